@@ -10,6 +10,14 @@
 #include <signal.h>
 #include <time.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define WHITESPACE " \t\n"          // We want to split our command line up into tokens
                                     // so we need to define what delimits our tokens.
@@ -20,46 +28,355 @@
 
 #define MAX_NUM_ARGUMENTS 5         // Mav shell only supports five arguments
 
-#define NUM_BLOCKS 4226             // Maximum number of blocks allocated
-#define BLOCK_SIZE 8192             // Maximum block size
-#define MAX_FILE_SIZE 10240000      // Maximum file size
-#define MAX_FILE 125                // Maximum number of files/inodes
-#define MAX_BLOCKS_PER_FILE 1250    // Maxiumum blocks per file
-#define MAX_FILENAME 32             // Maximum filename length
+#define DEFAULT_NUM_BLOCKS 4096         // Default number of data blocks in a new image
+#define DEFAULT_BLOCK_SIZE 8192         // Default block size
+#define DEFAULT_NUM_INODES 126          // Default number of inodes (125 files plus the root)
+#define MIN_BLOCK_SIZE 512              // Smallest block size createfs accepts
+#define MAX_BLOCK_SIZE 1048576          // Largest block size createfs accepts
+#define MAX_NUM_BLOCKS (1ULL << 40)     // Upper bound on the block count createfs accepts
+#define MAX_NUM_INODES (1ULL << 32)     // Upper bound on the inode count createfs accepts
+#define MAX_FILENAME 32                 // Maximum filename length
+#define MAX_SNAPSHOTS 64                // Maximum number of snapshots an image keeps
+
+#define IMAGE_MAGIC "MFSIMAGE"          // Identifies a file system image in its header
+#define IMAGE_COMPRESS 1                // Feature flag: compress blocks as they are stored
+#define IMAGE_DEDUP 2                   // Feature flag: share blocks with identical contents
+#define IMAGE_PLACEMENT 4               // Feature flag: place blocks by how often files are read
+#define IMAGE_VERSION 9                 // Version of the on-disk layout
+
+// size of a directory entry record in the directory region:
+// name (null terminated), valid, h and r flags, then the inode index and parent directory
+#define DIRECTORY_RECORD_SIZE (MAX_FILENAME + 1 + 3 * sizeof(uint8_t) + 2 * sizeof(int64_t))
+
+#define ROOT_INODE 0                    // Inode of the root directory
+#define TYPE_FILE 0                     // Inode holds a regular file
+#define TYPE_DIRECTORY 1                // Inode holds a directory
+
+#define MAX_INLINE_SIZE 256             // Files up to this size are stored in their inode
+#define INODE_INLINE 1                  // Inode flag: the file's data is in the inode record
+#define INODE_RECORD_SIZE 64            // Bytes per record of the inode region, block maps are kept apart
+#define MIN_MAP_ENTRIES (MAX_INLINE_SIZE / sizeof(int64_t)) // Block map a new inode starts with
+
+// a short last block is packed with the tails of other files into a shared block, split
+// into FRAGS_PER_BLOCK fragments. Its block map entry then records the shared block along
+// with the first fragment and the fragment count: PACKED_ENTRY | block << 8 | start << 4 | count - 1
+#define FRAGS_PER_BLOCK 16
+#define PACKED_ENTRY (1LL << 62)
+
+// a compressed block is packed into fragments the same way, as a 4 byte length followed
+// by the compressed data. Its entry is a packed entry with COMPRESSED_ENTRY set as well
+#define COMPRESSED_ENTRY (1LL << 61)
+
+#define LZ_HASH_BITS 12                 // Match finder table of the block codec
+#define LZ_MIN_MATCH 4                  // Shortest match the block codec encodes
+#define LZ_MAX_OFFSET 65535             // Furthest back a match can reach
+#define COMPRESS_BATCH 64               // Blocks put reads and compresses at a time
+#define MAX_COMPRESS_THREADS 8          // Upper bound on threads compressing a batch
+
+#define CRC32C_POLY 0x82F63B78          // Castagnoli polynomial, bit reversed
+#define NUM_REGIONS 8                   // Regions of the image with a checksum of their own
+#define MAX_SCRUB_THREADS 16            // Upper bound on threads scrub reads blocks with
+#define DEFAULT_SCRUB_RATE 256          // MB per second scrub reads at unless told otherwise
+#define MAX_FSCK_THREADS 16             // Upper bound on threads fsck checks with
+#define LOST_AND_FOUND "lost+found"     // Directory fsck moves orphaned files into
+#define DEFRAG_STEP_MS 50               // Milliseconds a defrag step moves blocks for by default
+#define HEAT_HALF_LIFE 86400            // Seconds after which the reads of a file count half as much
+#define HISTOGRAM_SUB_BITS 4            // Latency buckets per power of two, as bits (within 6.25%)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define TRACE_EVENTS 65536              // Events the trace ring buffer keeps, a power of two
+#define RECORD_HEADER "# mfs workload v1" // First line of a workload recording
+
+// fsck marks each fragment with a code for the entry using it: 0 for none, WHOLE_BLOCK_CODE
+// for a block of its own, PACKED_CODE with the compressed bit, start and count for fragments
+#define WHOLE_BLOCK_CODE 0x400
+#define PACKED_CODE 0x200
+
+// block map entry of an all-zero block that was never stored, reads back as zeros
+// (-1 still ends the block map)
+#define HOLE_ENTRY -2
+
+#define INITIAL_INDEX_CAPACITY 8        // Slots in a new directory's name index
+#define EMPTY_SLOT -1                   // Index slot never used
+#define DELETED_SLOT -2                 // Index slot whose entry was removed
+
+#define DEFAULT_SERVER_THREADS 4    // Number of worker threads mfsd starts with
+#define MAX_SERVER_THREADS 64       // Upper bound on worker threads for mfsd
+#define NUM_INODE_LOCKS 1024        // Number of striped per-file locks in mfsd
+
+// geometry of an image, chosen at createfs time and recorded in the header (block 0)
+// the data region follows the header and the metadata regions follow the data region,
+// each starting on a block boundary and sized from the geometry
+struct fs_geometry {
+    char magic[8];
+    uint64_t version;
+    uint64_t block_size;            // bytes per block
+    uint64_t num_blocks;            // number of data blocks
+    uint64_t num_inodes;            // number of inodes, and so of files
+    uint64_t max_file_size;         // largest file, as many bytes as the data region holds
+    uint64_t inode_size;            // bytes per inode record in the inode region
+    uint64_t data_start;            // first block of the data region
+    uint64_t dir_start;             // first block and length of the directory region
+    uint64_t dir_blocks;
+    uint64_t inode_map_start;       // first block and length of the free inode map
+    uint64_t inode_map_blocks;
+    uint64_t block_map_start;       // first block and length of the free block map
+    uint64_t block_map_blocks;
+    uint64_t inode_start;           // first block and length of the inode region
+    uint64_t inode_blocks;
+    uint64_t dedup_start;           // first block and length of the fingerprint index
+    uint64_t dedup_blocks;
+    uint64_t checksum_start;        // first block and length of the checksums, one per data
+    uint64_t checksum_blocks;       // block followed by one per region
+    uint64_t map_start;             // first block of the block maps of the inodes in use, then
+                                    // the snapshots, which together run to the end
+    uint64_t features;              // IMAGE_COMPRESS, IMAGE_DEDUP and IMAGE_PLACEMENT, changed with set
+    uint64_t num_snapshots;         // snapshots stored after the fingerprint index
+};
+struct fs_geometry geometry;
+
+// array used to store files in blocks, indexed by data block number
+// blocks are loaded from the image file on first use, NULL until then
+void **data_blocks;
+
+// blocks changed since the image was last saved
+uint8_t *dirty_block_map;
+
+// CRC32C of every data block as it was last saved, checked when a block is loaded
+uint32_t *block_checksums;
+
+// blocks whose data didn't match their checksum when loaded from the image file
+uint8_t *corrupt_block_map;
+
+// zeros that holes in files read back as, never written
+char zero_block[MAX_BLOCK_SIZE];
+
+// bytes run through the block codec and the nanoseconds it took since the program started,
+// updated atomically since put compresses on several threads and mfsd reads concurrently
+uint64_t compress_bytes, compress_ns;
+uint64_t decompress_bytes, decompress_ns;
+
+// latency histogram, log-linear like HDR histograms: values below 2^HISTOGRAM_SUB_BITS get
+// a bucket each, above that every power of two is split into 2^HISTOGRAM_SUB_BITS buckets.
+// Updated with relaxed atomics so mfsd workers never wait on each other to record
+struct histogram {
+    uint64_t count;
+    uint64_t sum;                   // nanoseconds
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+// internal phases that are timed, the commands follow them in the same histogram array
+enum phase_stat {
+    STAT_DIR_SEARCH,                // resolving a new name and finding a free directory entry
+    STAT_INODE_ALLOC,               // find_free_inode
+    STAT_ALLOC,                     // find_free_block
+    STAT_PUT_READ,                  // put reading a batch from its input
+    STAT_PUT_COMPRESS,              // put compressing a batch
+    STAT_PUT_STORE,                 // put storing a batch into blocks
+    STAT_GET_WRITE,                 // get writing a block to its output
+    STAT_BLOCK_LOAD,                // a block read from the image file on first use
+    STAT_SAVEFS_BLOCKS,             // savefs writing the changed blocks
+    STAT_SAVEFS_METADATA,           // savefs serializing the metadata regions
+    STAT_OPEN_METADATA,             // open checking and reading the metadata regions
+    NUM_PHASE_STATS
+};
+const char *phase_names[NUM_PHASE_STATS] = {
+    "dir.search", "inode.alloc", "alloc", "put.read", "put.compress", "put.store", "get.write", "block.load", "savefs.blocks",
+    "savefs.metadata", "open.metadata"
+};
+const char *command_names[] = {
+    "createfs", "open", "close", "savefs", "put", "get", "write", "del", "clone", "list", "df",
+    "attrib", "mkdir", "rmdir", "cd", "attach", "detach", "switch", "copy", "move", "snapshot",
+    "scrub", "fsck", "defrag", "resize", "set", "stats", "trace", "record"
+};
+#define NUM_COMMAND_STATS (sizeof(command_names) / sizeof(command_names[0]))
+struct histogram histograms[NUM_PHASE_STATS + NUM_COMMAND_STATS];
+
+// event counters, atomic like the histograms
+enum counter_stat {
+    COUNT_BLOCKS_CLAIMED, COUNT_BLOCKS_RELEASED, COUNT_BLOCKS_LOADED, COUNT_BLOCKS_WRITTEN,
+    COUNT_BYTES_PUT, COUNT_BYTES_GOT, NUM_COUNTER_STATS
+};
+const char *counter_names[NUM_COUNTER_STATS] = {
+    "blocks_claimed", "blocks_released", "blocks_loaded", "blocks_written", "bytes_put", "bytes_got"
+};
+uint64_t counters[NUM_COUNTER_STATS];
+
+// file the stats are appended to every stats_dump_interval seconds, by a thread of its own
+char *stats_dump_path = NULL;
+uint64_t stats_dump_interval;
+pthread_t stats_dump_thread;
+pthread_mutex_t stats_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stats_dump_cond = PTHREAD_COND_INITIALIZER;
+// held while the dump thread is stopped and started, mfsd workers may do both at once
+pthread_mutex_t stats_dump_control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a timed command or phase as a trace event, with when it began and how long it took
+struct trace_event {
+    uint64_t seq;                   // index the event was written at plus one, 0 while written
+    uint64_t start_ns;              // since the trace was turned on
+    uint64_t duration_ns;
+    uint32_t stat;                  // histogram the event was also recorded in
+    uint32_t thread;
+};
 
-// array used to store files in blocks
-// NOTE: actual data blocks start at index 130
-void *data_blocks[NUM_BLOCKS];
+// ring buffer the events go into while tracing is on, the newest TRACE_EVENTS are kept.
+// Writers claim a slot by bumping trace_next, so recording never takes a lock
+struct trace_event *trace_ring = NULL;
+uint64_t trace_next;
+int tracing = 0;
+struct timespec trace_epoch;
+
+// workload recording of the commands typed at the REPL, with when it started. Each line
+// is "<microseconds> <host file size> <command line>"
+FILE *record_fp = NULL;
+struct timespec record_epoch;
+
+// small per-thread number the events are tagged with, 0 until the thread first records
+uint32_t trace_threads;
+__thread uint32_t trace_thread = 0;
+
+// fragments in use in each block holding packed tails and compressed blocks, one bit per
+// fragment, 0 for blocks that don't hold fragments. Rebuilt from the inodes on open
+uint16_t *fragment_map;
+
+// block map entries referenced by more than one file, with the number of references
+// beyond the first. Entries not in it have a single reference. Rebuilt from the inodes
+// on open
+struct share_table {
+    uint64_t count;                 // entries in the table
+    uint64_t used;                  // slots holding an entry or a deleted marker
+    uint64_t capacity;              // number of slots, a power of two
+    int64_t *entries;               // block map entries, EMPTY_SLOT or DELETED_SLOT
+    uint32_t *refs;                 // extra references of each entry
+};
+struct share_table shared_entries;
+
+// fingerprint index of the dedup mode, a direct mapped table of num_blocks slots from the
+// fingerprint of a full block's contents to the entry holding them. It is only a hint,
+// a slot is checked against the stored data before the entry is shared. NULL while dedup
+// is off
+struct fingerprint_slot {
+    uint64_t fingerprint;
+    int64_t entry;                  // -1 for an empty slot
+};
+struct fingerprint_slot *fingerprint_index;
 
-// free inodes array 
+// free inodes array
 uint8_t *free_inode_map;
 
-// free blocks array 
+// free blocks array
 uint8_t *free_block_map;
 
 // entry struct used to store directory file data
 struct directory_entry {
     char *name;
     int valid;
-    int inode_idx;
+    int64_t inode_idx;
+    int64_t parent;                 // inode of the directory the entry is in
     int h;
     int r;
 };
 struct directory_entry *directory_array_ptr;
 
+// open addressing hash table from names to directory entries, one per directory
+// so lookups only touch the entries of the directory being searched
+struct directory_index {
+    uint64_t count;                 // entries in the directory
+    uint64_t used;                  // slots holding an entry or a deleted marker
+    uint64_t capacity;              // number of slots, a power of two
+    int64_t *slots;                 // directory entry indices, EMPTY_SLOT or DELETED_SLOT
+};
+
 // entry struct for inode data
 struct inode {
     time_t date;
-    int size;
+    uint64_t size;
     int valid;
-    int blocks[MAX_BLOCKS_PER_FILE];
+    int type;                       // TYPE_FILE or TYPE_DIRECTORY
+    int flags;                      // INODE_INLINE
+    int64_t parent;                 // inode of the directory the inode is in
+    struct directory_index *index;  // name index of a directory, built in memory
+    uint64_t reads;                 // gets and ranged reads of the file, for block placement
+    time_t last_read;               // when the file was last read, 0 if never
+    uint64_t capacity;              // entries the block map has room for, grown as the file
+                                    // grows
+    int64_t *blocks;                // block map ended by -1, or the file's data itself for an
+                                    // inline file
+};
+struct inode **inode_array_ptr;
+
+// point in time copy of the image's metadata. Its inodes hold a reference to every entry
+// they use, so the blocks stay as they were while the live files are changed or deleted.
+// Stored after the block maps of the live inodes as the name, the date, the directory
+// records, the free inode map and then the record and block map of each inode in use
+struct snapshot {
+    char name[MAX_FILENAME + 1];
+    time_t date;
+    struct directory_entry *directory;  // geometry.num_inodes entries
+    uint8_t *free_inode_map;
+    struct inode **inodes;              // NULL for inodes not in use
 };
-struct inode *inode_array_ptr[MAX_FILE];
+struct snapshot *snapshots;             // geometry.num_snapshots of them
 
 // keep track if a file system image is opened or not
 int opened = 0;
 char *opened_image = NULL;
 
+// image file the opened image was loaded from, data blocks are read from it lazily
+// and written back to it in place by savefs
+FILE *backing_fp = NULL;
+
+// inode of the current working directory of the shell
+int64_t cwd_inode = ROOT_INODE;
+
+// state of a loaded file system image, used to hold the image attached next to the
+// opened one so files can be copied or moved between the two without the host in between
+struct image_state {
+    struct fs_geometry geometry;
+    void **data_blocks;
+    uint8_t *dirty_block_map;
+    uint32_t *block_checksums;
+    uint8_t *corrupt_block_map;
+    uint16_t *fragment_map;
+    struct share_table shared_entries;
+    struct fingerprint_slot *fingerprint_index;
+    uint8_t *free_inode_map;
+    uint8_t *free_block_map;
+    struct directory_entry *directory_array_ptr;
+    struct inode **inode_array_ptr;
+    struct snapshot *snapshots;
+    int opened;
+    char *opened_image;
+    FILE *backing_fp;
+    int64_t cwd_inode;
+};
+struct image_state attached_image;
+
+// stream that command output and error messages are written to
+// stdout for the interactive shell, a per-request memory stream for mfsd workers
+__thread FILE *output_fp = NULL;
+
+// lock guarding the directory array, inode array and free maps in mfsd
+// readers (get, list, df) share it, writers (put, del, savefs) take it exclusively
+pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// striped per-file locks so concurrent readers of a file never block each other,
+// while del waits for in-flight reads of the file it is removing
+pthread_rwlock_t inode_locks[NUM_INODE_LOCKS];
+
+// serializes loading blocks from the image file, since readers share the image lock
+pthread_mutex_t block_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// seconds between the defrag steps a thread of its own takes in the background, 0 while
+// there is no such thread
+uint64_t defrag_interval = 0;
+pthread_t defrag_thread;
+pthread_mutex_t defrag_auto_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t defrag_auto_cond = PTHREAD_COND_INITIALIZER;
+// held while the background defrag is stopped and started, mfsd workers may do both at once
+pthread_mutex_t defrag_auto_control_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
 // image struct that will store image data
 typedef struct file_system_image {
@@ -94,761 +411,6693 @@ void cleanup(char *arr[], int size, char *string) {
 }
 
 /*
-    Name: close_image()
-    Parameters: None
-    Return: Void
-    Description: closes opened image by freeing directory names and data blocks
+    Name: inode_lock
+    Parameters: index of an entry in the inode array
+    Return: pointer to a rwlock
+    Description: returns the striped lock that guards the inode's data in mfsd
 */
-void close_image() {
-    // free directory file names
-    for (int i = 0; i < MAX_FILE; i++) {
-        free(directory_array_ptr[i].name);
-    }
+pthread_rwlock_t *inode_lock(int64_t inode_idx) {
+    return &inode_locks[inode_idx % NUM_INODE_LOCKS];
+}
 
-    // free data blocks
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        free(data_blocks[i]);
+/*
+    Name: blocks_for
+    Parameters: number of bytes
+    Return: uint64_t
+    Description: number of blocks of the current block size needed to hold the bytes
+*/
+uint64_t blocks_for(uint64_t bytes) {
+    return (bytes + geometry.block_size - 1) / geometry.block_size;
+}
+
+/*
+    Name: set_geometry
+    Parameters: block size, number of data blocks and number of inodes
+    Return: int
+    Description: validates the geometry and computes the image layout from it into the
+    geometry global, returns 0 on success and -1 if the geometry is invalid
+*/
+int set_geometry(uint64_t block_size, uint64_t num_blocks, uint64_t num_inodes) {
+    // block size must be a power of two within range, counts must be non zero and bounded
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        return -1;
+    }
+    if (num_blocks == 0 || num_blocks > MAX_NUM_BLOCKS) {
+        return -1;
+    }
+    if (num_inodes == 0 || num_inodes > MAX_NUM_INODES) {
+        return -1;
     }
 
-    // freeing data, so image is closed
-    opened = 0;
+    memset(&geometry, 0, sizeof(geometry));
+    memcpy(geometry.magic, IMAGE_MAGIC, sizeof(geometry.magic));
+    geometry.version = IMAGE_VERSION;
+    geometry.block_size = block_size;
+    geometry.num_blocks = num_blocks;
+    geometry.num_inodes = num_inodes;
+
+    // block maps grow with their files, so a file is only limited by the size of the data
+    // region. Sparse files included, a file can't have more blocks than the image
+    geometry.max_file_size = num_blocks * block_size;
+    geometry.inode_size = INODE_RECORD_SIZE;
+
+    // header in block 0, data right after it, then each metadata region
+    geometry.data_start = 1;
+    geometry.dir_start = geometry.data_start + num_blocks;
+    geometry.dir_blocks = blocks_for(num_inodes * DIRECTORY_RECORD_SIZE);
+    geometry.inode_map_start = geometry.dir_start + geometry.dir_blocks;
+    geometry.inode_map_blocks = blocks_for(num_inodes);
+    geometry.block_map_start = geometry.inode_map_start + geometry.inode_map_blocks;
+    geometry.block_map_blocks = blocks_for(num_blocks);
+    geometry.inode_start = geometry.block_map_start + geometry.block_map_blocks;
+    geometry.inode_blocks = blocks_for(num_inodes * geometry.inode_size);
+    geometry.dedup_start = geometry.inode_start + geometry.inode_blocks;
+    geometry.dedup_blocks = blocks_for(num_blocks * sizeof(struct fingerprint_slot));
+    geometry.checksum_start = geometry.dedup_start + geometry.dedup_blocks;
+    geometry.checksum_blocks = blocks_for((num_blocks + NUM_REGIONS) * sizeof(uint32_t));
+    geometry.map_start = geometry.checksum_start + geometry.checksum_blocks;
+
+    return 0;
 }
 
 /*
-    Name: init
-    Parameters: None
+    Name: clear_block_map
+    Parameters: inode
     Return: void
-    Description: sets up new file system image that is empty
+    Description: empties the inode's block map and shrinks it back to the room an inline file
+    needs, the block map grows with the file from there
 */
-void init() {
-    // if file image already opened, do cleanup before initializing new one
-    if (opened) {
-        close_image();
-    }
-
-    // allocate memory for data blocks and clear them
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        data_blocks[i] = calloc(BLOCK_SIZE, sizeof(char));
-    }
+void clear_block_map(struct inode *inode) {
+    uint64_t capacity = MIN_MAP_ENTRIES;
 
-    // store directores in block 0 (enough space that block 1 isn't used)
-    directory_array_ptr = (struct directory_entry *) data_blocks[0];
-    for (int i = 0; i < MAX_FILE; i++) {
-        directory_array_ptr[i].name = NULL;
-        directory_array_ptr[i].valid = 0;
-        directory_array_ptr[i].inode_idx = -1;
-        directory_array_ptr[i].h = 0;
-        directory_array_ptr[i].r = 0;
+    if (inode->capacity != capacity) {
+        inode->blocks = realloc(inode->blocks, capacity * sizeof(int64_t));
+        inode->capacity = capacity;
     }
-
-    // store inodes in blocks 5-129
-    for (int i = 5; i < MAX_FILE + 5; i++) {
-        inode_array_ptr[i - 5] = (struct inode *) data_blocks[i];
-        inode_array_ptr[i - 5]->date = 0;
-        inode_array_ptr[i - 5]->size = 0;
-        inode_array_ptr[i - 5]->valid = 0;
-        // set all blocks of each inode to invalid index
-        for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++) {
-            inode_array_ptr[i - 5]->blocks[j] = -1;
-        }
+    for (uint64_t i = 0; i < capacity; i++) {
+        inode->blocks[i] = -1;
     }
+}
 
-    // store free inode map in block 2
-    free_inode_map = (uint8_t *) data_blocks[2];
-    for (int i = 0; i < MAX_FILE; i++) {
-        free_inode_map[i] == 0;
-    }
+/*
+    Name: new_inode
+    Parameters: None
+    Return: pointer to the inode
+    Description: allocates an empty file inode with the smallest block map
+*/
+struct inode *new_inode() {
+    struct inode *inode = calloc(1, sizeof(struct inode));
 
-    // store free block map in block 3
-    free_block_map = (uint8_t *) data_blocks[3];
-    for (int i = 0; i < NUM_BLOCKS - 130; i++) {
-        free_block_map[i] == 0;
-    }
+    clear_block_map(inode);
+    inode->type = TYPE_FILE;
+    inode->parent = -1;
 
-    // new image created, so set open to true
-    opened = 1;
+    return inode;
 }
 
 /*
-    Name: savefs
-    Parameters: file pointer to file being written into
+    Name: free_inode
+    Parameters: pointer to an inode or NULL
     Return: void
-    Description: save contents of file system image into the file specified
-*/
-void savefs(FILE *fp) {
-    // save contents of directory block into file
-    for (int i = 0; i < MAX_FILE; i++) {
-        // save names of files on image into file
-        if (directory_array_ptr[i].name != NULL) {
-            // keep track of length of filename so we can read from it later
-            int len = strlen(directory_array_ptr[i].name);
-            fwrite(&len, sizeof(int), 1, fp);
-            fwrite(directory_array_ptr[i].name, sizeof(char), len, fp);
-        }
-        // no file name at directory index
-        else {
-            // write 0 into file to indicate no filename to be read later
-            int len = 0;
-            fwrite(&len, sizeof(int), 1, fp);
-        }
-
-        // then save remaining fields
-        fwrite(&(directory_array_ptr[i].valid), sizeof(int), 1, fp);
-        fwrite(&(directory_array_ptr[i].inode_idx), sizeof(int), 1, fp);
-        fwrite(&(directory_array_ptr[i].h), sizeof(int), 1, fp);
-        fwrite(&(directory_array_ptr[i].r), sizeof(int), 1, fp);
+    Description: frees the inode along with its block map, the name index is left to the caller
+*/
+void free_inode(struct inode *inode) {
+    if (inode) {
+        free(inode->blocks);
     }
+    free(inode);
+}
 
-    // save contents of free inode map into file
-    fwrite(free_inode_map, sizeof(uint8_t), MAX_FILE, fp);
+/*
+    Name: reserve_blocks
+    Parameters: inode and number of block map entries it needs
+    Return: void
+    Description: grows the block map so it holds the entries and the -1 ending it. New entries
+    are -1 and the map at least doubles, so a file stored one block at a time is copied only a
+    few times
+*/
+void reserve_blocks(struct inode *inode, uint64_t count) {
+    uint64_t needed = count + 1;
+    if (needed <= inode->capacity) {
+        return;
+    }
 
-    // save contents of free block map into file
-    fwrite(free_block_map, sizeof(uint8_t), NUM_BLOCKS - 130, fp);
+    uint64_t capacity = inode->capacity * 2 > needed ? inode->capacity * 2 : needed;
 
-    // save contents of inode blocks into file
-    for (int i = 0; i < MAX_FILE; i++) {
-        fwrite(&(inode_array_ptr[i]->date), sizeof(time_t), 1, fp);
-        fwrite(&(inode_array_ptr[i]->size), sizeof(int), 1, fp);
-        fwrite(&(inode_array_ptr[i]->valid), sizeof(int), 1, fp);
-        // also save contents of block array for each inode
-        fwrite(inode_array_ptr[i]->blocks, sizeof(int), MAX_BLOCKS_PER_FILE, fp);
+    inode->blocks = realloc(inode->blocks, capacity * sizeof(int64_t));
+    for (uint64_t i = inode->capacity; i < capacity; i++) {
+        inode->blocks[i] = -1;
     }
+    inode->capacity = capacity;
+}
 
-    // save contents of data blocks into file
-    for (int i = 130; i < NUM_BLOCKS; i++) {
-        fwrite(data_blocks[i], BLOCK_SIZE, 1, fp);
+/*
+    Name: copy_block_map
+    Parameters: inode to copy into and inode to copy from
+    Return: void
+    Description: replaces the block map (or inline data) of one inode with a copy of another's
+*/
+void copy_block_map(struct inode *dst, struct inode *src) {
+    if (dst->capacity != src->capacity) {
+        dst->blocks = realloc(dst->blocks, src->capacity * sizeof(int64_t));
+        dst->capacity = src->capacity;
     }
+    memcpy(dst->blocks, src->blocks, src->capacity * sizeof(int64_t));
 }
 
 /*
-    Name: open
-    Parameters: file pointer to file being read from
+    Name: free_snapshot
+    Parameters: pointer to a snapshot
     Return: void
-    Description: read contents of file and save it into the image
+    Description: frees the snapshot's copies of the directory and inodes, the blocks they
+    reference are left alone
 */
-void open(FILE *fp) {
-    // read directories and save into directory pointer array
-    for (int i = 0; i < MAX_FILE; i++) {
-        // read length of filename
-        int len;
-        fread(&len, sizeof(int), 1, fp);
-
-        // if len > 0, allocate space for filename and read into it
-        if (len) {
-            directory_array_ptr[i].name = malloc(sizeof(char) * len);
-            fread(directory_array_ptr[i].name, sizeof(char), len, fp);
-        }
-        // if len == 0, no filename to read, so set name to NULL
-        else {
-            directory_array_ptr[i].name = NULL;
-        }
-
-        // then read remaining fields
-        fread(&(directory_array_ptr[i].valid), sizeof(int), 1, fp);
-        fread(&(directory_array_ptr[i].inode_idx), sizeof(int), 1, fp);
-        fread(&(directory_array_ptr[i].h), sizeof(int), 1, fp);
-        fread(&(directory_array_ptr[i].r), sizeof(int), 1, fp);
+void free_snapshot(struct snapshot *snapshot) {
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        free(snapshot->directory[i].name);
+        free_inode(snapshot->inodes[i]);
     }
 
-    // read free inode map values from file
-    fread(free_inode_map, sizeof(uint8_t), MAX_FILE, fp);
+    free(snapshot->directory);
+    free(snapshot->free_inode_map);
+    free(snapshot->inodes);
+}
 
-    // read free block map values from file
-    fread(free_block_map, sizeof(uint8_t), NUM_BLOCKS - 130, fp);
+/*
+    Name: close_image()
+    Parameters: None
+    Return: Void
+    Description: closes opened image by freeing directory names, inodes and data blocks
+*/
+void close_image() {
+    // free directory file names, inodes and directory indexes
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        free(directory_array_ptr[i].name);
+        if (inode_array_ptr[i] && inode_array_ptr[i]->index) {
+            free(inode_array_ptr[i]->index->slots);
+            free(inode_array_ptr[i]->index);
+        }
+        free_inode(inode_array_ptr[i]);
+    }
 
-    // read inodes and save into inode array pointer
-    for (int i = 0; i < MAX_FILE; i++) {
-        fread(&(inode_array_ptr[i]->date), sizeof(time_t), 1, fp);
-        fread(&(inode_array_ptr[i]->size), sizeof(int), 1, fp);
-        fread(&(inode_array_ptr[i]->valid), sizeof(int), 1, fp);
-        // also read contents of blocks array for each inode
-        fread(inode_array_ptr[i]->blocks, sizeof(int), MAX_BLOCKS_PER_FILE, fp);
+    // free data blocks
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        free(data_blocks[i]);
     }
 
-    // read contents of data blocks into the corresponding data blocks
-    for (int i = 130; i < NUM_BLOCKS; i++) {
-        fread(data_blocks[i], BLOCK_SIZE, 1, fp);
+    // free the snapshots' copies of the metadata
+    for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+        free_snapshot(&snapshots[i]);
     }
+    free(snapshots);
+    snapshots = NULL;
+
+    free(directory_array_ptr);
+    free(inode_array_ptr);
+    free(data_blocks);
+    free(dirty_block_map);
+    free(block_checksums);
+    free(corrupt_block_map);
+    free(fragment_map);
+    free(shared_entries.entries);
+    free(shared_entries.refs);
+    free(fingerprint_index);
+    memset(&shared_entries, 0, sizeof(shared_entries));
+    fingerprint_index = NULL;
+    free(free_inode_map);
+    free(free_block_map);
+
+    // nothing left to load from the image file
+    if (backing_fp) {
+        fclose(backing_fp);
+        backing_fp = NULL;
+    }
+
+    // freeing data, so image is closed
+    opened = 0;
 }
 
 /*
-    Name: df
-    Parameters: None
-    Return: int
-    Description: iterates over free block list and gets size of free blocks
+    Name: exchange_image
+    Parameters: image state to exchange with
+    Return: void
+    Description: exchanges the opened image with the one kept in the state, so every image
+    function operates on the other image until exchanged back
 */
-int df() {
-    // keep count of number of free blocks
-    int count = 0;
-    
-    for (int i = 0; i < NUM_BLOCKS - 130; i++) {
-        // increment count if a block is not in use
-        if (free_block_map[i] == 0) {
-            count++;
-        }
-    }
+void exchange_image(struct image_state *other) {
+    struct image_state tmp = {
+        geometry, data_blocks, dirty_block_map, block_checksums, corrupt_block_map, fragment_map,
+        shared_entries, fingerprint_index,
+        free_inode_map, free_block_map,
+        directory_array_ptr, inode_array_ptr, snapshots, opened, opened_image, backing_fp, cwd_inode
+    };
+
+    geometry = other->geometry;
+    data_blocks = other->data_blocks;
+    dirty_block_map = other->dirty_block_map;
+    block_checksums = other->block_checksums;
+    corrupt_block_map = other->corrupt_block_map;
+    fragment_map = other->fragment_map;
+    shared_entries = other->shared_entries;
+    fingerprint_index = other->fingerprint_index;
+    free_inode_map = other->free_inode_map;
+    free_block_map = other->free_block_map;
+    directory_array_ptr = other->directory_array_ptr;
+    inode_array_ptr = other->inode_array_ptr;
+    snapshots = other->snapshots;
+    opened = other->opened;
+    opened_image = other->opened_image;
+    backing_fp = other->backing_fp;
+    cwd_inode = other->cwd_inode;
+
+    *other = tmp;
+}
 
-    // to get bytes free, multiply count of free blocks by block size
-    return count * BLOCK_SIZE;
+/*
+    Name: swap_images
+    Parameters: None
+    Return: void
+    Description: exchanges the opened image with the attached one, so every image function
+    operates on the other image until swapped back
+*/
+void swap_images() {
+    exchange_image(&attached_image);
 }
 
 /*
-    Name: find_free_directory_entry
-    Parameters: none
-    Return: int
-    Description: searches directory array for first free entry
+    Name: alloc_inode
+    Parameters: index of an entry in the inode array
+    Return: pointer to the inode
+    Description: allocates the inode if it was never used and resets it to an empty file
 */
-int find_free_directory_entry() {
-    int retval = -1;
+struct inode *alloc_inode(int64_t inode_idx) {
+    if (!inode_array_ptr[inode_idx]) {
+        inode_array_ptr[inode_idx] = new_inode();
+    }
 
-    // search directory array for a free entry
-    for (int i = 0; i < MAX_FILE; i++) {
-        // get i value of first free entry
-        if (directory_array_ptr[i].valid == 0) {
-            retval = i;
-            break;
-        }
+    struct inode *inode = inode_array_ptr[inode_idx];
+    inode->date = 0;
+    inode->size = 0;
+    inode->valid = 0;
+    inode->type = TYPE_FILE;
+    inode->flags = 0;
+    inode->parent = -1;
+    inode->reads = 0;
+    inode->last_read = 0;
+
+    // a directory's name index goes away with it
+    if (inode->index) {
+        free(inode->index->slots);
+        free(inode->index);
     }
+    inode->index = NULL;
 
-    return retval;
+    // a reused inode gives back the block map its last file grew
+    clear_block_map(inode);
+
+    return inode;
 }
 
 /*
-    Name: find_free_inode
-    Parameters: none
-    Return: int
-    Description: searches inode array for first free entry
+    Name: hash_name
+    Parameters: string
+    Return: uint64_t
+    Description: FNV-1a hash of a filename, used to place it in a directory index
 */
-int find_free_inode() {
-    int retval = -1;
+uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
 
-    // search inode array for a free entry
-    for (int i = 0; i < MAX_FILE; i++) {
-        // get i value of first free entry
-        if (inode_array_ptr[i]->valid == 0) {
-            retval = i;
-            break;
-        }
+    for (; *name; name++) {
+        hash ^= (uint8_t) *name;
+        hash *= 1099511628211ULL;
     }
 
-    return retval;
+    return hash;
 }
 
 /*
-    Name: find_free_block
-    Parameters: none
-    Return: int
-    Description: searches free block map for first free entry
+    Name: new_directory_index
+    Parameters: None
+    Return: pointer to a directory index
+    Description: allocates an empty directory index
 */
-int find_free_block() {
-    int retval = -1;
-
-    // search free block map for a free entry
-    for (int i = 0; i < NUM_BLOCKS - 130; i++) {
-        // get i value of first free entry
-        if (free_block_map[i] == 0) {
-            retval = i;
-            break;
-        }
+struct directory_index *new_directory_index() {
+    struct directory_index *index = malloc(sizeof(struct directory_index));
+
+    index->count = 0;
+    index->used = 0;
+    index->capacity = INITIAL_INDEX_CAPACITY;
+    index->slots = malloc(index->capacity * sizeof(int64_t));
+    for (uint64_t i = 0; i < index->capacity; i++) {
+        index->slots[i] = EMPTY_SLOT;
     }
 
-    // return the index in the map + 130 to get the index in data_blocks
-    return retval + 130;
+    return index;
 }
 
 /*
-    Name: find_free_inode_block_entry
-    Parameters: index of an entry in the inode array
-    Return: int
-    Description: searches blocks array in an inode for the first free entry
+    Name: index_slot
+    Parameters: directory index and filename
+    Return: int64_t
+    Description: probes the index for the entry with the given name, returns the slot it
+    is in or -1 if the directory has no such entry
 */
-int find_free_inode_block_entry(int inode_idx) {
-    int retval = -1;
-
-    // search the blocks array in the inode pointed to by the index for a free entry
-    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
-        // get i value of first free entry
-        if (inode_array_ptr[inode_idx]->blocks[i] == -1) {
-            retval = i;
-            break;
+int64_t index_slot(struct directory_index *index, char *name) {
+    uint64_t mask = index->capacity - 1;
+
+    // linear probing, an empty slot ends the probe sequence
+    for (uint64_t i = hash_name(name) & mask; index->slots[i] != EMPTY_SLOT; i = (i + 1) & mask) {
+        int64_t dir_idx = index->slots[i];
+        if (dir_idx != DELETED_SLOT && !strcmp(directory_array_ptr[dir_idx].name, name)) {
+            return i;
         }
     }
 
-    return retval;
+    return -1;
 }
 
 /*
-    Name: put
-    Parameters: filename of file being put into image
+    Name: index_insert
+    Parameters: directory index and index of a directory entry
     Return: void
-    Description: will open file and try to read the file into file image system
+    Description: adds the directory entry to the index, growing it as needed
 */
-void put(char *filename) {
-    // create stat struct and try reading file into it
-    struct stat buf;
-    int status = stat(filename, &buf);
+void index_insert(struct directory_index *index, int64_t dir_idx) {
+    // keep at most three quarters of the slots used (deleted markers included),
+    // rebuilding into a table twice the size of the live entries when it fills up
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        uint64_t old_capacity = index->capacity;
+        int64_t *old_slots = index->slots;
+
+        uint64_t capacity = INITIAL_INDEX_CAPACITY;
+        while ((index->count + 1) * 4 > capacity * 2) {
+            capacity *= 2;
+        }
 
-    // if invalid name entered, print error message
-    if (status == -1) {
-        printf("put error: File not found\n");
-        return;
-    }
+        index->capacity = capacity;
+        index->used = 0;
+        index->count = 0;
+        index->slots = malloc(capacity * sizeof(int64_t));
+        for (uint64_t i = 0; i < capacity; i++) {
+            index->slots[i] = EMPTY_SLOT;
+        }
 
-    // check if file size is greater than amount of free space on image
-    if (buf.st_size > df()) {
-        printf("put error: Not enough disk space\n");
-        return;
+        for (uint64_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i] >= 0) {
+                index_insert(index, old_slots[i]);
+            }
+        }
+        free(old_slots);
     }
 
-    // check if file size is greater than supported max file size
-    if (buf.st_size > MAX_FILE_SIZE) {
-        printf("put error: File size too big\n");
-        return;
+    // take the first empty or deleted slot along the probe sequence
+    uint64_t mask = index->capacity - 1;
+    uint64_t i = hash_name(directory_array_ptr[dir_idx].name) & mask;
+    while (index->slots[i] >= 0) {
+        i = (i + 1) & mask;
     }
 
-    // try to find a free directory entry
-    int dir_idx = find_free_directory_entry();
-
-    // if -1 returned, no space in directory array, so print error message
-    if (dir_idx == -1) {
-        printf("put error: Not enough disk space\n");
-        return;
+    if (index->slots[i] == EMPTY_SLOT) {
+        index->used++;
     }
+    index->slots[i] = dir_idx;
+    index->count++;
+}
 
-    // populate directory entry fields
-    directory_array_ptr[dir_idx].name = strdup(filename);
-    directory_array_ptr[dir_idx].valid = 1;
+/*
+    Name: index_remove
+    Parameters: directory index and filename
+    Return: void
+    Description: removes the entry with the given name from the index
+*/
+void index_remove(struct directory_index *index, char *name) {
+    int64_t slot = index_slot(index, name);
 
-    // try to find a free inode
-    int inode_idx = find_free_inode();
+    // leave a marker so probe sequences running through the slot keep going
+    if (slot != -1) {
+        index->slots[slot] = DELETED_SLOT;
+        index->count--;
+    }
+}
 
-    // if -1 returned, no inode available, so print error message
-    if (inode_idx == -1) {
-        printf("put error: Not enough disk space\n");
-        return;
+/*
+    Name: index_directories
+    Parameters: None
+    Return: void
+    Description: indexes every directory entry in the directory it belongs to, the indexes
+    of the directories must be empty (entries pointing at something that isn't a directory
+    can't be reached and are skipped)
+*/
+void index_directories() {
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        int64_t parent = directory_array_ptr[i].parent;
+        if (directory_array_ptr[i].valid && parent >= 0 && (uint64_t) parent < geometry.num_inodes &&
+            free_inode_map[parent] && inode_array_ptr[parent]->type == TYPE_DIRECTORY) {
+            index_insert(inode_array_ptr[parent]->index, i);
+        }
     }
+}
 
-    directory_array_ptr[dir_idx].inode_idx = inode_idx;
-    directory_array_ptr[dir_idx].h = 0;
-    directory_array_ptr[dir_idx].r = 0;
+/*
+    Name: make_directory_inode
+    Parameters: index of a free entry in the inode array and inode of the parent directory
+    Return: void
+    Description: turns the inode into an empty directory inside the parent directory
+*/
+void make_directory_inode(int64_t inode_idx, int64_t parent) {
+    struct inode *inode = alloc_inode(inode_idx);
 
-    // populate inode entry fields
-    inode_array_ptr[inode_idx]->date = time(NULL);
-    inode_array_ptr[inode_idx]->size = buf.st_size;
-    inode_array_ptr[inode_idx]->valid = 1;
+    inode->date = time(NULL);
+    inode->valid = 1;
+    inode->type = TYPE_DIRECTORY;
+    inode->parent = parent;
+    inode->index = new_directory_index();
 
-    // update free inode map
     free_inode_map[inode_idx] = 1;
+}
 
-    // open file now to read into data blocks
-    FILE *fp = fopen(filename, "r");
+/*
+    Name: init
+    Parameters: block size, number of data blocks and number of inodes of the new image
+    Return: int
+    Description: sets up new file system image that is empty, returns 0 on success, -1 if
+    the geometry is invalid and -2 if there isn't enough memory for it (the opened image is
+    left alone in both cases)
+*/
+int init(uint64_t block_size, uint64_t num_blocks, uint64_t num_inodes) {
+    // check the geometry before throwing away the opened image
+    struct fs_geometry old_geometry = geometry;
+    if (set_geometry(block_size, num_blocks, num_inodes) == -1) {
+        geometry = old_geometry;
+        return -1;
+    }
 
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int copy_size = buf.st_size;
+    // allocate the new image's arrays before throwing away the opened image too. Data
+    // blocks and inodes are allocated when first written or loaded
+    void **new_data_blocks = calloc(num_blocks, sizeof(void *));
+    uint8_t *new_dirty_block_map = calloc(num_blocks, sizeof(uint8_t));
+    uint32_t *new_block_checksums = calloc(num_blocks, sizeof(uint32_t));
+    uint8_t *new_corrupt_block_map = calloc(num_blocks, sizeof(uint8_t));
+    uint16_t *new_fragment_map = calloc(num_blocks, sizeof(uint16_t));
+    struct snapshot *new_snapshots = calloc(MAX_SNAPSHOTS, sizeof(struct snapshot));
+    struct directory_entry *new_directory = calloc(num_inodes, sizeof(struct directory_entry));
+    struct inode **new_inodes = calloc(num_inodes, sizeof(struct inode *));
+    uint8_t *new_free_inode_map = calloc(num_inodes, sizeof(uint8_t));
+    uint8_t *new_free_block_map = calloc(num_blocks, sizeof(uint8_t));
+    if (!new_data_blocks || !new_dirty_block_map || !new_block_checksums || !new_corrupt_block_map ||
+        !new_fragment_map || !new_snapshots || !new_directory || !new_inodes ||
+        !new_free_inode_map || !new_free_block_map) {
+        free(new_data_blocks);
+        free(new_dirty_block_map);
+        free(new_block_checksums);
+        free(new_corrupt_block_map);
+        free(new_fragment_map);
+        free(new_snapshots);
+        free(new_directory);
+        free(new_inodes);
+        free(new_free_inode_map);
+        free(new_free_block_map);
+        geometry = old_geometry;
+        return -2;
+    }
 
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int offset = 0;
+    // if file image already opened, do cleanup before initializing new one
+    if (opened) {
+        struct fs_geometry new_geometry = geometry;
+        geometry = old_geometry;
+        close_image();
+        geometry = new_geometry;
+    }
 
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while (copy_size >= BLOCK_SIZE) {
-        // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-        // memory pool. Why? We are simulating the way the file system stores file data in
-        // blocks of space on the disk. block_index will keep us pointing to the area of
-        // the area that we will read from or write to.
-        int block_idx = find_free_block();
+    data_blocks = new_data_blocks;
+    dirty_block_map = new_dirty_block_map;
+    block_checksums = new_block_checksums;
+    corrupt_block_map = new_corrupt_block_map;
+    fragment_map = new_fragment_map;
+    memset(&shared_entries, 0, sizeof(shared_entries));
+    fingerprint_index = NULL;
+    snapshots = new_snapshots;
+
+    // directory entries, all free
+    directory_array_ptr = new_directory;
+    for (uint64_t i = 0; i < num_inodes; i++) {
+        directory_array_ptr[i].name = NULL;
+        directory_array_ptr[i].valid = 0;
+        directory_array_ptr[i].inode_idx = -1;
+        directory_array_ptr[i].h = 0;
+        directory_array_ptr[i].r = 0;
+    }
 
-        // if -1 returned (never should), print error message and cleanup directory/inode entry
-        if (block_idx == -1) {
-            printf("put error: Not enough disk space\n");
+    // inodes are allocated when first used
+    inode_array_ptr = new_inodes;
 
-            free(directory_array_ptr[dir_idx].name);
-            directory_array_ptr[dir_idx].name = NULL;
-            directory_array_ptr[dir_idx].valid = 0;
-            directory_array_ptr[dir_idx].inode_idx = -1;
-            directory_array_ptr[dir_idx].h = 0;
-            directory_array_ptr[dir_idx].r = 0;
+    // free inode and block maps, everything free
+    free_inode_map = new_free_inode_map;
+    free_block_map = new_free_block_map;
 
-            inode_array_ptr[inode_idx]->date = 0;
-            inode_array_ptr[inode_idx]->size = 0;
-            inode_array_ptr[inode_idx]->valid = 0;
-            for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
-                inode_array_ptr[inode_idx]->blocks[i] = -1;
-            }
+    // the root directory is its own parent, the shell starts out in it
+    make_directory_inode(ROOT_INODE, ROOT_INODE);
+    cwd_inode = ROOT_INODE;
 
-            free_inode_map[inode_idx] = 1;
+    // new image created, so set open to true
+    opened = 1;
 
-            return;
-        } 
+    return 0;
+}
 
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-        fseek(fp, offset, SEEK_SET);
-    
-        // Read BLOCK_SIZE number of bytes from the input file and store them in our
-        // data array. 
-        int bytes = fread(data_blocks[block_idx], BLOCK_SIZE, 1, fp);
+// slicing-by-8 tables of the software CRC32C, filled in by crc32c_init
+uint32_t crc32c_table[8][256];
 
-        // After reading in data into the block, set that block in the free block map to in use
-        // index - 130 used to map from index in data_blocks to the index in the free map
-        free_block_map[block_idx - 130] = 1;
+/*
+    Name: crc32c_software
+    Parameters: CRC of the data before this piece, data and its length
+    Return: uint32_t
+    Description: CRC32C of the data, eight bytes at a time through the slicing tables
+    (the words are read little endian)
+*/
+uint32_t crc32c_software(uint32_t crc, const void *data, uint64_t length) {
+    const uint8_t *bytes = data;
+    crc = ~crc;
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+    }
 
-        // Also record the block used into the blocks array of the inode
-        int inode_block_entry = find_free_inode_block_entry(inode_idx);
+    return ~crc;
+}
 
-        // if -1 returned, print error message and cleanup directory/inode entry
-        if (inode_block_entry == -1) {
-            printf("put error: Not enough disk space\n");
+#if defined(__x86_64__)
+/*
+    Name: crc32c_sse42
+    Parameters: CRC of the data before this piece, data and its length
+    Return: uint32_t
+    Description: CRC32C of the data with the SSE4.2 crc32 instruction, eight bytes at a time
+*/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *data, uint64_t length) {
+    const uint8_t *bytes = data;
+    uint64_t crc64 = ~crc & 0xFFFFFFFF;
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        length -= 8;
+    }
+
+    uint32_t crc32 = crc64;
+    while (length--) {
+        crc32 = _mm_crc32_u8(crc32, *bytes++);
+    }
+
+    return ~crc32;
+}
+#endif
+
+// CRC32C implementation in use, the SSE4.2 one if the processor has it
+uint32_t (*crc32c)(uint32_t crc, const void *data, uint64_t length) = crc32c_software;
+
+/*
+    Name: crc32c_init
+    Parameters: None
+    Return: void
+    Description: builds the slicing tables and picks the fastest CRC32C the processor runs
+*/
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    // each further table advances the CRC of a byte by one more zero byte
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32c_sse42;
+    }
+#endif
+}
+
+/*
+    Name: elapsed_ns
+    Parameters: time a piece of work started at
+    Return: uint64_t
+    Description: nanoseconds of monotonic time passed since the start time
+*/
+uint64_t elapsed_ns(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+}
+
+/*
+    Name: histogram_bucket
+    Parameters: value
+    Return: uint64_t
+    Description: index of the histogram bucket the value falls in
+*/
+uint64_t histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+
+    // the power of two picks the group, the bits below the top one the bucket within it
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((uint64_t) (shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/*
+    Name: bucket_value
+    Parameters: index of a histogram bucket
+    Return: uint64_t
+    Description: the smallest value that falls in the bucket
+*/
+uint64_t bucket_value(uint64_t bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return ((1ULL << HISTOGRAM_SUB_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+}
+
+/*
+    Name: trace_event
+    Parameters: index of the histogram, time the work started at and nanoseconds it took
+    Return: void
+    Description: adds the event to the trace ring buffer, overwriting the oldest one when it
+    is full. The slot's sequence number is cleared while it is written and set after, so an
+    export running meanwhile skips it instead of reading half an event
+*/
+void trace_event(int stat, struct timespec *start, uint64_t ns) {
+    // work that began before tracing was turned on is left out
+    int64_t start_ns = (start->tv_sec - trace_epoch.tv_sec) * 1000000000LL + start->tv_nsec - trace_epoch.tv_nsec;
+    if (start_ns < 0) {
+        return;
+    }
+
+    if (trace_thread == 0) {
+        trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t idx = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    struct trace_event *event = &trace_ring[idx & (TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELEASE);
+    event->start_ns = start_ns;
+    event->duration_ns = ns;
+    event->stat = stat;
+    event->thread = trace_thread;
+    __atomic_store_n(&event->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Name: record_stat
+    Parameters: index of the histogram and time the timed work started at
+    Return: void
+    Description: records the time passed since the start in the histogram
+*/
+void record_stat(int stat, struct timespec *start) {
+    struct histogram *histogram = &histograms[stat];
+    uint64_t ns = elapsed_ns(start);
+
+    __atomic_add_fetch(&histogram->buckets[histogram_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        trace_event(stat, start, ns);
+    }
+}
+
+/*
+    Name: count_stat
+    Parameters: index of the counter and the amount to add
+    Return: void
+    Description: adds to an event counter
+*/
+void count_stat(int counter, uint64_t amount) {
+    __atomic_add_fetch(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/*
+    Name: command_stat
+    Parameters: command line, or just the command
+    Return: int
+    Description: index of the histogram the command is timed in, -1 for commands not timed
+*/
+int command_stat(const char *line) {
+    size_t length = strcspn(line, WHITESPACE);
+
+    for (uint64_t i = 0; i < NUM_COMMAND_STATS; i++) {
+        if (strlen(command_names[i]) == length && !strncmp(line, command_names[i], length)) {
+            return NUM_PHASE_STATS + i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Name: histogram_percentile
+    Parameters: copy of a histogram and the percentile wanted
+    Return: uint64_t
+    Description: the smallest value of the bucket the percentile falls in
+*/
+uint64_t histogram_percentile(struct histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t) (percentile / 100 * histogram->count + 0.5);
+    uint64_t seen = 0;
+
+    for (uint64_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return bucket_value(i);
+        }
+    }
+
+    return histogram->max;
+}
+
+/*
+    Name: report_stats
+    Parameters: stream to write to
+    Return: void
+    Description: prints the latency of every command and phase that ran, the counters and how
+    full the opened image is. Latencies are in microseconds
+*/
+void report_stats(FILE *fp) {
+    fprintf(fp, "%-16s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", "p50",
+            "p90", "p99", "max");
+
+    for (uint64_t i = 0; i < NUM_PHASE_STATS + NUM_COMMAND_STATS; i++) {
+        // a snapshot of the histogram, the counts may move on while it is read
+        struct histogram histogram;
+        histogram.count = 0;
+        histogram.sum = __atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED);
+        histogram.max = __atomic_load_n(&histograms[i].max, __ATOMIC_RELAXED);
+        for (uint64_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            histogram.buckets[j] = __atomic_load_n(&histograms[i].buckets[j], __ATOMIC_RELAXED);
+            histogram.count += histogram.buckets[j];
+        }
+        if (histogram.count == 0) {
+            continue;
+        }
+
+        fprintf(fp, "%-16s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                i < NUM_PHASE_STATS ? phase_names[i] : command_names[i - NUM_PHASE_STATS], histogram.count,
+                histogram.sum / 1e3 / histogram.count, histogram_percentile(&histogram, 50) / 1e3,
+                histogram_percentile(&histogram, 90) / 1e3, histogram_percentile(&histogram, 99) / 1e3,
+                histogram.max / 1e3);
+    }
+
+    for (int i = 0; i < NUM_COUNTER_STATS; i++) {
+        fprintf(fp, "%s: %" PRIu64 "\n", counter_names[i], __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+
+    if (!opened) {
+        return;
+    }
+
+    // how full the image is, by inodes, directory slots and blocks
+    uint64_t inodes = 0;
+    uint64_t entries = 0;
+    uint64_t blocks = 0;
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        inodes += free_inode_map[i] != 0;
+        entries += directory_array_ptr[i].valid != 0;
+    }
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        blocks += free_block_map[i] != 0;
+    }
+    fprintf(fp, "inodes: %" PRIu64 " of %" PRIu64 " in use\n", inodes, geometry.num_inodes);
+    fprintf(fp, "directory entries: %" PRIu64 " of %" PRIu64 " in use\n", entries, geometry.num_inodes);
+    fprintf(fp, "blocks: %" PRIu64 " of %" PRIu64 " in use\n", blocks, geometry.num_blocks);
+}
+
+/*
+    Name: reset_stats
+    Parameters: None
+    Return: void
+    Description: zeroes every histogram and counter
+*/
+void reset_stats() {
+    for (uint64_t i = 0; i < NUM_PHASE_STATS + NUM_COMMAND_STATS; i++) {
+        __atomic_store_n(&histograms[i].count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histograms[i].sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histograms[i].max, 0, __ATOMIC_RELAXED);
+        for (uint64_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            __atomic_store_n(&histograms[i].buckets[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+    for (int i = 0; i < NUM_COUNTER_STATS; i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Name: stats_dumper
+    Parameters: None (thread argument unused)
+    Return: NULL
+    Description: appends the stats, with the time, to the dump file every interval until the
+    dump is turned off. The image lock keeps the image from changing while it is looked at
+*/
+void *stats_dumper(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&stats_dump_lock);
+    while (stats_dump_path) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += stats_dump_interval;
+        if (pthread_cond_timedwait(&stats_dump_cond, &stats_dump_lock, &wake) != ETIMEDOUT || !stats_dump_path) {
+            continue;
+        }
+
+        // the path stays until this thread is joined, so the dump can go on unlocked
+        pthread_mutex_unlock(&stats_dump_lock);
+        FILE *fp = fopen(stats_dump_path, "a");
+        if (fp) {
+            fprintf(fp, "time: %lld\n", (long long) time(NULL));
+            pthread_rwlock_rdlock(&image_lock);
+            report_stats(fp);
+            pthread_rwlock_unlock(&image_lock);
+            fprintf(fp, "\n");
+            fclose(fp);
+        }
+        pthread_mutex_lock(&stats_dump_lock);
+    }
+    pthread_mutex_unlock(&stats_dump_lock);
+
+    return NULL;
+}
+
+/*
+    Name: stats_dump
+    Parameters: file to append the stats to (NULL to stop) and seconds between dumps
+    Return: void
+    Description: starts, restarts or stops the periodic dump of the stats. The caller must not
+    hold the image lock, a dump in progress may be waiting for it
+*/
+void stats_dump(char *path, uint64_t interval) {
+    pthread_mutex_lock(&stats_dump_control_lock);
+
+    // stop the running dump first
+    pthread_mutex_lock(&stats_dump_lock);
+    char *old_path = stats_dump_path;
+    stats_dump_path = NULL;
+    pthread_cond_signal(&stats_dump_cond);
+    pthread_mutex_unlock(&stats_dump_lock);
+    if (old_path) {
+        pthread_join(stats_dump_thread, NULL);
+        free(old_path);
+    }
+
+    if (path) {
+        stats_dump_path = strdup(path);
+        stats_dump_interval = interval;
+        pthread_create(&stats_dump_thread, NULL, stats_dumper, NULL);
+    }
+
+    pthread_mutex_unlock(&stats_dump_control_lock);
+}
+
+/*
+    Name: trace_start
+    Parameters: None
+    Return: void
+    Description: empties the trace ring buffer and starts recording events into it
+*/
+void trace_start() {
+    // the buffer stays once made, so a writer still finishing an event never loses it
+    if (!trace_ring) {
+        trace_ring = calloc(TRACE_EVENTS, sizeof(struct trace_event));
+    }
+
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    for (uint64_t i = 0; i < TRACE_EVENTS; i++) {
+        __atomic_store_n(&trace_ring[i].seq, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Name: trace_export
+    Parameters: file to write the trace to
+    Return: int
+    Description: writes the events in the ring buffer, oldest first, as Chrome trace JSON
+    ("X" events with their begin time and duration, in microseconds) that chrome://tracing
+    and Perfetto load. Recording can carry on meanwhile. Returns 0 on success and -1 on failure
+*/
+int trace_export(char *path) {
+    if (!trace_ring) {
+        fprintf(output_fp, "trace error: Nothing traced\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(output_fp, "trace error: File not found\n");
+        return -1;
+    }
+
+    uint64_t next = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t first = next > TRACE_EVENTS ? next - TRACE_EVENTS : 0;
+    uint64_t count = 0;
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (uint64_t i = first; i < next; i++) {
+        // copy the event out, it only counts if it wasn't rewritten while copied
+        struct trace_event *slot = &trace_ring[i & (TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        struct trace_event event = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1 || event.stat >= NUM_PHASE_STATS + NUM_COMMAND_STATS) {
+            continue;
+        }
+
+        int command = event.stat >= NUM_PHASE_STATS;
+        fprintf(fp, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": %d, \"tid\": %u}",
+                count > 0 ? ",\n" : "", command ? command_names[event.stat - NUM_PHASE_STATS] : phase_names[event.stat],
+                command ? "command" : "phase", event.start_ns / 1e3, event.duration_ns / 1e3, (int) getpid(),
+                event.thread);
+        count++;
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(output_fp, "trace error: Write failed\n");
+        return -1;
+    }
+
+    fprintf(output_fp, "trace: %" PRIu64 " events written to %s", count, path);
+    if (first > 0) {
+        fprintf(output_fp, " (%" PRIu64 " older events were overwritten)", first);
+    }
+    fprintf(output_fp, ".\n");
+
+    return 0;
+}
+
+/*
+    Name: trace_command
+    Parameters: action (on, off or export) and the file to export to
+    Return: int
+    Description: "trace on" starts recording, "trace off" stops it and "trace export <file>"
+    writes what was recorded. Returns 0 on success and -1 on failure
+*/
+int trace_command(char *action, char *path) {
+    if (action && !strcmp(action, "on")) {
+        trace_start();
+        return 0;
+    }
+    if (action && !strcmp(action, "off")) {
+        __atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (action && !strcmp(action, "export") && path) {
+        return trace_export(path);
+    }
+
+    fprintf(output_fp, "trace error: Incorrect command usage\n");
+    return -1;
+}
+
+/*
+    Name: block_data
+    Parameters: index of a data block
+    Return: pointer to the block's data
+    Description: returns the block's data, loading it from the image file on first use
+*/
+void *block_data(int64_t block_idx) {
+    void *block = __atomic_load_n(&data_blocks[block_idx], __ATOMIC_ACQUIRE);
+    if (block) {
+        return block;
+    }
+
+    // several readers may want the same block, only one of them loads it
+    pthread_mutex_lock(&block_load_lock);
+    block = data_blocks[block_idx];
+    if (!block) {
+        // blocks past the end of the file (or never saved) read back as zeros
+        block = calloc(geometry.block_size, sizeof(char));
+        if (backing_fp) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            off_t offset = (geometry.data_start + block_idx) * geometry.block_size;
+            if (pread(fileno(backing_fp), block, geometry.block_size, offset) == -1) {
+                perror("mfs: pread");
+            }
+
+            // a block in use was saved with its checksum, readers check for the flag
+            if (free_block_map[block_idx] &&
+                crc32c(0, block, geometry.block_size) != block_checksums[block_idx]) {
+                corrupt_block_map[block_idx] = 1;
+            }
+            record_stat(STAT_BLOCK_LOAD, &start);
+            count_stat(COUNT_BLOCKS_LOADED, 1);
+        }
+        __atomic_store_n(&data_blocks[block_idx], block, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&block_load_lock);
+
+    return block;
+}
+
+/*
+    Name: claim_block
+    Parameters: index of a free data block
+    Return: pointer to the block's data
+    Description: marks the block in use and returns a zeroed buffer for it, the block is
+    written back by the next savefs
+*/
+void *claim_block(int64_t block_idx) {
+    // whatever the image file holds for a free block is stale, so don't load it
+    if (!data_blocks[block_idx]) {
+        data_blocks[block_idx] = calloc(geometry.block_size, sizeof(char));
+    }
+
+    free_block_map[block_idx] = 1;
+    dirty_block_map[block_idx] = 1;
+    corrupt_block_map[block_idx] = 0;
+    count_stat(COUNT_BLOCKS_CLAIMED, 1);
+
+    return data_blocks[block_idx];
+}
+
+/*
+    Name: release_block
+    Parameters: index of a data block in use
+    Return: void
+    Description: marks the block free and drops its data
+*/
+void release_block(int64_t block_idx) {
+    free(data_blocks[block_idx]);
+    data_blocks[block_idx] = NULL;
+
+    free_block_map[block_idx] = 0;
+    dirty_block_map[block_idx] = 0;
+    corrupt_block_map[block_idx] = 0;
+    count_stat(COUNT_BLOCKS_RELEASED, 1);
+}
+
+/*
+    Name: share_slot
+    Parameters: block map entry
+    Return: int64_t
+    Description: probes the share table for the entry, returns the slot it is in or -1 if
+    the entry has a single reference
+*/
+int64_t share_slot(int64_t entry) {
+    if (shared_entries.capacity == 0) {
+        return -1;
+    }
+
+    // linear probing on a mix of the entry's bits, an empty slot ends the probe sequence
+    uint64_t mask = shared_entries.capacity - 1;
+    for (uint64_t i = (entry * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+         shared_entries.entries[i] != EMPTY_SLOT; i = (i + 1) & mask) {
+        if (shared_entries.entries[i] == entry) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Name: share_entry
+    Parameters: block map entry
+    Return: void
+    Description: adds a reference to the entry, growing the share table as needed
+*/
+void share_entry(int64_t entry) {
+    int64_t slot = share_slot(entry);
+    if (slot != -1) {
+        shared_entries.refs[slot]++;
+        return;
+    }
+
+    // keep at most three quarters of the slots used (deleted markers included),
+    // rebuilding into a table twice the size of the live entries when it fills up
+    if ((shared_entries.used + 1) * 4 > shared_entries.capacity * 3) {
+        struct share_table old = shared_entries;
+
+        uint64_t capacity = INITIAL_INDEX_CAPACITY;
+        while ((old.count + 1) * 4 > capacity * 2) {
+            capacity *= 2;
+        }
+
+        shared_entries.capacity = capacity;
+        shared_entries.count = 0;
+        shared_entries.used = 0;
+        shared_entries.entries = malloc(capacity * sizeof(int64_t));
+        shared_entries.refs = malloc(capacity * sizeof(uint32_t));
+        for (uint64_t i = 0; i < capacity; i++) {
+            shared_entries.entries[i] = EMPTY_SLOT;
+        }
+
+        for (uint64_t i = 0; i < old.capacity; i++) {
+            if (old.entries[i] >= 0) {
+                share_entry(old.entries[i]);
+                shared_entries.refs[share_slot(old.entries[i])] = old.refs[i];
+            }
+        }
+        free(old.entries);
+        free(old.refs);
+    }
+
+    // take the first empty or deleted slot along the probe sequence
+    uint64_t mask = shared_entries.capacity - 1;
+    uint64_t i = (entry * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+    while (shared_entries.entries[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+
+    if (shared_entries.entries[i] == EMPTY_SLOT) {
+        shared_entries.used++;
+    }
+    shared_entries.entries[i] = entry;
+    shared_entries.refs[i] = 1;
+    shared_entries.count++;
+}
+
+/*
+    Name: unshare_entry
+    Parameters: block map entry
+    Return: int
+    Description: drops a reference to the entry, returns 1 if other references are left and
+    0 if that was the last one (the caller then frees the entry)
+*/
+int unshare_entry(int64_t entry) {
+    int64_t slot = share_slot(entry);
+    if (slot == -1) {
+        return 0;
+    }
+
+    // leave a marker so probe sequences running through the slot keep going
+    if (--shared_entries.refs[slot] == 0) {
+        shared_entries.entries[slot] = DELETED_SLOT;
+        shared_entries.count--;
+    }
+
+    return 1;
+}
+
+/*
+    Name: lz_length
+    Parameters: pointer to the output position and the length beyond the token nibble
+    Return: void
+    Description: writes the extra length bytes of a sequence, 255 for every full 255 and
+    then the rest
+*/
+void lz_length(uint8_t **op, uint64_t length) {
+    while (length >= 255) {
+        *(*op)++ = 255;
+        length -= 255;
+    }
+    *(*op)++ = length;
+}
+
+/*
+    Name: lz_compress
+    Parameters: data to compress and its length, output buffer and its capacity
+    Return: uint64_t
+    Description: compresses the data into LZ4 style sequences (a token with the literal and
+    match lengths, the literals, then a two byte offset back to the match). Returns the
+    compressed length, or 0 if it would not fit in the output buffer
+*/
+uint64_t lz_compress(const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    uint64_t ip = 0;
+    uint64_t anchor = 0;
+    uint8_t *op = dst;
+    uint8_t *end = dst + capacity;
+
+    // the last match has to start 12 bytes before the end and leave 5 literals after it
+    while (length >= 13 && ip < length - 12) {
+        uint32_t word;
+        memcpy(&word, src + ip, sizeof(word));
+        uint32_t hash = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+        uint64_t candidate = table[hash];
+        table[hash] = ip;
+
+        uint32_t candidate_word;
+        memcpy(&candidate_word, src + candidate, sizeof(candidate_word));
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || candidate_word != word) {
+            // step faster through data that doesn't compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        uint64_t match = LZ_MIN_MATCH;
+        while (ip + match < length - 5 && src[candidate + match] == src[ip + match]) {
+            match++;
+        }
+
+        // token, literals, offset and extra match length must all fit
+        uint64_t literals = ip - anchor;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + (match - LZ_MIN_MATCH) / 255 + 1 > end) {
+            return 0;
+        }
+
+        uint8_t *token = op++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15) {
+            lz_length(&op, literals - 15);
+        }
+        memcpy(op, src + anchor, literals);
+        op += literals;
+
+        *op++ = (ip - candidate) & 0xFF;
+        *op++ = (ip - candidate) >> 8;
+        *token |= match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15;
+        if (match - LZ_MIN_MATCH >= 15) {
+            lz_length(&op, match - LZ_MIN_MATCH - 15);
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // the rest goes out as literals in a final sequence without a match
+    uint64_t literals = length - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > end) {
+        return 0;
+    }
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        lz_length(&op, literals - 15);
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+
+    return op - dst;
+}
+
+/*
+    Name: lz_decompress
+    Parameters: compressed data and its length, output buffer and its capacity
+    Return: int64_t
+    Description: expands data compressed by lz_compress, returns the decompressed length or
+    -1 if the data is malformed or doesn't fit in the output buffer
+*/
+int64_t lz_decompress(const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t capacity) {
+    uint64_t ip = 0;
+    uint64_t op = 0;
+
+    while (ip < length) {
+        uint8_t token = src[ip++];
+
+        // literal length, extended by bytes of 255 while they last
+        uint64_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                byte = src[ip++];
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > length - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // the final sequence has no match
+        if (ip == length) {
+            break;
+        }
+
+        if (length - ip < 2) {
+            return -1;
+        }
+        uint64_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+
+        uint64_t match = token & 15;
+        if (match == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                byte = src[ip++];
+                match += byte;
+            } while (byte == 255);
+        }
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || match > capacity - op) {
+            return -1;
+        }
+
+        // a match may overlap the bytes it produces, then it has to go a byte at a time
+        if (offset >= match) {
+            memcpy(dst + op, dst + op - offset, match);
+        }
+        else {
+            for (uint64_t i = 0; i < match; i++) {
+                dst[op + i] = dst[op + i - offset];
+            }
+        }
+        op += match;
+    }
+
+    return op;
+}
+
+/*
+    Name: fragments_for
+    Parameters: number of bytes
+    Return: uint64_t
+    Description: number of fragments the bytes take when stored, a block's worth for more
+    than half a block since those aren't packed
+*/
+uint64_t fragments_for(uint64_t bytes) {
+    uint64_t fragment_size = geometry.block_size / FRAGS_PER_BLOCK;
+
+    if (bytes > geometry.block_size / 2) {
+        return FRAGS_PER_BLOCK;
+    }
+
+    return (bytes + fragment_size - 1) / fragment_size;
+}
+
+/*
+    Name: compress_block
+    Parameters: data of a block and its length, output buffer of a block's size
+    Return: uint64_t
+    Description: compresses the block into the output as a 4 byte length followed by the
+    compressed data. Returns the bytes written, or 0 if compressing doesn't save a fragment
+*/
+uint64_t compress_block(const void *data, uint64_t num_bytes, void *out) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // only worth it if the result takes fewer fragments than the raw data
+    uint64_t fragments = fragments_for(num_bytes);
+    uint64_t capacity = (fragments - 1) * (geometry.block_size / FRAGS_PER_BLOCK);
+    uint64_t length = 0;
+    if (capacity > sizeof(uint32_t)) {
+        length = lz_compress(data, num_bytes, (uint8_t *) out + sizeof(uint32_t),
+                             capacity - sizeof(uint32_t));
+    }
+
+    __atomic_add_fetch(&compress_bytes, num_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compress_ns, elapsed_ns(&start), __ATOMIC_RELAXED);
+
+    if (length == 0) {
+        return 0;
+    }
+
+    uint32_t header = length;
+    memcpy(out, &header, sizeof(header));
+
+    return sizeof(header) + length;
+}
+
+/*
+    Name: inline_size
+    Parameters: None
+    Return: uint64_t
+    Description: largest file stored inline, the data takes the block map a new inode starts
+    with
+*/
+uint64_t inline_size() {
+    return MIN_MAP_ENTRIES * sizeof(int64_t);
+}
+
+/*
+    Name: entry_block
+    Parameters: block map entry
+    Return: int64_t
+    Description: index of the data block the entry refers to
+*/
+int64_t entry_block(int64_t entry) {
+    if (entry & PACKED_ENTRY) {
+        return (entry & ~(PACKED_ENTRY | COMPRESSED_ENTRY)) >> 8;
+    }
+
+    return entry;
+}
+
+/*
+    Name: entry_fragments
+    Parameters: block map entry of a packed tail
+    Return: uint16_t
+    Description: mask of the fragments the tail takes in its shared block
+*/
+uint16_t entry_fragments(int64_t entry) {
+    int start = (entry >> 4) & 0xF;
+    int count = (entry & 0xF) + 1;
+
+    return ((1U << count) - 1) << start;
+}
+
+/*
+    Name: valid_entry
+    Parameters: block map entry
+    Return: int
+    Description: returns 1 if the entry refers to a block in the data region (and fragments
+    within it for a packed entry)
+*/
+int valid_entry(int64_t entry) {
+    if (entry < 0) {
+        return 0;
+    }
+
+    if (entry & PACKED_ENTRY) {
+        if (((entry >> 4) & 0xF) + (entry & 0xF) + 1 > FRAGS_PER_BLOCK) {
+            return 0;
+        }
+    }
+    else if (entry & COMPRESSED_ENTRY) {
+        return 0;
+    }
+
+    return entry_block(entry) < (int64_t) geometry.num_blocks;
+}
+
+/*
+    Name: entry_data
+    Parameters: block map entry and a buffer of a block's size
+    Return: pointer to the entry's data
+    Description: returns the data of the block, or of the first fragment of a packed tail,
+    loading the block from the image file on first use. Holes read as zero_block and
+    compressed blocks are expanded into the buffer
+*/
+void *entry_data(int64_t entry, void *buffer) {
+    if (entry == HOLE_ENTRY) {
+        return zero_block;
+    }
+
+    char *block = block_data(entry_block(entry));
+
+    if (entry & PACKED_ENTRY) {
+        block += ((entry >> 4) & 0xF) * (geometry.block_size / FRAGS_PER_BLOCK);
+    }
+
+    if (entry & COMPRESSED_ENTRY) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        // the length can't run past the fragments the entry holds
+        uint32_t length;
+        memcpy(&length, block, sizeof(length));
+        uint64_t room = ((entry & 0xF) + 1) * (geometry.block_size / FRAGS_PER_BLOCK);
+
+        int64_t num_bytes = -1;
+        if (length <= room - sizeof(length)) {
+            num_bytes = lz_decompress((uint8_t *) block + sizeof(length), length, buffer,
+                                      geometry.block_size);
+        }
+        if (num_bytes == -1) {
+            fprintf(output_fp, "mfs: Corrupt compressed block %" PRId64 "\n", entry_block(entry));
+            memset(buffer, 0, geometry.block_size);
+        }
+
+        __atomic_add_fetch(&decompress_bytes, num_bytes == -1 ? 0 : num_bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&decompress_ns, elapsed_ns(&start), __ATOMIC_RELAXED);
+
+        return buffer;
+    }
+
+    return block;
+}
+
+/*
+    Name: write_directory_record
+    Parameters: image file positioned at the record and the directory entry to write
+    Return: void
+    Description: writes the entry as a record of the directory region
+*/
+void write_directory_record(FILE *fp, struct directory_entry *entry) {
+    // names are stored null padded to a fixed width
+    char name[MAX_FILENAME + 1] = {0};
+    if (entry->name != NULL) {
+        strncpy(name, entry->name, MAX_FILENAME);
+    }
+    uint8_t valid = entry->valid;
+    uint8_t h = entry->h;
+    uint8_t r = entry->r;
+
+    fwrite(name, sizeof(char), MAX_FILENAME + 1, fp);
+    fwrite(&valid, sizeof(uint8_t), 1, fp);
+    fwrite(&h, sizeof(uint8_t), 1, fp);
+    fwrite(&r, sizeof(uint8_t), 1, fp);
+    fwrite(&(entry->inode_idx), sizeof(int64_t), 1, fp);
+    fwrite(&(entry->parent), sizeof(int64_t), 1, fp);
+}
+
+/*
+    Name: read_directory_record
+    Parameters: image file positioned at the record and the directory entry to read into
+    Return: void
+    Description: reads a record of the directory region into the entry
+*/
+void read_directory_record(FILE *fp, struct directory_entry *entry) {
+    char name[MAX_FILENAME + 1];
+    uint8_t valid, h, r;
+
+    fread(name, sizeof(char), MAX_FILENAME + 1, fp);
+    fread(&valid, sizeof(uint8_t), 1, fp);
+    fread(&h, sizeof(uint8_t), 1, fp);
+    fread(&r, sizeof(uint8_t), 1, fp);
+    fread(&(entry->inode_idx), sizeof(int64_t), 1, fp);
+    fread(&(entry->parent), sizeof(int64_t), 1, fp);
+
+    // only entries in use have a filename
+    name[MAX_FILENAME] = 0;
+    entry->name = valid ? strdup(name) : NULL;
+    entry->valid = valid;
+    entry->h = h;
+    entry->r = r;
+}
+
+/*
+    Name: map_length
+    Parameters: inode
+    Return: uint64_t
+    Description: number of block map entries the inode's record stores, the entries up to the
+    -1 ending the map, or the ones an inline file's data takes
+*/
+uint64_t map_length(struct inode *inode) {
+    uint64_t length = 0;
+    if (inode->flags & INODE_INLINE) {
+        length = (inode->size + sizeof(int64_t) - 1) / sizeof(int64_t);
+        return length < inode->capacity ? length : inode->capacity;
+    }
+
+    while (length < inode->capacity && inode->blocks[length] != -1) {
+        length++;
+    }
+
+    return length;
+}
+
+/*
+    Name: write_inode_record
+    Parameters: image file positioned at the record and the inode to write
+    Return: void
+    Description: writes the inode as a fixed size record of the inode region, the block map
+    is written separately by write_block_map and only its length is kept here
+*/
+void write_inode_record(FILE *fp, struct inode *inode) {
+    char record[INODE_RECORD_SIZE] = {0};
+    int64_t date = inode->date;
+    int32_t valid = inode->valid;
+    int32_t type = inode->type;
+    int32_t flags = inode->flags;
+    uint64_t length = map_length(inode);
+    // mfsd gets count reads holding only the file's lock, so these are read atomically
+    uint64_t reads = __atomic_load_n(&inode->reads, __ATOMIC_RELAXED);
+    int64_t last_read = __atomic_load_n(&inode->last_read, __ATOMIC_RELAXED);
+    memcpy(record, &date, sizeof(int64_t));
+    memcpy(record + 8, &(inode->size), sizeof(uint64_t));
+    memcpy(record + 16, &valid, sizeof(int32_t));
+    memcpy(record + 20, &type, sizeof(int32_t));
+    memcpy(record + 24, &flags, sizeof(int32_t));
+    memcpy(record + 32, &(inode->parent), sizeof(int64_t));
+    memcpy(record + 40, &length, sizeof(uint64_t));
+    memcpy(record + 48, &reads, sizeof(uint64_t));
+    memcpy(record + 56, &last_read, sizeof(int64_t));
+    fwrite(record, sizeof(record), 1, fp);
+}
+
+/*
+    Name: write_block_map
+    Parameters: image file positioned where the block map goes and the inode to write
+    Return: void
+    Description: writes as many block map entries as the inode's record says it has (the
+    data of an inline file)
+*/
+void write_block_map(FILE *fp, struct inode *inode) {
+    fwrite(inode->blocks, sizeof(int64_t), map_length(inode), fp);
+}
+
+/*
+    Name: read_inode_record
+    Parameters: image file positioned at the record and the inode to read into
+    Return: uint64_t
+    Description: reads a record of the inode region into the inode, returns the number of
+    block map entries to read with read_block_map
+*/
+uint64_t read_inode_record(FILE *fp, struct inode *inode) {
+    char record[INODE_RECORD_SIZE] = {0};
+    int64_t date;
+    int32_t valid, type, flags;
+    uint64_t length;
+    int64_t last_read;
+
+    fread(record, sizeof(record), 1, fp);
+    memcpy(&date, record, sizeof(int64_t));
+    memcpy(&(inode->size), record + 8, sizeof(uint64_t));
+    memcpy(&valid, record + 16, sizeof(int32_t));
+    memcpy(&type, record + 20, sizeof(int32_t));
+    memcpy(&flags, record + 24, sizeof(int32_t));
+    memcpy(&(inode->parent), record + 32, sizeof(int64_t));
+    memcpy(&length, record + 40, sizeof(uint64_t));
+    memcpy(&(inode->reads), record + 48, sizeof(uint64_t));
+    memcpy(&last_read, record + 56, sizeof(int64_t));
+
+    inode->date = date;
+    inode->valid = valid;
+    inode->type = type;
+    inode->flags = flags;
+    inode->last_read = last_read;
+
+    return length;
+}
+
+/*
+    Name: read_block_map
+    Parameters: image file positioned at the block map, the inode to read into and the number
+    of entries its record gave
+    Return: int
+    Description: reads the inode's block map, growing it to the length that was stored. If the
+    file ends first the map is ended after the entries that were read. Returns 0 on success
+    and -1 on a short read
+*/
+int read_block_map(FILE *fp, struct inode *inode, uint64_t length) {
+    // a damaged record can't make the map larger than any file of the image needs
+    uint64_t most = geometry.num_blocks > MIN_MAP_ENTRIES ? geometry.num_blocks : MIN_MAP_ENTRIES;
+    if (length > most) {
+        length = most;
+    }
+
+    reserve_blocks(inode, length);
+    uint64_t read = fread(inode->blocks, sizeof(int64_t), length, fp);
+    if (read != length) {
+        for (uint64_t i = read; i < length; i++) {
+            inode->blocks[i] = -1;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+// regions of the image file with a checksum each, in the order the checksums are stored
+const char *region_names[NUM_REGIONS] = {
+    "header", "directory", "inode map", "block map", "inode", "fingerprint index",
+    "block checksum", "inode block map and snapshot"
+};
+
+/*
+    Name: region_checksum
+    Parameters: descriptor of the image file and number of the region
+    Return: uint32_t
+    Description: CRC32C of the region as it is in the image file. The fingerprint index and
+    the snapshots may not be there at all, only the bytes the file holds count
+*/
+uint32_t region_checksum(int fd, int region) {
+    off_t start = 0;
+    off_t length = 0;
+    off_t block_size = geometry.block_size;
+
+    switch (region) {
+    case 0:
+        length = sizeof(struct fs_geometry);
+        break;
+    case 1:
+        start = geometry.dir_start * block_size;
+        length = geometry.dir_blocks * block_size;
+        break;
+    case 2:
+        start = geometry.inode_map_start * block_size;
+        length = geometry.inode_map_blocks * block_size;
+        break;
+    case 3:
+        start = geometry.block_map_start * block_size;
+        length = geometry.block_map_blocks * block_size;
+        break;
+    case 4:
+        start = geometry.inode_start * block_size;
+        length = geometry.inode_blocks * block_size;
+        break;
+    case 5:
+        start = geometry.dedup_start * block_size;
+        length = geometry.dedup_blocks * block_size;
+        break;
+    case 6:
+        // just the block checksums, the region checksums after them aren't covered
+        start = geometry.checksum_start * block_size;
+        length = geometry.num_blocks * sizeof(uint32_t);
+        break;
+    default: {
+        // the live block maps and the snapshots run to the end of the file
+        struct stat buf;
+        start = geometry.map_start * block_size;
+        length = fstat(fd, &buf) == 0 && buf.st_size > start ? buf.st_size - start : 0;
+        break;
+    }
+    }
+
+    // read the region a chunk at a time, stopping where the file ends
+    char chunk[65536];
+    uint32_t crc = 0;
+    while (length > 0) {
+        ssize_t bytes = pread(fd, chunk, length < (off_t) sizeof(chunk) ? length : (off_t) sizeof(chunk),
+                              start);
+        if (bytes <= 0) {
+            break;
+        }
+
+        crc = crc32c(crc, chunk, bytes);
+        start += bytes;
+        length -= bytes;
+    }
+
+    return crc;
+}
+
+/*
+    Name: check_regions
+    Parameters: descriptor of the image file and an array to return the numbers of the
+    regions that don't match in (NUM_REGIONS entries)
+    Return: int
+    Description: compares the checksum of every region against the one saved with it,
+    returns the number of regions that don't match
+*/
+int check_regions(int fd, int *mismatched) {
+    uint32_t saved[NUM_REGIONS] = {0};
+    off_t offset = geometry.checksum_start * geometry.block_size + geometry.num_blocks * sizeof(uint32_t);
+    if (pread(fd, saved, sizeof(saved), offset) != (ssize_t) sizeof(saved)) {
+        memset(saved, 0, sizeof(saved));
+    }
+
+    int count = 0;
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        if (region_checksum(fd, i) != saved[i]) {
+            mismatched[count++] = i;
+        }
+    }
+
+    return count;
+}
+
+/*
+    Name: savefs
+    Parameters: None
+    Return: int
+    Description: save contents of file system image into the opened image's file. Only blocks
+    changed since the last save are written, the metadata regions are rewritten in full.
+    Returns 0 on success and -1 on failure
+*/
+int savefs() {
+    // a new image doesn't have a file yet, create it
+    FILE *fp = backing_fp;
+    if (!fp) {
+        fp = fopen(opened_image, "w+b");
+        if (!fp) {
+            fprintf(output_fp, "savefs error: File not found\n");
+            return -1;
+        }
+    }
+    int fd = fileno(fp);
+
+    // save data blocks changed since the last save, the rest are already in the file
+    // (blocks never written stay holes in the file)
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        if (!dirty_block_map[i]) {
+            continue;
+        }
+
+        // a block that failed its checksum keeps the old one, so it still reads as corrupt
+        // wherever its data is written
+        off_t offset = (geometry.data_start + i) * geometry.block_size;
+        if (!corrupt_block_map[i]) {
+            block_checksums[i] = crc32c(0, data_blocks[i], geometry.block_size);
+        }
+        if (pwrite(fd, data_blocks[i], geometry.block_size, offset) != (ssize_t) geometry.block_size) {
+            fprintf(output_fp, "savefs error: Write failed\n");
+            if (!backing_fp) {
+                fclose(fp);
+            }
+            return -1;
+        }
+        dirty_block_map[i] = 0;
+        count_stat(COUNT_BLOCKS_WRITTEN, 1);
+    }
+    record_stat(STAT_SAVEFS_BLOCKS, &start);
+
+    // save contents of directory region into file
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fseeko(fp, geometry.dir_start * geometry.block_size, SEEK_SET);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        write_directory_record(fp, &directory_array_ptr[i]);
+    }
+
+    // save contents of free inode map into file
+    fseeko(fp, geometry.inode_map_start * geometry.block_size, SEEK_SET);
+    fwrite(free_inode_map, sizeof(uint8_t), geometry.num_inodes, fp);
+
+    // save contents of free block map into file
+    fseeko(fp, geometry.block_map_start * geometry.block_size, SEEK_SET);
+    fwrite(free_block_map, sizeof(uint8_t), geometry.num_blocks, fp);
+
+    // save contents of inodes in use into file, free inode records are left as they are
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (!free_inode_map[i]) {
+            continue;
+        }
+
+        fseeko(fp, geometry.inode_start * geometry.block_size + i * geometry.inode_size, SEEK_SET);
+        write_inode_record(fp, inode_array_ptr[i]);
+    }
+
+    // save the fingerprint index while dedup is on
+    if (fingerprint_index) {
+        fseeko(fp, geometry.dedup_start * geometry.block_size, SEEK_SET);
+        fwrite(fingerprint_index, sizeof(struct fingerprint_slot), geometry.num_blocks, fp);
+    }
+
+    // block maps of the inodes in use go one after the other in inode order, each only as
+    // long as its file needs
+    fseeko(fp, geometry.map_start * geometry.block_size, SEEK_SET);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (free_inode_map[i]) {
+            write_block_map(fp, inode_array_ptr[i]);
+        }
+    }
+
+    // snapshots follow one after the other, each with the records of its inodes in use
+    for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+        int64_t date = snapshots[i].date;
+
+        fwrite(snapshots[i].name, sizeof(char), MAX_FILENAME + 1, fp);
+        fwrite(&date, sizeof(int64_t), 1, fp);
+        for (uint64_t j = 0; j < geometry.num_inodes; j++) {
+            write_directory_record(fp, &snapshots[i].directory[j]);
+        }
+        fwrite(snapshots[i].free_inode_map, sizeof(uint8_t), geometry.num_inodes, fp);
+        for (uint64_t j = 0; j < geometry.num_inodes; j++) {
+            if (snapshots[i].free_inode_map[j]) {
+                write_inode_record(fp, snapshots[i].inodes[j]);
+                write_block_map(fp, snapshots[i].inodes[j]);
+            }
+        }
+    }
+    off_t end = ftello(fp);
+
+    // header goes last, so the geometry describes regions that are all written
+    fseeko(fp, 0, SEEK_SET);
+    fwrite(&geometry, sizeof(geometry), 1, fp);
+
+    if (fflush(fp) != 0 || ftruncate(fd, end) == -1) {
+        fprintf(output_fp, "savefs error: Write failed\n");
+        if (!backing_fp) {
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    // checksums go in once everything they cover is written, the block checksums first
+    // since they are a region of their own
+    off_t offset = geometry.checksum_start * geometry.block_size;
+    uint32_t regions[NUM_REGIONS];
+    int failed = pwrite(fd, block_checksums, geometry.num_blocks * sizeof(uint32_t), offset) !=
+                 (ssize_t) (geometry.num_blocks * sizeof(uint32_t));
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        regions[i] = region_checksum(fd, i);
+    }
+    if (failed || pwrite(fd, regions, sizeof(regions), offset + geometry.num_blocks * sizeof(uint32_t)) !=
+                  (ssize_t) sizeof(regions)) {
+        fprintf(output_fp, "savefs error: Write failed\n");
+        if (!backing_fp) {
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    // blocks not loaded yet can be read from the saved file from now on
+    backing_fp = fp;
+    record_stat(STAT_SAVEFS_METADATA, &start);
+
+    return 0;
+}
+
+/*
+    Name: mark_entries
+    Parameters: inode read from the image and a map of the entries seen so far (one bit per
+    fragment start, bit 0 for whole blocks)
+    Return: void
+    Description: marks the fragments the inode's packed entries take in use and counts every
+    entry already seen in another inode as shared
+*/
+void mark_entries(struct inode *inode, uint16_t *seen) {
+    if (inode->flags & INODE_INLINE) {
+        return;
+    }
+
+    for (uint64_t i = 0; inode->blocks[i] != -1; i++) {
+        // entries outside the image are left for fsck to find
+        int64_t entry = inode->blocks[i];
+        if (entry == HOLE_ENTRY || !valid_entry(entry)) {
+            continue;
+        }
+
+        int64_t block_idx = entry_block(entry);
+        uint16_t bit = 1;
+        if (entry & PACKED_ENTRY) {
+            fragment_map[block_idx] |= entry_fragments(entry);
+            bit = 1 << ((entry >> 4) & 0xF);
+        }
+
+        if (seen[block_idx] & bit) {
+            share_entry(entry);
+        }
+        seen[block_idx] |= bit;
+    }
+}
+
+/*
+    Name: load_image
+    Parameters: image file and the header read from it
+    Return: int
+    Description: reads the metadata regions of the image file into a new image in the
+    globals, which hold no image yet. Returns 0 on success and -1 on failure, the image read
+    so far is left for the caller to close then
+*/
+int load_image(FILE *fp, struct fs_geometry *header) {
+    // initialize a new image with the recorded geometry to read data into, the features
+    // are taken as they were saved
+    int valid = init(header->block_size, header->num_blocks, header->num_inodes);
+    if (valid < 0) {
+        fprintf(output_fp, "open error: %s\n", valid == -1 ? "Not a file system image" : "Not enough memory");
+        return -1;
+    }
+    geometry.features = header->features;
+    geometry.num_snapshots = header->num_snapshots;
+    if (memcmp(header, &geometry, sizeof(geometry)) != 0 ||
+        geometry.num_snapshots > MAX_SNAPSHOTS) {
+        geometry.num_snapshots = 0;
+        fprintf(output_fp, "open error: Not a file system image\n");
+        return -1;
+    }
+
+    // metadata that doesn't match its checksum can't be trusted to be read in at all
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int mismatched[NUM_REGIONS];
+    if (check_regions(fileno(fp), mismatched) > 0) {
+        fprintf(output_fp, "open error: Checksum mismatch in the %s region\n", region_names[mismatched[0]]);
+        geometry.num_snapshots = 0;
+        return -1;
+    }
+
+    // read the checksums the data blocks are checked against as they are loaded
+    if (pread(fileno(fp), block_checksums, geometry.num_blocks * sizeof(uint32_t),
+              geometry.checksum_start * geometry.block_size) == -1) {
+        perror("mfs: pread");
+    }
+
+    // read directories and save into directory pointer array
+    fseeko(fp, geometry.dir_start * geometry.block_size, SEEK_SET);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        read_directory_record(fp, &directory_array_ptr[i]);
+    }
+
+    // read free inode map values from file
+    fseeko(fp, geometry.inode_map_start * geometry.block_size, SEEK_SET);
+    fread(free_inode_map, sizeof(uint8_t), geometry.num_inodes, fp);
+
+    // read free block map values from file
+    fseeko(fp, geometry.block_map_start * geometry.block_size, SEEK_SET);
+    fread(free_block_map, sizeof(uint8_t), geometry.num_blocks, fp);
+
+    // read inodes in use and save into inode array pointer, the records are next to each
+    // other so this is a single pass over the inode region
+    uint64_t *lengths = calloc(geometry.num_inodes, sizeof(uint64_t));
+    fseeko(fp, geometry.inode_start * geometry.block_size, SEEK_SET);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (!free_inode_map[i]) {
+            fseeko(fp, geometry.inode_size, SEEK_CUR);
+            continue;
+        }
+
+        struct inode *inode = alloc_inode(i);
+        lengths[i] = read_inode_record(fp, inode);
+
+        // directory indexes aren't stored, they are rebuilt from the entries below
+        if (inode->type == TYPE_DIRECTORY) {
+            inode->index = new_directory_index();
+        }
+    }
+
+    // then their block maps, in the same order
+    uint16_t *seen = calloc(geometry.num_blocks, sizeof(uint16_t));
+    fseeko(fp, geometry.map_start * geometry.block_size, SEEK_SET);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (free_inode_map[i]) {
+            if (read_block_map(fp, inode_array_ptr[i], lengths[i]) == -1 || feof(fp)) {
+                fprintf(output_fp, "open error: The block maps are cut short\n");
+                free(lengths);
+                free(seen);
+                geometry.num_snapshots = 0;
+                return -1;
+            }
+
+            // fragment use and shared entries aren't stored, count them up again
+            mark_entries(inode_array_ptr[i], seen);
+        }
+    }
+    free(lengths);
+
+    // read the snapshots, their inodes count towards the shared entries like live ones
+    for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+        struct snapshot *snapshot = &snapshots[i];
+        int64_t date;
+
+        snapshot->directory = calloc(geometry.num_inodes, sizeof(struct directory_entry));
+        snapshot->free_inode_map = calloc(geometry.num_inodes, sizeof(uint8_t));
+        snapshot->inodes = calloc(geometry.num_inodes, sizeof(struct inode *));
+
+        fread(snapshot->name, sizeof(char), MAX_FILENAME + 1, fp);
+        fread(&date, sizeof(int64_t), 1, fp);
+        snapshot->name[MAX_FILENAME] = 0;
+        snapshot->date = date;
+        for (uint64_t j = 0; j < geometry.num_inodes; j++) {
+            read_directory_record(fp, &snapshot->directory[j]);
+        }
+        int cut_short = fread(snapshot->free_inode_map, sizeof(uint8_t), geometry.num_inodes, fp) !=
+                        geometry.num_inodes;
+        for (uint64_t j = 0; j < geometry.num_inodes && !cut_short; j++) {
+            if (snapshot->free_inode_map[j]) {
+                snapshot->inodes[j] = new_inode();
+                uint64_t length = read_inode_record(fp, snapshot->inodes[j]);
+                cut_short = read_block_map(fp, snapshot->inodes[j], length) == -1 || feof(fp);
+                mark_entries(snapshot->inodes[j], seen);
+            }
+        }
+
+        // the snapshots read so far, this one included, are freed with the image
+        if (cut_short) {
+            fprintf(output_fp, "open error: The snapshots are cut short\n");
+            free(seen);
+            geometry.num_snapshots = i + 1;
+            return -1;
+        }
+    }
+    free(seen);
+
+    // the fingerprint index is only kept while dedup is on
+    if (geometry.features & IMAGE_DEDUP) {
+        fingerprint_index = malloc(geometry.num_blocks * sizeof(struct fingerprint_slot));
+        fseeko(fp, geometry.dedup_start * geometry.block_size, SEEK_SET);
+        if (fread(fingerprint_index, sizeof(struct fingerprint_slot), geometry.num_blocks, fp) !=
+            geometry.num_blocks) {
+            for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+                fingerprint_index[i].entry = -1;
+            }
+        }
+    }
+
+    // an image without a root directory can't be navigated
+    if (!free_inode_map[ROOT_INODE] || inode_array_ptr[ROOT_INODE]->type != TYPE_DIRECTORY) {
+        fprintf(output_fp, "open error: Not a file system image\n");
+        return -1;
+    }
+
+    index_directories();
+    record_stat(STAT_OPEN_METADATA, &start);
+
+    return 0;
+}
+
+/*
+    Name: open
+    Parameters: filename of the image file being read from
+    Return: int
+    Description: read the header and metadata regions of the image file into a new image,
+    data blocks are loaded from the file as they are used. Returns 0 on success and -1 on
+    failure (the opened image is left alone in that case)
+*/
+int open(char *filename) {
+    // open for update so savefs can write back in place, fall back to read-only
+    FILE *fp = fopen(filename, "r+b");
+    if (!fp) {
+        fp = fopen(filename, "rb");
+    }
+    if (!fp) {
+        fprintf(output_fp, "open error: File not found\n");
+        return -1;
+    }
+
+    // read and check the header
+    struct fs_geometry header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != IMAGE_VERSION) {
+        fprintf(output_fp, "open error: Not a file system image\n");
+        fclose(fp);
+        return -1;
+    }
+
+    // the image is read into a spare slot, the opened one is only closed once the new one
+    // has been read in full
+    struct image_state old_image;
+    memset(&old_image, 0, sizeof(old_image));
+    exchange_image(&old_image);
+    if (load_image(fp, &header) == -1) {
+        if (opened) {
+            close_image();
+        }
+        fclose(fp);
+        exchange_image(&old_image);
+        return -1;
+    }
+
+    // data blocks are read from the file on first use
+    backing_fp = fp;
+
+    // close the old image, its name stays with the shell until the caller replaces it
+    exchange_image(&old_image);
+    char *old_name = opened_image;
+    if (opened) {
+        close_image();
+    }
+    exchange_image(&old_image);
+    opened_image = old_name;
+
+    return 0;
+}
+
+/*
+    Name: df
+    Parameters: None
+    Return: uint64_t
+    Description: iterates over free block list and gets size of free blocks, along with the
+    free fragments of blocks holding packed fragments
+*/
+uint64_t df() {
+    // keep count of number of free blocks and free fragments
+    uint64_t count = 0;
+    uint64_t fragments = 0;
+
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        // increment count if a block is not in use
+        if (free_block_map[i] == 0) {
+            count++;
+        }
+        else if (fragment_map[i] != 0) {
+            fragments += FRAGS_PER_BLOCK - __builtin_popcount(fragment_map[i]);
+        }
+    }
+
+    // to get bytes free, multiply count of free blocks by block size
+    return count * geometry.block_size + fragments * (geometry.block_size / FRAGS_PER_BLOCK);
+}
+
+/*
+    Name: report_df
+    Parameters: None
+    Return: void
+    Description: prints the free space. For an image in dedup mode (or with shared blocks)
+    also the bytes the files hold against the bytes actually used to store them, and for an
+    image with compressed blocks how well they compress and how fast the codec has been running
+*/
+void report_df() {
+    uint64_t free_bytes = df();
+    fprintf(output_fp, "%" PRIu64 " bytes free.\n", free_bytes);
+
+    // add up the file sizes, and the file bytes held in compressed blocks along with the
+    // fragments they take
+    uint64_t file_bytes = 0;
+    uint64_t logical = 0;
+    uint64_t physical = 0;
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        struct inode *inode = inode_array_ptr[i];
+        if (!free_inode_map[i]) {
+            continue;
+        }
+
+        file_bytes += inode->size;
+        if (inode->flags & INODE_INLINE) {
+            continue;
+        }
+
+        for (uint64_t j = 0; inode->blocks[j] != -1; j++) {
+            int64_t entry = inode->blocks[j];
+            if (entry == HOLE_ENTRY || !(entry & COMPRESSED_ENTRY)) {
+                continue;
+            }
+
+            uint64_t remaining = inode->size - j * geometry.block_size;
+            logical += remaining < geometry.block_size ? remaining : geometry.block_size;
+            // an entry shared by several files is split evenly between them
+            int64_t slot = share_slot(entry);
+            uint64_t refs = slot == -1 ? 1 : shared_entries.refs[slot] + 1;
+            physical += ((entry & 0xF) + 1) * (geometry.block_size / FRAGS_PER_BLOCK) / refs;
+        }
+    }
+
+    // shared blocks are counted once in the space used
+    if ((geometry.features & IMAGE_DEDUP) || shared_entries.count > 0) {
+        fprintf(output_fp, "%" PRIu64 " bytes in files, %" PRIu64 " bytes used.\n", file_bytes,
+                geometry.num_blocks * geometry.block_size - free_bytes);
+    }
+
+    if (!(geometry.features & IMAGE_COMPRESS) && physical == 0) {
+        return;
+    }
+
+    fprintf(output_fp, "%" PRIu64 " bytes compressed into %" PRIu64 " bytes (ratio %.2f).\n",
+            logical, physical, physical ? (double) logical / physical : 0.0);
+
+    // throughput is per thread, in MB of uncompressed data per second
+    uint64_t c_bytes = __atomic_load_n(&compress_bytes, __ATOMIC_RELAXED);
+    uint64_t c_ns = __atomic_load_n(&compress_ns, __ATOMIC_RELAXED);
+    uint64_t d_bytes = __atomic_load_n(&decompress_bytes, __ATOMIC_RELAXED);
+    uint64_t d_ns = __atomic_load_n(&decompress_ns, __ATOMIC_RELAXED);
+    fprintf(output_fp, "Compression %.1f MB/s, decompression %.1f MB/s.\n",
+            c_ns ? c_bytes * 1000.0 / c_ns : 0.0, d_ns ? d_bytes * 1000.0 / d_ns : 0.0);
+}
+
+/*
+    Name: find_free_directory_entry
+    Parameters: none
+    Return: int64_t
+    Description: searches directory array for first free entry
+*/
+int64_t find_free_directory_entry() {
+    int64_t retval = -1;
+
+    // search directory array for a free entry
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        // get i value of first free entry
+        if (directory_array_ptr[i].valid == 0) {
+            retval = i;
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*
+    Name: find_free_inode
+    Parameters: none
+    Return: int64_t
+    Description: searches free inode map for first free entry
+*/
+int64_t find_free_inode() {
+    int64_t retval = -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // search inode map for a free entry
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        // get i value of first free entry
+        if (free_inode_map[i] == 0) {
+            retval = i;
+            break;
+        }
+    }
+
+    record_stat(STAT_INODE_ALLOC, &start);
+    return retval;
+}
+
+/*
+    Name: find_free_block
+    Parameters: none
+    Return: int64_t
+    Description: searches free block map for first free entry. With placement on it's the
+    last free entry instead: new blocks haven't been read yet, so they start out cold at the
+    end of the data region and the front is left for the hot files defrag moves there
+*/
+int64_t find_free_block() {
+    int64_t retval = -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // search free block map for a free entry
+    int last_fit = geometry.features & IMAGE_PLACEMENT;
+    for (uint64_t n = 0; n < geometry.num_blocks; n++) {
+        uint64_t i = last_fit ? geometry.num_blocks - 1 - n : n;
+
+        // get i value of first free entry
+        if (free_block_map[i] == 0) {
+            retval = i;
+            break;
+        }
+    }
+
+    record_stat(STAT_ALLOC, &start);
+    return retval;
+}
+
+/*
+    Name: has_free_blocks
+    Parameters: number of blocks needed
+    Return: int
+    Description: returns 1 if at least count blocks are free, the search stops as soon as
+    they are found
+*/
+int has_free_blocks(uint64_t count) {
+    for (uint64_t i = 0; i < geometry.num_blocks && count > 0; i++) {
+        if (free_block_map[i] == 0) {
+            count--;
+        }
+    }
+
+    return count == 0;
+}
+
+/*
+    Name: find_free_block_run
+    Parameters: number of blocks needed
+    Return: int64_t
+    Description: searches free block map for the first run of count consecutive free blocks,
+    returns the index of the first block or -1 if there is no such run. With placement on
+    the last run is taken, for the same reason as in find_free_block
+*/
+int64_t find_free_block_run(uint64_t count) {
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+
+    // scanning from the end, a run is complete at its lowest block
+    if (geometry.features & IMAGE_PLACEMENT) {
+        for (uint64_t n = 0; n < geometry.num_blocks; n++) {
+            if (free_block_map[geometry.num_blocks - 1 - n] != 0) {
+                run_length = 0;
+                continue;
+            }
+            if (++run_length == count) {
+                return geometry.num_blocks - 1 - n;
+            }
+        }
+
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        // a used block ends the current run, start counting again after it
+        if (free_block_map[i] != 0) {
+            run_start = i + 1;
+            run_length = 0;
+            continue;
+        }
+
+        if (++run_length == count) {
+            return run_start;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Name: pack_fragments
+    Parameters: data of a file's last block (or of a compressed block) and its length
+    Return: int64_t
+    Description: copies the data into the first run of free fragments big enough for it,
+    in a block already holding fragments or else in a free block. Returns the packed block
+    map entry for it, or -1 if there is no room
+*/
+int64_t pack_fragments(const void *data, uint64_t num_bytes) {
+    uint64_t fragment_size = geometry.block_size / FRAGS_PER_BLOCK;
+    int count = (num_bytes + fragment_size - 1) / fragment_size;
+    uint16_t run = (1U << count) - 1;
+
+    // first fit among the blocks that already hold fragments
+    int64_t block_idx = -1;
+    int start = 0;
+    for (uint64_t i = 0; i < geometry.num_blocks && block_idx == -1; i++) {
+        if (fragment_map[i] == 0) {
+            continue;
+        }
+        for (start = 0; start + count <= FRAGS_PER_BLOCK; start++) {
+            if ((fragment_map[i] & (run << start)) == 0) {
+                block_idx = i;
+                break;
+            }
+        }
+    }
+
+    // otherwise start a new shared block
+    if (block_idx == -1) {
+        block_idx = find_free_block();
+        if (block_idx == -1) {
+            return -1;
+        }
+        claim_block(block_idx);
+        start = 0;
+    }
+
+    memcpy((char *) block_data(block_idx) + start * fragment_size, data, num_bytes);
+    fragment_map[block_idx] |= run << start;
+    dirty_block_map[block_idx] = 1;
+
+    return PACKED_ENTRY | block_idx << 8 | start << 4 | (count - 1);
+}
+
+/*
+    Name: release_entry
+    Parameters: block map entry
+    Return: void
+    Description: drops a reference to the entry. Once the last one is gone it frees the block
+    the entry refers to, or the fragments of a packed tail (and the shared block with them
+    once no other tail is left in it). Holes are left alone
+*/
+void release_entry(int64_t entry) {
+    // a hole holds nothing, a shared entry stays with its other files
+    if (entry == HOLE_ENTRY || unshare_entry(entry)) {
+        return;
+    }
+
+    int64_t block_idx = entry_block(entry);
+
+    if (entry & PACKED_ENTRY) {
+        fragment_map[block_idx] &= ~entry_fragments(entry);
+        if (fragment_map[block_idx] != 0) {
+            return;
+        }
+    }
+
+    release_block(block_idx);
+}
+
+/*
+    Name: is_zero
+    Parameters: data and its length
+    Return: int
+    Description: returns 1 if every byte of the data is zero. Compares the data against
+    itself shifted by a byte, which lets memcmp run over it a vector at a time
+*/
+int is_zero(const void *data, uint64_t num_bytes) {
+    const char *bytes = data;
+
+    return num_bytes == 0 || (bytes[0] == 0 && memcmp(bytes, bytes + 1, num_bytes - 1) == 0);
+}
+
+/*
+    Name: fingerprint
+    Parameters: data and its length
+    Return: uint64_t
+    Description: 64 bit hash of the data for the dedup index. Four independent lanes each
+    take every fourth word, so the multiplies of a stripe of 32 bytes run side by side (or in
+    one vector), then the lanes and any leftover bytes are mixed together
+*/
+uint64_t fingerprint(const void *data, uint64_t length) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint8_t *bytes = data;
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, -prime1};
+
+    uint64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * sizeof(word), sizeof(word));
+            lanes[lane] += word * prime2;
+            lanes[lane] = ((lanes[lane] << 31) | (lanes[lane] >> 33)) * prime1;
+        }
+    }
+
+    uint64_t hash = length;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane] * prime1) * prime2;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ bytes[i]) * prime1;
+    }
+
+    // final avalanche so every input bit reaches every output bit
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+/*
+    Name: entry_matches
+    Parameters: block map entry from the fingerprint index, data of a full block and a
+    buffer of a block's size
+    Return: int
+    Description: returns 1 if the entry still holds a full block with exactly the data. The
+    index isn't updated when entries are freed, so the entry is checked to be in use before
+    its data is looked at (a slot read from the image is checked to be in range as well)
+*/
+int entry_matches(int64_t entry, const void *data, void *buffer) {
+    int64_t block_idx = entry_block(entry);
+    if (entry < 0 || block_idx >= (int64_t) geometry.num_blocks || !free_block_map[block_idx]) {
+        return 0;
+    }
+
+    // a block of its own, not one holding fragments
+    if (!(entry & PACKED_ENTRY)) {
+        return fragment_map[block_idx] == 0 &&
+               memcmp(block_data(block_idx), data, geometry.block_size) == 0;
+    }
+
+    // only full blocks that were compressed are indexed, packed tails never are
+    uint16_t fragments = entry_fragments(entry);
+    if (!(entry & COMPRESSED_ENTRY) || (fragment_map[block_idx] & fragments) != fragments) {
+        return 0;
+    }
+
+    uint64_t fragment_size = geometry.block_size / FRAGS_PER_BLOCK;
+    char *fragment = (char *) block_data(block_idx) + ((entry >> 4) & 0xF) * fragment_size;
+    uint32_t length;
+    memcpy(&length, fragment, sizeof(length));
+    if (length > ((entry & 0xF) + 1) * fragment_size - sizeof(length)) {
+        return 0;
+    }
+
+    return lz_decompress((uint8_t *) fragment + sizeof(length), length, buffer, geometry.block_size) ==
+           (int64_t) geometry.block_size && memcmp(buffer, data, geometry.block_size) == 0;
+}
+
+/*
+    Name: store_block
+    Parameters: inode of the file, index of the block within the file, its data and length,
+    its compressed form from compress_block and that length (0 if not compressed), and the
+    data block to use if it needs a whole one (-1 for the first free one)
+    Return: int
+    Description: stores one block of a file whose size is already set in the inode. Small
+    files go inline into the inode, all-zero blocks become holes, full blocks already in the
+    image are shared in dedup mode, compressed blocks and a short last block are packed into
+    fragments, anything else takes a data block of its own. Returns 0 on success and -1 if
+    there is no room
+*/
+int store_block(struct inode *inode, uint64_t i, const void *data, uint64_t num_bytes,
+                const void *compressed, uint64_t compressed_size, int64_t block_idx) {
+    // the whole file fits where its block map would go
+    if (i == 0 && inode->size <= inline_size()) {
+        memcpy(inode->blocks, data, num_bytes);
+        inode->flags |= INODE_INLINE;
+        return 0;
+    }
+
+    // the block map grows to the block's entry
+    reserve_blocks(inode, i + 1);
+
+    // zeros aren't stored at all, reads make them up again
+    if (is_zero(data, num_bytes)) {
+        inode->blocks[i] = HOLE_ENTRY;
+        return 0;
+    }
+
+    // in dedup mode a full block whose contents are already stored takes another reference
+    // to them, otherwise it is stored below and its slot in the index is taken over
+    struct fingerprint_slot *slot = NULL;
+    if (fingerprint_index && num_bytes == geometry.block_size) {
+        uint64_t hash = fingerprint(data, num_bytes);
+        slot = &fingerprint_index[hash % geometry.num_blocks];
+
+        if (slot->entry != -1 && slot->fingerprint == hash) {
+            char *buffer = malloc(geometry.block_size);
+            int match = entry_matches(slot->entry, data, buffer);
+            free(buffer);
+
+            if (match) {
+                share_entry(slot->entry);
+                inode->blocks[i] = slot->entry;
+                return 0;
+            }
+        }
+
+        slot->fingerprint = hash;
+        slot->entry = -1;
+    }
+
+    // compressed blocks take fewer fragments than the raw data would
+    if (compressed_size > 0) {
+        int64_t entry = pack_fragments(compressed, compressed_size);
+        if (entry != -1) {
+            inode->blocks[i] = entry | COMPRESSED_ENTRY;
+            if (slot) {
+                slot->entry = inode->blocks[i];
+            }
+            return 0;
+        }
+    }
+
+    // only the last block of a file can be short, pack it if it fills at most half a block
+    if (num_bytes <= geometry.block_size / 2) {
+        int64_t entry = pack_fragments(data, num_bytes);
+        if (entry != -1) {
+            inode->blocks[i] = entry;
+            return 0;
+        }
+    }
+
+    if (block_idx == -1) {
+        block_idx = find_free_block();
+        if (block_idx == -1) {
+            return -1;
+        }
+    }
+
+    memcpy(claim_block(block_idx), data, num_bytes);
+    inode->blocks[i] = block_idx;
+    if (slot) {
+        slot->entry = block_idx;
+    }
+
+    return 0;
+}
+
+/*
+    Name: share_blocks
+    Parameters: inode
+    Return: void
+    Description: takes another reference to every entry in the inode's block map, for a
+    copy of the inode that uses the same blocks
+*/
+void share_blocks(struct inode *inode) {
+    // an inline file's data comes along with the block map
+    if (inode->flags & INODE_INLINE) {
+        return;
+    }
+
+    for (uint64_t i = 0; inode->blocks[i] != -1; i++) {
+        if (inode->blocks[i] != HOLE_ENTRY) {
+            share_entry(inode->blocks[i]);
+        }
+    }
+}
+
+/*
+    Name: release_blocks
+    Parameters: inode
+    Return: void
+    Description: drops the inode's reference to every entry in its block map, freeing the
+    blocks no other file uses, and clears the block map
+*/
+void release_blocks(struct inode *inode) {
+    // an inline file holds no blocks, only its data needs clearing from the block map
+    if (inode->flags & INODE_INLINE) {
+        for (uint64_t i = 0; i * sizeof(int64_t) < inode->size; i++) {
+            inode->blocks[i] = -1;
+        }
+        inode->flags = 0;
+    }
+
+    // clear blocks array in inode entry and set corresponding blocks in free block map to not in use
+    for (uint64_t i = 0; inode->blocks[i] != -1; i++) {
+        release_entry(inode->blocks[i]);
+        inode->blocks[i] = -1;
+    }
+}
+
+/*
+    Name: release_inode
+    Parameters: index of an entry in the inode array
+    Return: void
+    Description: frees every block the inode holds and marks the inode free
+*/
+void release_inode(int64_t inode_idx) {
+    struct inode *inode = inode_array_ptr[inode_idx];
+
+    release_blocks(inode);
+
+    // clear inode entry and set its value in inode map to not in use
+    inode->date = 0;
+    inode->size = 0;
+    inode->valid = 0;
+    free_inode_map[inode_idx] = 0;
+}
+
+/*
+    Name: lookup
+    Parameters: inode of a directory and name of an entry in it
+    Return: int64_t
+    Description: finds the entry through the directory's index, returns its index in the
+    directory array or -1 if the directory has no such entry
+*/
+int64_t lookup(int64_t dir_inode, char *name) {
+    struct directory_index *index = inode_array_ptr[dir_inode]->index;
+
+    int64_t slot = index_slot(index, name);
+    if (slot == -1) {
+        return -1;
+    }
+
+    return index->slots[slot];
+}
+
+/*
+    Name: walk
+    Parameters: inode of a directory and a single path component
+    Return: int64_t
+    Description: steps from the directory to the component ("." and ".." included), returns
+    the inode reached or -1 if the component doesn't exist
+*/
+int64_t walk(int64_t dir_inode, char *component) {
+    if (!strcmp(component, ".")) {
+        return dir_inode;
+    }
+    if (!strcmp(component, "..")) {
+        return inode_array_ptr[dir_inode]->parent;
+    }
+
+    int64_t dir_idx = lookup(dir_inode, component);
+    if (dir_idx == -1) {
+        return -1;
+    }
+
+    return directory_array_ptr[dir_idx].inode_idx;
+}
+
+/*
+    Name: resolve_parent
+    Parameters: path and buffer (MAX_COMMAND_SIZE bytes) receiving its last component
+    Return: int64_t
+    Description: walks every component of the path but the last one, starting at the root for
+    absolute paths and at the working directory otherwise. Returns the inode of the directory
+    the last component is in, or -1 if a directory on the way doesn't exist or the path has
+    no last component
+*/
+int64_t resolve_parent(char *path, char *leaf) {
+    char buffer[MAX_COMMAND_SIZE];
+    strncpy(buffer, path, MAX_COMMAND_SIZE - 1);
+    buffer[MAX_COMMAND_SIZE - 1] = 0;
+
+    int64_t dir_inode = path[0] == '/' ? ROOT_INODE : cwd_inode;
+    leaf[0] = 0;
+
+    // every component seen so far except the latest is a directory to step into
+    char *save_ptr;
+    char *component = strtok_r(buffer, "/", &save_ptr);
+    while (component != NULL) {
+        char *next = strtok_r(NULL, "/", &save_ptr);
+        if (next == NULL) {
+            strcpy(leaf, component);
+            break;
+        }
+
+        dir_inode = walk(dir_inode, component);
+        if (dir_inode == -1 || inode_array_ptr[dir_inode]->type != TYPE_DIRECTORY) {
+            return -1;
+        }
+        component = next;
+    }
+
+    if (leaf[0] == 0) {
+        return -1;
+    }
+
+    return dir_inode;
+}
+
+/*
+    Name: resolve_inode
+    Parameters: path
+    Return: int64_t
+    Description: walks the whole path, returns the inode it names or -1 if it doesn't exist
+*/
+int64_t resolve_inode(char *path) {
+    // the root has no last component to look up
+    if (strspn(path, "/") == strlen(path) && path[0] == '/') {
+        return ROOT_INODE;
+    }
+
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t dir_inode = resolve_parent(path, leaf);
+    if (dir_inode == -1) {
+        return -1;
+    }
+
+    return walk(dir_inode, leaf);
+}
+
+/*
+    Name: find_directory_entry
+    Parameters: path of file in image
+    Return: int64_t
+    Description: resolves the path to its entry in the directory array, returns -1 if the file
+    is not in the image (or the path names the root, ".", or "..", which have no entry)
+*/
+int64_t find_directory_entry(char *filename) {
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t dir_inode = resolve_parent(filename, leaf);
+
+    if (dir_inode == -1 || !strcmp(leaf, ".") || !strcmp(leaf, "..")) {
+        return -1;
+    }
+
+    return lookup(dir_inode, leaf);
+}
+
+/*
+    Name: add_directory_entry
+    Parameters: inode of the directory, name of the new entry and the inode it refers to
+    Return: int64_t
+    Description: fills a free directory entry and adds it to the directory's index, returns
+    the entry's index or -1 if the directory array is full
+*/
+int64_t add_directory_entry(int64_t dir_inode, char *name, int64_t inode_idx) {
+    int64_t dir_idx = find_free_directory_entry();
+    if (dir_idx == -1) {
+        return -1;
+    }
+
+    directory_array_ptr[dir_idx].name = strdup(name);
+    directory_array_ptr[dir_idx].valid = 1;
+    directory_array_ptr[dir_idx].inode_idx = inode_idx;
+    directory_array_ptr[dir_idx].parent = dir_inode;
+    directory_array_ptr[dir_idx].h = 0;
+    directory_array_ptr[dir_idx].r = 0;
+
+    index_insert(inode_array_ptr[dir_inode]->index, dir_idx);
+
+    return dir_idx;
+}
+
+/*
+    Name: remove_directory_entry
+    Parameters: index of an entry in the directory array
+    Return: void
+    Description: removes the entry from its directory's index and clears it
+*/
+void remove_directory_entry(int64_t dir_idx) {
+    index_remove(inode_array_ptr[directory_array_ptr[dir_idx].parent]->index,
+                 directory_array_ptr[dir_idx].name);
+
+    // clear directory entry
+    free(directory_array_ptr[dir_idx].name);
+    directory_array_ptr[dir_idx].name = NULL;
+    directory_array_ptr[dir_idx].valid = 0;
+    directory_array_ptr[dir_idx].inode_idx = -1;
+    directory_array_ptr[dir_idx].parent = -1;
+    directory_array_ptr[dir_idx].h = 0;
+    directory_array_ptr[dir_idx].r = 0;
+}
+
+/*
+    Name: check_new_entry
+    Parameters: name of the command, path of the entry to create and buffer (MAX_COMMAND_SIZE
+    bytes) receiving the new entry's name
+    Return: int64_t
+    Description: checks that the path can name a new entry, returns the inode of the
+    directory to create it in or -1 after printing why it can't
+*/
+int64_t check_new_entry(char *command, char *path, char *leaf) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t dir_inode = resolve_parent(path, leaf);
+    int64_t existing = dir_inode == -1 ? -1 : lookup(dir_inode, leaf);
+    record_stat(STAT_DIR_SEARCH, &start);
+
+    if (dir_inode == -1 || !strcmp(leaf, ".") || !strcmp(leaf, "..")) {
+        fprintf(output_fp, "%s error: File not found\n", command);
+        return -1;
+    }
+
+    if (strlen(leaf) > MAX_FILENAME) {
+        fprintf(output_fp, "%s error: File name too long\n", command);
+        return -1;
+    }
+
+    if (existing != -1) {
+        fprintf(output_fp, "%s error: File already exists\n", command);
+        return -1;
+    }
+
+    return dir_inode;
+}
+
+// a batch of blocks being compressed, each thread takes every num_threads'th block
+// starting at its own index
+struct compress_job {
+    char *data;                     // blocks to compress, a block size apart
+    uint64_t *lengths;              // bytes in each block
+    char *compressed;               // compressed blocks, a block size apart
+    uint64_t *compressed_sizes;     // length of each compressed block, 0 if not compressed
+    uint64_t count;                 // blocks in the batch
+    int thread;
+    int num_threads;
+};
+
+/*
+    Name: compress_worker
+    Parameters: pointer to a compress job
+    Return: void pointer
+    Description: compresses the job's share of the blocks in the batch
+*/
+void *compress_worker(void *arg) {
+    struct compress_job *job = arg;
+
+    for (uint64_t i = job->thread; i < job->count; i += job->num_threads) {
+        job->compressed_sizes[i] = compress_block(job->data + i * geometry.block_size, job->lengths[i],
+                                                  job->compressed + i * geometry.block_size);
+    }
+
+    return NULL;
+}
+
+/*
+    Name: compress_batch
+    Parameters: compress job describing the batch
+    Return: void
+    Description: compresses every block of the batch, spread over one thread per core
+*/
+void compress_batch(struct compress_job *batch) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cores < 1 ? 1 : cores > MAX_COMPRESS_THREADS ? MAX_COMPRESS_THREADS : cores;
+    if ((uint64_t) num_threads > batch->count) {
+        num_threads = batch->count;
+    }
+
+    // the calling thread takes the first share itself
+    pthread_t threads[MAX_COMPRESS_THREADS];
+    struct compress_job jobs[MAX_COMPRESS_THREADS];
+    for (int t = 0; t < num_threads; t++) {
+        jobs[t] = *batch;
+        jobs[t].thread = t;
+        jobs[t].num_threads = num_threads;
+        if (t > 0) {
+            pthread_create(&threads[t], NULL, compress_worker, &jobs[t]);
+        }
+    }
+
+    compress_worker(&jobs[0]);
+
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/*
+    Name: put_stream
+    Parameters: path the data is stored under, stream to read the data from and the
+    number of bytes to read
+    Return: int
+    Description: reads size bytes from the stream into the file image system, returns 0 on
+    success and -1 on failure
+*/
+int put_stream(char *filename, FILE *fp, uint64_t size) {
+    // find the directory the file goes into and make sure the name is free
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t dir_inode = check_new_entry("put", filename, leaf);
+    if (dir_inode == -1) {
+        return -1;
+    }
+
+    // there is no check against df here, zero blocks take no space so a sparse file can be
+    // larger than the free space. Running out is caught while the blocks are stored
+
+    // check if file size is greater than supported max file size
+    if (size > geometry.max_file_size) {
+        fprintf(output_fp, "put error: File size too big\n");
+        return -1;
+    }
+
+    // try to find a free directory entry and a free inode
+    int64_t dir_idx = find_free_directory_entry();
+    int64_t inode_idx = find_free_inode();
+
+    // if -1 returned, no space in directory array or no inode available, so print error message
+    if (dir_idx == -1 || inode_idx == -1) {
+        fprintf(output_fp, "put error: Not enough disk space\n");
+        return -1;
+    }
+
+    // populate inode entry fields
+    struct inode *inode = alloc_inode(inode_idx);
+    inode->date = time(NULL);
+    inode->size = size;
+    inode->valid = 1;
+    inode->parent = dir_inode;
+
+    // update free inode map
+    free_inode_map[inode_idx] = 1;
+
+    // Save off the size of the input file since we'll use it in a couple of places and
+    // also initialize our index variables to zero.
+    uint64_t copy_size = size;
+
+    // We want to copy and write in chunks of BLOCK_SIZE. So to do this
+    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
+    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
+    off_t offset = 0;
+
+    // chunks are read a batch at a time, so an image that compresses can compress the whole
+    // batch in parallel. Where each chunk ends up (inline, a hole, packed into fragments or
+    // in a block of its own) is decided once it is read
+    int compress = geometry.features & IMAGE_COMPRESS;
+    uint64_t lengths[COMPRESS_BATCH];
+
+    // with placement on, blocks are taken from the end of the data region. A file that fits
+    // in the last free run goes into it in order, rather than one block at a time backwards
+    int64_t run_start = -1;
+    if ((geometry.features & IMAGE_PLACEMENT) && size > inline_size()) {
+        run_start = find_free_block_run(blocks_for(size));
+    }
+    uint64_t compressed_sizes[COMPRESS_BATCH] = {0};
+    struct compress_job batch = {
+        malloc(COMPRESS_BATCH * geometry.block_size), lengths,
+        compress ? malloc(COMPRESS_BATCH * geometry.block_size) : NULL, compressed_sizes, 0, 0, 1
+    };
+    int retval = 0;
+
+    // copy_size is initialized to the size of the input file so each loop iteration we
+    // will copy a batch of BLOCK_SIZE chunks from the file then reduce our copy_size counter
+    // by the bytes read. When copy_size is zero we know we have copied all the data from
+    // the input file (the last block holds the remainder).
+    struct timespec start;
+    for (uint64_t i = 0; copy_size > 0 && retval == 0; i += batch.count) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (batch.count = 0; batch.count < COMPRESS_BATCH && copy_size > 0; batch.count++) {
+            // Index into the input file by offset number of bytes.  Initially offset is set to
+            // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We
+            // then increase the offset by BLOCK_SIZE and continue the process.  This will
+            // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
+            fseeko(fp, offset, SEEK_SET);
+
+            // Read BLOCK_SIZE number of bytes (or the remainder) from the input file
+            uint64_t num_bytes = copy_size < geometry.block_size ? copy_size : geometry.block_size;
+            size_t bytes = fread(batch.data + batch.count * geometry.block_size, num_bytes, 1, fp);
+
+            // If bytes == 0 the input file ended early or couldn't be read, so undo the put
+            if (bytes == 0) {
+                fprintf(output_fp, "An error occured reading from the input file.\n");
+                retval = -1;
+                break;
+            }
+            lengths[batch.count] = num_bytes;
+
+            // Reduce copy_size by the bytes copied and increase the offset into our input
+            // file by BLOCK_SIZE.  This will allow the fseek at the top of the loop to
+            // position us to the correct spot.
+            copy_size -= num_bytes;
+            offset += num_bytes;
+        }
+
+        record_stat(STAT_PUT_READ, &start);
+
+        if (retval == 0 && compress) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            compress_batch(&batch);
+            record_stat(STAT_PUT_COMPRESS, &start);
+        }
+
+        // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big
+        // memory pool. Why? We are simulating the way the file system stores file data in
+        // blocks of space on the disk. store_block records where each chunk went in the
+        // blocks array of the inode.
+        // If there is no room left, print error message and undo the put
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t j = 0; j < batch.count && retval == 0; j++) {
+            char *compressed = compress ? batch.compressed + j * geometry.block_size : NULL;
+
+            // fragments packed meanwhile may have taken a block of the run
+            int64_t block_idx = run_start != -1 ? run_start + (int64_t) (i + j) : -1;
+            if (block_idx != -1 && free_block_map[block_idx]) {
+                block_idx = -1;
+            }
+            if (store_block(inode, i + j, batch.data + j * geometry.block_size, lengths[j],
+                            compressed, compressed_sizes[j], block_idx) == -1) {
+                fprintf(output_fp, "put error: Not enough disk space\n");
+                retval = -1;
+            }
+        }
+        record_stat(STAT_PUT_STORE, &start);
+    }
+
+    free(batch.data);
+    free(batch.compressed);
+
+    // release the inode along with the blocks it already holds
+    if (retval == -1) {
+        release_inode(inode_idx);
+        return -1;
+    }
+
+    // populate directory entry fields once the data is in place
+    add_directory_entry(dir_inode, leaf, inode_idx);
+    count_stat(COUNT_BYTES_PUT, size);
+
+    return 0;
+}
+
+/*
+    Name: put
+    Parameters: filename of file being put into image and path to store it under (NULL to
+    use the same name)
+    Return: int
+    Description: will open file and try to read the file into file image system,
+    returns 0 on success and -1 on failure
+*/
+int put(char *filename, char *image_filename) {
+    // create stat struct and try reading file into it
+    struct stat buf;
+    int status = stat(filename, &buf);
+
+    // if invalid name entered, print error message
+    if (status == -1) {
+        fprintf(output_fp, "put error: File not found\n");
+        return -1;
+    }
+
+    // open file now to read into data blocks
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(output_fp, "put error: File not found\n");
+        return -1;
+    }
+
+    // copy the file contents into the image, under the same name unless told otherwise
+    int retval = put_stream(image_filename ? image_filename : filename, fp, buf.st_size);
+
+    // close file pointer
+    fclose(fp);
+
+    return retval;
+}
+
+/*
+    Name: write_stream
+    Parameters: path of a file in the image, stream to read the data from, offset in the file
+    to write it at and the number of bytes to read
+    Return: int
+    Description: overwrites part of the file with data from the stream, growing the file if
+    the data runs past its end (a gap before the offset reads as zeros). Only the blocks the
+    write touches are stored again, blocks the file shares with clones or duplicates are
+    copied first and the other files keep the old data. Returns 0 on success and -1 on failure
+*/
+int write_stream(char *filename, FILE *fp, uint64_t offset, uint64_t length) {
+    int64_t dir_idx = find_directory_entry(filename);
+    if (dir_idx == -1) {
+        fprintf(output_fp, "write error: File not found\n");
+        return -1;
+    }
+
+    int64_t inode_idx = directory_array_ptr[dir_idx].inode_idx;
+    struct inode *inode = inode_array_ptr[inode_idx];
+
+    if (inode->type == TYPE_DIRECTORY) {
+        fprintf(output_fp, "write error: Is a directory\n");
+        return -1;
+    }
+
+    if (directory_array_ptr[dir_idx].r) {
+        fprintf(output_fp, "write error: File is read-only\n");
+        return -1;
+    }
+
+    uint64_t old_size = inode->size;
+    uint64_t new_size = offset + length > old_size ? offset + length : old_size;
+    if (offset > geometry.max_file_size || new_size > geometry.max_file_size) {
+        fprintf(output_fp, "write error: File size too big\n");
+        return -1;
+    }
+
+    char *data = malloc(length + 1);
+    if (length > 0 && fread(data, length, 1, fp) != 1) {
+        fprintf(output_fp, "An error occured reading from the input file.\n");
+        free(data);
+        return -1;
+    }
+
+    // wait for any in-flight reads of the file to finish before changing its blocks
+    pthread_rwlock_wrlock(inode_lock(inode_idx));
+    inode->date = time(NULL);
+
+    // a file that stays small enough is changed in place in its inode
+    if (inode->flags & INODE_INLINE && new_size <= inline_size()) {
+        memset((char *) inode->blocks + old_size, 0, new_size - old_size);
+        memcpy((char *) inode->blocks + offset, data, length);
+        inode->size = new_size;
+        pthread_rwlock_unlock(inode_lock(inode_idx));
+        free(data);
+        return 0;
+    }
+
+    // the blocks the data lands in, along with a short last block the file grows past (or
+    // the first block of an inline file), which has to be stored again at its new length
+    uint64_t old_blocks = blocks_for(old_size);
+    uint64_t first = length > 0 ? offset / geometry.block_size : UINT64_MAX;
+    uint64_t last = length > 0 ? (offset + length - 1) / geometry.block_size : 0;
+    if (new_size > old_size && old_size % geometry.block_size != 0) {
+        if (old_blocks - 1 < first) {
+            first = old_blocks - 1;
+        }
+        if (old_blocks - 1 > last) {
+            last = old_blocks - 1;
+        }
+    }
+
+    // nothing is changed until the write is known to go through: the old data of every
+    // block it touches has to be intact, and every block not changed where it is may need
+    // a free block of its own
+    uint64_t needed = 0;
+    for (uint64_t i = first; i <= last && first != UINT64_MAX; i++) {
+        int64_t old_entry = (inode->flags & INODE_INLINE) || i >= old_blocks ? HOLE_ENTRY : inode->blocks[i];
+        if (old_entry >= 0 && !(old_entry & PACKED_ENTRY) && share_slot(old_entry) == -1) {
+            block_data(old_entry);
+        }
+        else {
+            needed++;
+            if (old_entry != HOLE_ENTRY) {
+                block_data(entry_block(old_entry));
+            }
+        }
+
+        if (old_entry != HOLE_ENTRY && corrupt_block_map[entry_block(old_entry)]) {
+            fprintf(output_fp, "write error: Checksum mismatch in block %" PRId64 "\n", entry_block(old_entry));
+            pthread_rwlock_unlock(inode_lock(inode_idx));
+            free(data);
+            return -1;
+        }
+    }
+    if (!has_free_blocks(needed)) {
+        fprintf(output_fp, "write error: Not enough disk space\n");
+        pthread_rwlock_unlock(inode_lock(inode_idx));
+        free(data);
+        return -1;
+    }
+
+    // an inline file outgrowing its inode becomes a file with an empty block map whose old
+    // contents are written back as part of the first block
+    char *inline_data = NULL;
+    if (inode->flags & INODE_INLINE) {
+        inline_data = malloc(old_size + 1);
+        memcpy(inline_data, inode->blocks, old_size);
+        for (uint64_t i = 0; i * sizeof(int64_t) < old_size; i++) {
+            inode->blocks[i] = -1;
+        }
+        inode->flags &= ~INODE_INLINE;
+    }
+
+    // blocks the file grows by start out as holes
+    reserve_blocks(inode, blocks_for(new_size));
+    for (uint64_t i = old_blocks; i < blocks_for(new_size); i++) {
+        inode->blocks[i] = HOLE_ENTRY;
+    }
+
+    inode->size = new_size;
+
+    char *buffer = malloc(geometry.block_size);
+    char *compressed = malloc(geometry.block_size);
+    char *expanded = malloc(geometry.block_size);
+    int retval = 0;
+
+    for (uint64_t i = first; i <= last && first != UINT64_MAX; i++) {
+        uint64_t block_start = i * geometry.block_size;
+        uint64_t block_length = new_size - block_start < geometry.block_size ?
+                                new_size - block_start : geometry.block_size;
+        uint64_t old_length = 0;
+        if (old_size > block_start) {
+            old_length = old_size - block_start < geometry.block_size ? old_size - block_start :
+                         geometry.block_size;
+        }
+        int64_t old_entry = inline_data ? HOLE_ENTRY : inode->blocks[i];
+
+        // bytes of the block the data covers
+        uint64_t from = 0;
+        uint64_t to = 0;
+        if (length > 0 && offset < block_start + block_length && offset + length > block_start) {
+            from = offset > block_start ? offset - block_start : 0;
+            to = offset + length - block_start < block_length ? offset + length - block_start :
+                 block_length;
+        }
+
+        // a block of its own nobody else references is changed where it is
+        if (old_entry >= 0 && !(old_entry & PACKED_ENTRY) && share_slot(old_entry) == -1) {
+            char *block = block_data(old_entry);
+            memset(block + old_length, 0, geometry.block_size - old_length);
+            if (to > from) {
+                memcpy(block + from, data + block_start + from - offset, to - from);
+            }
+            dirty_block_map[old_entry] = 1;
+            continue;
+        }
+
+        // otherwise copy the old contents out, apply the write and store the result anew
+        memset(buffer, 0, geometry.block_size);
+        if (inline_data) {
+            memcpy(buffer, inline_data, old_length);
+        }
+        else if (old_length > 0) {
+            memcpy(buffer, entry_data(old_entry, expanded), old_length);
+        }
+        if (to > from) {
+            memcpy(buffer + from, data + block_start + from - offset, to - from);
+        }
+
+        uint64_t compressed_size = 0;
+        if (geometry.features & IMAGE_COMPRESS) {
+            compressed_size = compress_block(buffer, block_length, compressed);
+        }
+
+        if (store_block(inode, i, buffer, block_length, compressed, compressed_size, -1) == -1) {
+            fprintf(output_fp, "write error: Not enough disk space\n");
+            inode->blocks[i] = old_entry;
+            retval = -1;
+            break;
+        }
+
+        // the old entry goes only after its data was copied, so a shared one stays with
+        // the files still referencing it
+        release_entry(old_entry);
+    }
+
+    pthread_rwlock_unlock(inode_lock(inode_idx));
+
+    free(buffer);
+    free(compressed);
+    free(expanded);
+    free(inline_data);
+    free(data);
+
+    return retval;
+}
+
+/*
+    Name: write_file
+    Parameters: filename of the host file holding the data, path of the file in the image
+    and the offset to write at
+    Return: int
+    Description: writes the host file's contents into the file in the image at the offset,
+    returns 0 on success and -1 on failure
+*/
+int write_file(char *filename, char *image_filename, uint64_t offset) {
+    struct stat buf;
+    if (stat(filename, &buf) == -1) {
+        fprintf(output_fp, "write error: File not found\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(output_fp, "write error: File not found\n");
+        return -1;
+    }
+
+    int retval = write_stream(image_filename, fp, offset, buf.st_size);
+
+    fclose(fp);
+
+    return retval;
+}
+
+/*
+    Name: get_stream
+    Parameters: index of the file's inode, stream being written to, and the offset and length
+    of the byte range to write
+    Return: int
+    Description: writes the byte range of the file stored at the inode into the stream, the
+    range is cut off at the end of the file. Returns 0 on success and -1 if a block doesn't
+    match its checksum
+*/
+int get_stream(int64_t inode_idx, FILE *fp, uint64_t offset, uint64_t length) {
+    struct inode *inode = inode_array_ptr[inode_idx];
+
+    // mfsd readers of the file share its lock, so the access count goes up atomically
+    __atomic_add_fetch(&inode->reads, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&inode->last_read, time(NULL), __ATOMIC_RELAXED);
+
+    // nothing to write past the end of the file
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (length > inode->size - offset) {
+        length = inode->size - offset;
+    }
+
+    // an inline file is written straight out of the inode
+    if (inode->flags & INODE_INLINE) {
+        fwrite((char *) inode->blocks + offset, length, 1, fp);
+        count_stat(COUNT_BYTES_GOT, length);
+        return 0;
+    }
+
+    // Now that we have the inode of the file in the image, we can iterate through its block array
+    // and copy the blocks covering the range into the file (compressed blocks are expanded
+    // into the buffer first)
+    char *buffer = malloc(geometry.block_size);
+    while (length > 0) {
+        // The range may start and end in the middle of a block, so only copy from the
+        // offset within the block up to the end of the block or of the range, whichever
+        // comes first. If we copied BLOCK_SIZE number of bytes we'd end up with garbage
+        // at the end of the file.
+        uint64_t block_offset = offset % geometry.block_size;
+        uint64_t num_bytes = geometry.block_size - block_offset;
+        if (num_bytes > length) {
+            num_bytes = length;
+        }
+
+        // Write num_bytes number of bytes from our data array into our output file
+        // (a packed tail is read from its fragments in the shared block, a hole from
+        // zero_block without loading anything)
+        int64_t entry = inode->blocks[offset / geometry.block_size];
+        char *data = entry_data(entry, buffer);
+
+        // the block was checked against its checksum when it was loaded
+        if (entry != HOLE_ENTRY && corrupt_block_map[entry_block(entry)]) {
+            fprintf(output_fp, "get error: Checksum mismatch in block %" PRId64 "\n", entry_block(entry));
+            free(buffer);
+            return -1;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fwrite(data + block_offset, num_bytes, 1, fp);
+        record_stat(STAT_GET_WRITE, &start);
+        count_stat(COUNT_BYTES_GOT, num_bytes);
+
+        // Reduce the amount of bytes remaining to copy, increase the offset into the file
+        length -= num_bytes;
+        offset += num_bytes;
+    }
+
+    free(buffer);
+
+    return 0;
+}
+
+/*
+    Name: get_entry
+    Parameters: filename of file in image
+    Return: int64_t
+    Description: directory entry of the file a get retrieves, -1 if there is no such file or
+    it's a directory
+*/
+int64_t get_entry(char *image_filename) {
+    // first, see if the image file actually exists
+    int64_t dir_idx = find_directory_entry(image_filename);
+
+    // if dir_idx is -1, the file cold not be found, so print error message
+    if (dir_idx == -1) {
+        fprintf(output_fp, "get error: File not found\n");
+        return -1;
+    }
+
+    // only regular files have contents to retrieve
+    if (inode_array_ptr[directory_array_ptr[dir_idx].inode_idx]->type == TYPE_DIRECTORY) {
+        fprintf(output_fp, "get error: Is a directory\n");
+        return -1;
+    }
+
+    return dir_idx;
+}
+
+/*
+    Name: get
+    Parameters: filename of file in image, filename of file getting written to, and the offset
+    and length of the byte range to retrieve (0 and UINT64_MAX for the whole file)
+    Return: int
+    Description: retrieve file from image and write it into a file in the curent working directory,
+    returns 0 on success and -1 on failure
+*/
+int get(char *image_filename, char *out_filename, uint64_t offset, uint64_t length) {
+    int64_t dir_idx = get_entry(image_filename);
+    if (dir_idx == -1) {
+        return -1;
+    }
+
+    // if no output filename given, set it equal to the name of the file in the image
+    if (!out_filename) {
+        out_filename = directory_array_ptr[dir_idx].name;
+    }
+
+    // try opening output filename for writing
+    FILE *fp = fopen(out_filename, "w");
+    if (!fp) {
+        fprintf(output_fp, "get error: File not found\n");
+        return -1;
+    }
+
+    // get inode index using directory index and copy its blocks into the file
+    int retval = get_stream(directory_array_ptr[dir_idx].inode_idx, fp, offset, length);
+
+    // close file pointer
+    fclose(fp);
+
+    return retval;
+}
+
+/*
+    Name: compare_entries
+    Parameters: pointers to two directory entry indices
+    Return: int
+    Description: qsort comparator ordering directory entries by their index
+*/
+int compare_entries(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+    Name: list
+    Parameters: path of the directory to list (NULL for the working directory) and a flag that
+    indicates if the user wants to also list hidden files
+    Return: void
+    Description: looks through the directory's index and prints its valid entries
+*/
+void list(char *path, int list_hidden) {
+    int64_t dir_inode = path ? resolve_inode(path) : cwd_inode;
+
+    if (dir_inode == -1 || inode_array_ptr[dir_inode]->type != TYPE_DIRECTORY) {
+        fprintf(output_fp, "list error: Directory not found\n");
+        return;
+    }
+
+    // gather the directory's entries and list them in the order they were created in
+    struct directory_index *index = inode_array_ptr[dir_inode]->index;
+    int64_t *entries = malloc((index->count + 1) * sizeof(int64_t));
+    uint64_t num_entries = 0;
+    for (uint64_t i = 0; i < index->capacity; i++) {
+        if (index->slots[i] >= 0) {
+            entries[num_entries++] = index->slots[i];
+        }
+    }
+    qsort(entries, num_entries, sizeof(int64_t), compare_entries);
+
+    // keep count of files listed
+    int count = 0;
+
+    for (uint64_t i = 0; i < num_entries; i++) {
+        int64_t dir_idx = entries[i];
+
+        // if file is hidden and flag is not set, skip loop iteration
+        if (directory_array_ptr[dir_idx].h && !list_hidden) {
+            continue;
+        }
+
+        // get inode of entry
+        struct inode *inode = inode_array_ptr[directory_array_ptr[dir_idx].inode_idx];
+
+        // get date and size of file from inode
+        time_t date = inode->date;
+        uint64_t size = inode->size;
+
+        // ctime_r returns a string with a newline so strip it
+        // (reentrant version since mfsd workers may list concurrently)
+        char date_string[26];
+        ctime_r(&date, date_string);
+        trim(date_string);
+
+        // print out list information, directories are marked with a trailing slash
+        fprintf(output_fp, "%-8" PRIu64 " %s %s%s\n", size, date_string, directory_array_ptr[dir_idx].name,
+                inode->type == TYPE_DIRECTORY ? "/" : "");
+
+        // increment count
+        count++;
+    }
+
+    free(entries);
+
+    // if count is 0, no files were listed
+    if (count == 0) {
+        fprintf(output_fp, "list: No files found.\n");
+    }
+}
+
+/*
+    Name: attrib
+    Parameters: flags that see which attribute to set and the filename of the file that the
+    user wants to set the attribute for
+    Return: void
+    Description: looks for the file in the directory entry and sets according attribute
+*/
+void attrib(int set_h, int set_r, char *filename) {
+    // first, look for file in directory array
+    int64_t dir_idx = find_directory_entry(filename);
+
+    // if file not found, output error message
+    if (dir_idx == -1 ) {
+        fprintf(output_fp, "attrib error: File not found\n");
+        return;
+    }
+
+    // if set_h flag is -1, user wants to set read-only instead
+    if (set_h == -1) {
+        directory_array_ptr[dir_idx].r = set_r;
+    }
+    // if set_r flag is -1, user wants to set hidden instead
+    else if (set_r == -1) {
+        directory_array_ptr[dir_idx].h = set_h;
+    }
+}
+
+/*
+    Name: del
+    Parameters: filename of file to delete
+    Return: int
+    Description: deletes the provided file from the file system image, returns 0 on success
+    and -1 on failure
+*/
+int del(char *filename) {
+    // first, look for file in directory array
+    int64_t dir_idx = find_directory_entry(filename);
+
+    // if file not found or read-only, output error message
+    if (dir_idx == -1 || directory_array_ptr[dir_idx].r) {
+        fprintf(output_fp, "attrib error: File not found\n");
+        return -1;
+    }
+
+    // get inode index of entry
+    int64_t inode_idx = directory_array_ptr[dir_idx].inode_idx;
+
+    // directories are removed with rmdir
+    if (inode_array_ptr[inode_idx]->type == TYPE_DIRECTORY) {
+        fprintf(output_fp, "del error: Is a directory\n");
+        return -1;
+    }
+
+    // wait for any in-flight reads of the file to finish before releasing its blocks
+    pthread_rwlock_wrlock(inode_lock(inode_idx));
+
+    // clear directory entry
+    remove_directory_entry(dir_idx);
+
+    // clear inode entry and its blocks
+    release_inode(inode_idx);
+
+    pthread_rwlock_unlock(inode_lock(inode_idx));
+
+    return 0;
+}
+
+/*
+    Name: clone_file
+    Parameters: path of the file to clone and path of the new file
+    Return: int
+    Description: creates a new file sharing every block of the source file, the block map is
+    copied and each entry takes another reference, no data is copied. A later write to
+    either file copies just the blocks it touches. Returns 0 on success and -1 on failure
+*/
+int clone_file(char *filename, char *new_filename) {
+    int64_t src_dir_idx = find_directory_entry(filename);
+    if (src_dir_idx == -1) {
+        fprintf(output_fp, "clone error: File not found\n");
+        return -1;
+    }
+
+    struct inode *src_inode = inode_array_ptr[directory_array_ptr[src_dir_idx].inode_idx];
+    if (src_inode->type == TYPE_DIRECTORY) {
+        fprintf(output_fp, "clone error: Is a directory\n");
+        return -1;
+    }
+
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t dir_inode = check_new_entry("clone", new_filename, leaf);
+    if (dir_inode == -1) {
+        return -1;
+    }
+
+    int64_t inode_idx = find_free_inode();
+    if (inode_idx == -1 || find_free_directory_entry() == -1) {
+        fprintf(output_fp, "clone error: Not enough disk space\n");
+        return -1;
+    }
+
+    struct inode *inode = alloc_inode(inode_idx);
+    inode->date = time(NULL);
+    inode->size = src_inode->size;
+    inode->valid = 1;
+    inode->flags = src_inode->flags;
+    inode->parent = dir_inode;
+    copy_block_map(inode, src_inode);
+    share_blocks(inode);
+
+    free_inode_map[inode_idx] = 1;
+    add_directory_entry(dir_inode, leaf, inode_idx);
+
+    return 0;
+}
+
+/*
+    Name: copy_inode
+    Parameters: inode to copy into and inode to copy
+    Return: void
+    Description: copies the attributes and the block map (or inline data) of an inode, the
+    name index of a directory isn't copied
+*/
+void copy_inode(struct inode *dst, struct inode *src) {
+    dst->date = src->date;
+    dst->size = src->size;
+    dst->valid = src->valid;
+    dst->type = src->type;
+    dst->flags = src->flags;
+    dst->parent = src->parent;
+    dst->reads = __atomic_load_n(&src->reads, __ATOMIC_RELAXED);
+    dst->last_read = __atomic_load_n(&src->last_read, __ATOMIC_RELAXED);
+    copy_block_map(dst, src);
+}
+
+/*
+    Name: find_snapshot
+    Parameters: name of a snapshot
+    Return: int64_t
+    Description: returns the index of the snapshot with the name or -1 if there is none
+*/
+int64_t find_snapshot(char *name) {
+    for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+        if (!strcmp(snapshots[i].name, name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Name: snapshot_create
+    Parameters: name of the new snapshot
+    Return: int
+    Description: copies the directory, the free inode map and the inodes in use into a new
+    snapshot. Only metadata is copied, every entry the inodes use takes another reference so
+    later changes to the files copy the blocks instead. Returns 0 on success and -1 on failure
+*/
+int snapshot_create(char *name) {
+    if (strlen(name) > MAX_FILENAME) {
+        fprintf(output_fp, "snapshot error: Name too long\n");
+        return -1;
+    }
+    if (find_snapshot(name) != -1) {
+        fprintf(output_fp, "snapshot error: Snapshot already exists\n");
+        return -1;
+    }
+    if (geometry.num_snapshots == MAX_SNAPSHOTS) {
+        fprintf(output_fp, "snapshot error: Too many snapshots\n");
+        return -1;
+    }
+
+    struct snapshot *snapshot = &snapshots[geometry.num_snapshots++];
+    strcpy(snapshot->name, name);
+    snapshot->date = time(NULL);
+    snapshot->directory = malloc(geometry.num_inodes * sizeof(struct directory_entry));
+    snapshot->free_inode_map = malloc(geometry.num_inodes * sizeof(uint8_t));
+    snapshot->inodes = calloc(geometry.num_inodes, sizeof(struct inode *));
+
+    memcpy(snapshot->free_inode_map, free_inode_map, geometry.num_inodes * sizeof(uint8_t));
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        snapshot->directory[i] = directory_array_ptr[i];
+        if (directory_array_ptr[i].name) {
+            snapshot->directory[i].name = strdup(directory_array_ptr[i].name);
+        }
+
+        if (free_inode_map[i]) {
+            snapshot->inodes[i] = new_inode();
+            copy_inode(snapshot->inodes[i], inode_array_ptr[i]);
+            share_blocks(snapshot->inodes[i]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Name: snapshot_list
+    Parameters: None
+    Return: void
+    Description: prints the date, name and number of files of every snapshot
+*/
+void snapshot_list() {
+    for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+        uint64_t files = 0;
+        for (uint64_t j = 0; j < geometry.num_inodes; j++) {
+            if (snapshots[i].free_inode_map[j] && snapshots[i].inodes[j]->type == TYPE_FILE) {
+                files++;
+            }
+        }
+
+        // ctime_r returns a string with a newline so strip it
+        char date_string[26];
+        ctime_r(&snapshots[i].date, date_string);
+        trim(date_string);
+
+        fprintf(output_fp, "%s %s (%" PRIu64 " files)\n", date_string, snapshots[i].name, files);
+    }
+
+    if (geometry.num_snapshots == 0) {
+        fprintf(output_fp, "snapshot: No snapshots found.\n");
+    }
+}
+
+/*
+    Name: snapshot_restore
+    Parameters: name of a snapshot
+    Return: int
+    Description: replaces the directory, the free inode map and the inodes with the
+    snapshot's copies. The snapshot is kept, the restored inodes take their own references
+    to its entries and blocks only the replaced files used are freed. Returns 0 on success
+    and -1 if there is no such snapshot
+*/
+int snapshot_restore(char *name) {
+    int64_t idx = find_snapshot(name);
+    if (idx == -1) {
+        fprintf(output_fp, "snapshot error: Snapshot not found\n");
+        return -1;
+    }
+    struct snapshot *snapshot = &snapshots[idx];
+
+    // reference the snapshot's entries before dropping the live ones, so blocks both use
+    // are never freed in between
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (snapshot->free_inode_map[i]) {
+            share_blocks(snapshot->inodes[i]);
+        }
+    }
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (free_inode_map[i]) {
+            release_blocks(inode_array_ptr[i]);
+        }
+    }
+
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        free(directory_array_ptr[i].name);
+        directory_array_ptr[i] = snapshot->directory[i];
+        if (snapshot->directory[i].name) {
+            directory_array_ptr[i].name = strdup(snapshot->directory[i].name);
+        }
+
+        // alloc_inode drops the name index of a directory that was there
+        if (snapshot->free_inode_map[i] || inode_array_ptr[i]) {
+            struct inode *inode = alloc_inode(i);
+            if (snapshot->free_inode_map[i]) {
+                copy_inode(inode, snapshot->inodes[i]);
+                if (inode->type == TYPE_DIRECTORY) {
+                    inode->index = new_directory_index();
+                }
+            }
+        }
+    }
+    memcpy(free_inode_map, snapshot->free_inode_map, geometry.num_inodes * sizeof(uint8_t));
+
+    // the working directory may not exist in the snapshot
+    index_directories();
+    cwd_inode = ROOT_INODE;
+
+    return 0;
+}
+
+/*
+    Name: snapshot_delete
+    Parameters: name of a snapshot
+    Return: int
+    Description: drops the snapshot's references to its entries, freeing the blocks no file
+    or other snapshot uses, and removes it. Returns 0 on success and -1 if there is no such
+    snapshot
+*/
+int snapshot_delete(char *name) {
+    int64_t idx = find_snapshot(name);
+    if (idx == -1) {
+        fprintf(output_fp, "snapshot error: Snapshot not found\n");
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (snapshots[idx].free_inode_map[i]) {
+            release_blocks(snapshots[idx].inodes[i]);
+        }
+    }
+    free_snapshot(&snapshots[idx]);
+
+    // keep the rest in the order they were taken
+    memmove(&snapshots[idx], &snapshots[idx + 1],
+            (geometry.num_snapshots - idx - 1) * sizeof(struct snapshot));
+    geometry.num_snapshots--;
+
+    return 0;
+}
+
+// scrub work shared by its threads, each takes the next block to check from next
+struct scrub_job {
+    int fd;                         // image file the blocks are read from
+    uint64_t next;                  // next block to check, taken atomically
+    uint64_t checked;               // blocks read and checked so far
+    uint64_t rate;                  // bytes per second to read at, 0 for no limit
+    struct timespec start;          // when the scrub started, for the rate limit
+    uint8_t *corrupt;               // blocks that don't match their checksum
+};
+
+/*
+    Name: scrub_worker
+    Parameters: pointer to the scrub job
+    Return: void pointer
+    Description: reads blocks in use from the image file and checks them against their
+    checksums until none are left, sleeping whenever it gets ahead of the rate limit
+*/
+void *scrub_worker(void *arg) {
+    struct scrub_job *job = arg;
+    char *buffer = malloc(geometry.block_size);
+
+    uint64_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < geometry.num_blocks) {
+        // free blocks hold nothing and changed blocks haven't been saved with a checksum yet
+        if (!free_block_map[i] || dirty_block_map[i]) {
+            continue;
+        }
+
+        // a short read means the file was cut off, the rest checks as zeros
+        memset(buffer, 0, geometry.block_size);
+        if (pread(job->fd, buffer, geometry.block_size, (geometry.data_start + i) * geometry.block_size) == -1) {
+            perror("mfs: pread");
+        }
+        if (crc32c(0, buffer, geometry.block_size) != block_checksums[i]) {
+            job->corrupt[i] = 1;
+        }
+
+        // wait until the bytes read so far are due at the rate
+        uint64_t checked = __atomic_add_fetch(&job->checked, 1, __ATOMIC_RELAXED);
+        if (job->rate) {
+            uint64_t due_ns = checked * geometry.block_size * 1000000000.0 / job->rate;
+            uint64_t spent_ns = elapsed_ns(&job->start);
+            if (due_ns > spent_ns) {
+                struct timespec delay = {
+                    (due_ns - spent_ns) / 1000000000, (due_ns - spent_ns) % 1000000000
+                };
+                nanosleep(&delay, NULL);
+            }
+        }
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+/*
+    Name: entry_index
+    Parameters: directory of the image or a snapshot
+    Return: pointer to an array of directory entry indices
+    Description: returns a new array with the directory entry naming each inode, -1 for
+    inodes no entry names
+*/
+int64_t *entry_index(struct directory_entry *directory) {
+    int64_t *entry_of = malloc(geometry.num_inodes * sizeof(int64_t));
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        entry_of[i] = -1;
+    }
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (directory[i].valid && directory[i].inode_idx >= 0 &&
+            (uint64_t) directory[i].inode_idx < geometry.num_inodes) {
+            entry_of[directory[i].inode_idx] = i;
+        }
+    }
+
+    return entry_of;
+}
+
+/*
+    Name: print_path
+    Parameters: directory of the image or a snapshot, the directory entry naming each inode,
+    an inode and the depth reached so far
+    Return: void
+    Description: prints the path of the inode from the root directory
+*/
+void print_path(struct directory_entry *directory, int64_t *entry_of, int64_t inode_idx, uint64_t depth) {
+    // stop at the root, or at an inode no entry names (or a loop of them)
+    int64_t dir_idx = entry_of[inode_idx];
+    if (inode_idx == ROOT_INODE || dir_idx == -1 || depth > geometry.num_inodes) {
+        return;
+    }
+
+    print_path(directory, entry_of, directory[dir_idx].parent, depth + 1);
+    fprintf(output_fp, "/%s", directory[dir_idx].name);
+}
+
+/*
+    Name: report_corrupt_files
+    Parameters: directory, free inode map and inodes of the image or a snapshot, name of the
+    snapshot (NULL for the image itself) and the corrupt blocks
+    Return: void
+    Description: prints the path of every file using a corrupt block
+*/
+void report_corrupt_files(struct directory_entry *directory, uint8_t *inode_map, struct inode **inodes,
+                          char *snapshot, uint8_t *corrupt) {
+    int64_t *entry_of = entry_index(directory);
+
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        struct inode *inode = inodes[i];
+        if (!inode_map[i] || (inode->flags & INODE_INLINE)) {
+            continue;
+        }
+
+        for (uint64_t j = 0; inode->blocks[j] != -1; j++) {
+            if (inode->blocks[j] != HOLE_ENTRY && corrupt[entry_block(inode->blocks[j])]) {
+                fprintf(output_fp, "scrub: ");
+                print_path(directory, entry_of, i, 0);
+                if (snapshot) {
+                    fprintf(output_fp, " in snapshot %s", snapshot);
+                }
+                fprintf(output_fp, " is corrupt\n");
+                break;
+            }
+        }
+    }
+
+    free(entry_of);
+}
+
+/*
+    Name: scrub
+    Parameters: number of threads to read with (0 for one per core) and the rate to read at
+    in MB per second (0 for no limit)
+    Return: int
+    Description: checks every region of the image file and every saved block in use against
+    its checksum and reports the files, in the image and its snapshots, that use corrupt
+    blocks. A corrupt block that is loaded and intact in memory is rewritten by the next
+    savefs instead. Returns 0 if nothing is corrupt and -1 otherwise
+*/
+int scrub(int num_threads, uint64_t rate) {
+    if (!backing_fp) {
+        fprintf(output_fp, "scrub error: Image has not been saved\n");
+        return -1;
+    }
+
+    int retval = 0;
+    int mismatched[NUM_REGIONS];
+    int num_mismatched = check_regions(fileno(backing_fp), mismatched);
+    for (int i = 0; i < num_mismatched; i++) {
+        fprintf(output_fp, "scrub: Checksum mismatch in the %s region\n", region_names[mismatched[i]]);
+        retval = -1;
+    }
+
+    if (num_threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cores < 1 ? 1 : cores;
+    }
+    if (num_threads > MAX_SCRUB_THREADS) {
+        num_threads = MAX_SCRUB_THREADS;
+    }
+
+    struct scrub_job job = {
+        fileno(backing_fp), 0, 0, rate * 1000000, {0, 0}, calloc(geometry.num_blocks, sizeof(uint8_t))
+    };
+    clock_gettime(CLOCK_MONOTONIC, &job.start);
+
+    // the calling thread scrubs along with the others
+    pthread_t threads[MAX_SCRUB_THREADS];
+    for (int t = 1; t < num_threads; t++) {
+        pthread_create(&threads[t], NULL, scrub_worker, &job);
+    }
+    scrub_worker(&job);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    uint64_t spent_ns = elapsed_ns(&job.start);
+    uint64_t corrupt = 0;
+    uint64_t rewritten = 0;
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        if (!job.corrupt[i]) {
+            continue;
+        }
+
+        // a copy loaded before the file went bad is still good, write it out again
+        if (data_blocks[i] && !corrupt_block_map[i]) {
+            dirty_block_map[i] = 1;
+            job.corrupt[i] = 0;
+            rewritten++;
+        }
+        else {
+            corrupt++;
+        }
+    }
+
+    fprintf(output_fp, "scrub: %" PRIu64 " blocks checked in %.2f s (%.1f MB/s), %" PRIu64 " corrupt.\n",
+            job.checked, spent_ns / 1e9,
+            spent_ns ? job.checked * geometry.block_size * 1000.0 / spent_ns : 0.0, corrupt + rewritten);
+    if (rewritten > 0) {
+        fprintf(output_fp, "scrub: %" PRIu64 " blocks will be rewritten from memory by savefs.\n", rewritten);
+    }
+
+    if (corrupt > 0) {
+        report_corrupt_files(directory_array_ptr, free_inode_map, inode_array_ptr, NULL, job.corrupt);
+        for (uint64_t i = 0; i < geometry.num_snapshots; i++) {
+            report_corrupt_files(snapshots[i].directory, snapshots[i].free_inode_map, snapshots[i].inodes,
+                                 snapshots[i].name, job.corrupt);
+        }
+        retval = -1;
+    }
+
+    free(job.corrupt);
+
+    return retval;
+}
+
+// a block map entry fsck found using fragments another entry uses
+struct fsck_conflict {
+    struct inode *inode;
+    uint64_t index;                 // position of the entry in the block map
+};
+
+// fsck work shared by its threads. The inodes are split between the threads first, each
+// marking the fragments its entries use, then the blocks are, each comparing the marks
+// against the free block map, the fragment map and the share table
+struct fsck_job {
+    struct inode **inodes;          // inodes in use, the image's and its snapshots'
+    uint64_t num_inodes;
+    uint16_t *marked;               // fragments of each block some entry uses
+    uint16_t *owners;               // code of the entry using each fragment
+    uint32_t *refs;                 // references to the entry starting at each fragment
+    int repair;                     // fix what is found, or only report it
+    int thread;
+    int num_threads;
+    uint64_t bad_entries;           // entries pointing outside the data region
+    uint64_t leaked;                // blocks in use that no entry uses
+    uint64_t unmarked;              // blocks entries use that are marked free
+    uint64_t fragment_maps;         // blocks with the wrong fragments marked in use
+    uint64_t share_counts;          // entries whose references the share table miscounts
+    uint64_t shared;                // entries with more than one reference
+    struct fsck_conflict *conflicts;
+    uint64_t num_conflicts;
+};
+
+/*
+    Name: fsck_inode_worker
+    Parameters: pointer to the thread's fsck job
+    Return: void pointer
+    Description: marks the fragments used by the entries of the thread's share of the inodes.
+    An entry finding a fragment marked by a different entry is a conflict, one finding it
+    marked by the same entry is another reference to it
+*/
+void *fsck_inode_worker(void *arg) {
+    struct fsck_job *job = arg;
+    uint64_t capacity = 0;
+
+    for (uint64_t i = job->thread; i < job->num_inodes; i += job->num_threads) {
+        struct inode *inode = job->inodes[i];
+        if (inode->flags & INODE_INLINE) {
+            continue;
+        }
+
+        for (uint64_t j = 0; inode->blocks[j] != -1; j++) {
+            int64_t entry = inode->blocks[j];
+            if (entry == HOLE_ENTRY) {
+                continue;
+            }
+
+            // nothing can be read through an entry outside the image, it reads as zeros
+            if (!valid_entry(entry)) {
+                job->bad_entries++;
+                if (job->repair) {
+                    inode->blocks[j] = HOLE_ENTRY;
+                }
+                continue;
+            }
+
+            int64_t block_idx = entry_block(entry);
+            uint16_t code = WHOLE_BLOCK_CODE;
+            uint16_t fragments = 0xFFFF;
+            int start = 0;
+            if (entry & PACKED_ENTRY) {
+                code = PACKED_CODE | (entry & COMPRESSED_ENTRY ? 0x100 : 0) | (entry & 0xFF);
+                fragments = entry_fragments(entry);
+                start = (entry >> 4) & 0xF;
+            }
+
+            // the pages of the per fragment arrays are only touched for blocks in use
+            __atomic_fetch_or(&job->marked[block_idx], fragments, __ATOMIC_RELAXED);
+
+            int conflict = 0;
+            for (int f = 0; f < FRAGS_PER_BLOCK; f++) {
+                uint16_t expected = 0;
+                if ((fragments >> f & 1) &&
+                    !__atomic_compare_exchange_n(&job->owners[block_idx * FRAGS_PER_BLOCK + f], &expected,
+                                                 code, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+                    expected != code) {
+                    conflict = 1;
+                }
+            }
+
+            if (!conflict) {
+                __atomic_add_fetch(&job->refs[block_idx * FRAGS_PER_BLOCK + start], 1, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (job->num_conflicts == capacity) {
+                capacity = capacity ? capacity * 2 : INITIAL_INDEX_CAPACITY;
+                job->conflicts = realloc(job->conflicts, capacity * sizeof(struct fsck_conflict));
+            }
+            job->conflicts[job->num_conflicts].inode = inode;
+            job->conflicts[job->num_conflicts].index = j;
+            job->num_conflicts++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Name: fsck_block_worker
+    Parameters: pointer to the thread's fsck job
+    Return: void pointer
+    Description: compares the marks of the thread's share of the blocks against the free
+    block map, the fragment map and the share table, fixing the maps if asked to
+*/
+void *fsck_block_worker(void *arg) {
+    struct fsck_job *job = arg;
+    uint64_t first = geometry.num_blocks * job->thread / job->num_threads;
+    uint64_t last = geometry.num_blocks * (job->thread + 1) / job->num_threads;
+
+    for (uint64_t i = first; i < last; i++) {
+        uint16_t *owners = &job->owners[i * FRAGS_PER_BLOCK];
+        uint16_t used = job->marked[i];
+
+        if (free_block_map[i] && !used) {
+            job->leaked++;
+            if (job->repair) {
+                release_block(i);
+            }
+        }
+        else if (!free_block_map[i] && used) {
+            job->unmarked++;
+            if (job->repair) {
+                free_block_map[i] = 1;
+            }
+        }
+
+        // only blocks holding packed entries have fragments marked
+        uint16_t fragments = used && owners[0] == WHOLE_BLOCK_CODE ? 0 : used;
+        if (fragment_map[i] != fragments) {
+            job->fragment_maps++;
+            if (job->repair) {
+                fragment_map[i] = fragments;
+            }
+        }
+
+        // every entry referenced more than once needs its extra references counted
+        for (int f = 0; used && f < FRAGS_PER_BLOCK; f++) {
+            uint32_t refs = job->refs[i * FRAGS_PER_BLOCK + f];
+            if (refs == 0) {
+                continue;
+            }
+
+            int64_t entry = i;
+            if (owners[f] != WHOLE_BLOCK_CODE) {
+                entry = PACKED_ENTRY | (owners[f] & 0x100 ? COMPRESSED_ENTRY : 0) | i << 8 | (owners[f] & 0xFF);
+            }
+            int64_t slot = share_slot(entry);
+            if (refs != (slot == -1 ? 1 : shared_entries.refs[slot] + 1)) {
+                job->share_counts++;
+            }
+            if (refs > 1) {
+                job->shared++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Name: fsck_blocks
+    Parameters: flag that says whether to repair and a pointer to return the number of
+    conflicting entries in
+    Return: uint64_t
+    Description: rebuilds which fragments of which blocks the inodes of the image and its
+    snapshots use, in parallel, and checks the free block map, the fragment map and the
+    share table against it. Entries using fragments another entry uses get a copy of the
+    data of their own. Returns the number of problems found, or -1 if there isn't enough
+    memory to check the blocks
+*/
+int64_t fsck_blocks(int repair, uint64_t *num_conflicts) {
+    // the inodes whose entries count, and which fragments each block has used and how often,
+    // take far more memory than the image's own maps
+    struct inode **inodes = malloc(geometry.num_inodes * (geometry.num_snapshots + 1) * sizeof(struct inode *));
+    uint16_t *marked = calloc(geometry.num_blocks, sizeof(uint16_t));
+    uint16_t *owners = calloc(geometry.num_blocks * FRAGS_PER_BLOCK, sizeof(uint16_t));
+    uint32_t *refs = calloc(geometry.num_blocks * FRAGS_PER_BLOCK, sizeof(uint32_t));
+    if (!inodes || !marked || !owners || !refs) {
+        free(inodes);
+        free(marked);
+        free(owners);
+        free(refs);
+        return -1;
+    }
+
+    // snapshots hold references like files do
+    uint64_t num_inodes = 0;
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (free_inode_map[i]) {
+            inodes[num_inodes++] = inode_array_ptr[i];
+        }
+        for (uint64_t j = 0; j < geometry.num_snapshots; j++) {
+            if (snapshots[j].free_inode_map[i]) {
+                inodes[num_inodes++] = snapshots[j].inodes[i];
+            }
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cores < 1 ? 1 : cores > MAX_FSCK_THREADS ? MAX_FSCK_THREADS : cores;
+
+    struct fsck_job jobs[MAX_FSCK_THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    for (int t = 0; t < num_threads; t++) {
+        jobs[t].inodes = inodes;
+        jobs[t].num_inodes = num_inodes;
+        jobs[t].marked = marked;
+        jobs[t].owners = owners;
+        jobs[t].refs = refs;
+        jobs[t].repair = repair;
+        jobs[t].thread = t;
+        jobs[t].num_threads = num_threads;
+    }
+
+    // every entry is marked before any block is checked, the calling thread takes the
+    // first share of each pass itself
+    pthread_t threads[MAX_FSCK_THREADS];
+    void *(*passes[2])(void *) = { fsck_inode_worker, fsck_block_worker };
+    for (int pass = 0; pass < 2; pass++) {
+        for (int t = 1; t < num_threads; t++) {
+            pthread_create(&threads[t], NULL, passes[pass], &jobs[t]);
+        }
+        passes[pass](&jobs[0]);
+        for (int t = 1; t < num_threads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    struct fsck_job total = jobs[0];
+    for (int t = 1; t < num_threads; t++) {
+        total.bad_entries += jobs[t].bad_entries;
+        total.leaked += jobs[t].leaked;
+        total.unmarked += jobs[t].unmarked;
+        total.fragment_maps += jobs[t].fragment_maps;
+        total.share_counts += jobs[t].share_counts;
+        total.shared += jobs[t].shared;
+        total.num_conflicts += jobs[t].num_conflicts;
+    }
+
+    // entries left in the share table that nothing references any more
+    if (total.share_counts == 0 && total.shared != shared_entries.count) {
+        total.share_counts = total.shared > shared_entries.count ? total.shared - shared_entries.count :
+                             shared_entries.count - total.shared;
+    }
+
+    // the share table is simplest rebuilt from the references counted
+    if (repair && total.share_counts > 0) {
+        free(shared_entries.entries);
+        free(shared_entries.refs);
+        memset(&shared_entries, 0, sizeof(shared_entries));
+
+        for (uint64_t i = 0; i < geometry.num_blocks * FRAGS_PER_BLOCK; i++) {
+            if (marked[i / FRAGS_PER_BLOCK] && refs[i] > 1) {
+                uint64_t block_idx = i / FRAGS_PER_BLOCK;
+                int64_t entry = block_idx;
+                if (owners[i] != WHOLE_BLOCK_CODE) {
+                    entry = PACKED_ENTRY | (owners[i] & 0x100 ? COMPRESSED_ENTRY : 0) | block_idx << 8 |
+                            (owners[i] & 0xFF);
+                }
+                share_entry(entry);
+                shared_entries.refs[share_slot(entry)] = refs[i] - 1;
+            }
+        }
+    }
+
+    // the data an entry in conflict reads right now is stored again for it alone, the
+    // fragments it marked are left for the next pass to free
+    uint64_t lost = 0;
+    char *buffer = malloc(geometry.block_size);
+    for (int t = 0; t < num_threads; t++) {
+        for (uint64_t i = 0; repair && i < jobs[t].num_conflicts; i++) {
+            struct inode *inode = jobs[t].conflicts[i].inode;
+            uint64_t j = jobs[t].conflicts[i].index;
+            uint64_t num_bytes = j * geometry.block_size < inode->size ? inode->size - j * geometry.block_size : 0;
+            if (num_bytes > geometry.block_size) {
+                num_bytes = geometry.block_size;
+            }
+
+            char *data = entry_data(inode->blocks[j], buffer);
+            if (num_bytes == 0 || store_block(inode, j, data, num_bytes, NULL, 0, -1) == -1) {
+                inode->blocks[j] = HOLE_ENTRY;
+                lost++;
+            }
+        }
+        free(jobs[t].conflicts);
+    }
+    free(buffer);
+
+    char *fixed = repair ? ", fixed" : "";
+    if (total.bad_entries > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " block map entries outside the image%s\n", total.bad_entries,
+                repair ? ", cleared" : "");
+    }
+    if (total.leaked > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " leaked blocks%s\n", total.leaked, repair ? ", freed" : "");
+    }
+    if (total.unmarked > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " blocks in use marked free%s\n", total.unmarked, fixed);
+    }
+    if (total.fragment_maps > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " blocks with wrong fragments marked%s\n", total.fragment_maps, fixed);
+    }
+    if (total.share_counts > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " wrong share counts%s\n", total.share_counts,
+                repair ? ", share table rebuilt" : "");
+    }
+    if (total.num_conflicts > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " double allocated block map entries%s\n", total.num_conflicts,
+                repair ? ", copied" : "");
+    }
+    if (lost > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " of them could not be copied and read as zeros\n", lost);
+    }
+
+    free(marked);
+    free(owners);
+    free(refs);
+    free(inodes);
+
+    *num_conflicts = total.num_conflicts;
+
+    return total.bad_entries + total.leaked + total.unmarked + total.fragment_maps + total.share_counts +
+           total.num_conflicts;
+}
+
+/*
+    Name: lost_and_found
+    Parameters: None
+    Return: int64_t
+    Description: returns the inode of the lost+found directory in the root directory,
+    creating it if needed, or -1 if there is no room for it
+*/
+int64_t lost_and_found() {
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        struct directory_entry *entry = &directory_array_ptr[i];
+        if (entry->valid && entry->parent == ROOT_INODE && !strcmp(entry->name, LOST_AND_FOUND) &&
+            inode_array_ptr[entry->inode_idx]->type == TYPE_DIRECTORY) {
+            return entry->inode_idx;
+        }
+    }
+
+    int64_t inode_idx = find_free_inode();
+    if (inode_idx == -1 || find_free_directory_entry() == -1) {
+        return -1;
+    }
+
+    make_directory_inode(inode_idx, ROOT_INODE);
+    add_directory_entry(ROOT_INODE, LOST_AND_FOUND, inode_idx);
+
+    return inode_idx;
+}
+
+/*
+    Name: clear_directory_entry
+    Parameters: index of a directory entry
+    Return: void
+    Description: marks the entry free without touching the index of its directory
+*/
+void clear_directory_entry(int64_t dir_idx) {
+    free(directory_array_ptr[dir_idx].name);
+    directory_array_ptr[dir_idx].name = NULL;
+    directory_array_ptr[dir_idx].valid = 0;
+    directory_array_ptr[dir_idx].inode_idx = -1;
+    directory_array_ptr[dir_idx].parent = -1;
+    directory_array_ptr[dir_idx].h = 0;
+    directory_array_ptr[dir_idx].r = 0;
+}
+
+/*
+    Name: fsck_namespace
+    Parameters: flag that says whether to repair
+    Return: uint64_t
+    Description: checks that every directory entry names an inode in use, that no inode is
+    named twice and that every inode in use can be reached from the root directory. Entries
+    naming nothing are removed and unreachable inodes are moved into lost+found under their
+    inode number (or freed if there's no room left). Returns the number of problems found
+*/
+uint64_t fsck_namespace(int repair) {
+    uint64_t dangling = 0;
+    uint64_t orphans = 0;
+    uint64_t dropped = 0;
+    uint64_t parents = 0;
+
+    // the entry naming each inode
+    int64_t *entry_of = malloc(geometry.num_inodes * sizeof(int64_t));
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        entry_of[i] = -1;
+    }
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        int64_t inode_idx = directory_array_ptr[i].inode_idx;
+        if (!directory_array_ptr[i].valid) {
+            continue;
+        }
+
+        if (inode_idx < 0 || (uint64_t) inode_idx >= geometry.num_inodes || !free_inode_map[inode_idx] ||
+            inode_idx == ROOT_INODE || entry_of[inode_idx] != -1) {
+            dangling++;
+            if (repair) {
+                clear_directory_entry(i);
+            }
+            continue;
+        }
+        entry_of[inode_idx] = i;
+    }
+
+    // walk up from every inode until reaching the root or an inode already walked from.
+    // Where the way up breaks off, or runs in a loop, the inode is cut loose: moving it
+    // into lost+found makes it and everything below it reachable again
+    uint8_t *state = calloc(geometry.num_inodes, sizeof(uint8_t));    // 1 reachable, 2 not, 3 walking
+    uint8_t *cut = calloc(geometry.num_inodes, sizeof(uint8_t));
+    int64_t *walk = malloc(geometry.num_inodes * sizeof(int64_t));
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (!free_inode_map[i]) {
+            continue;
+        }
+
+        uint64_t depth = 0;
+        int64_t inode_idx = i;
+        uint8_t result;
+        while (1) {
+            if (inode_idx == ROOT_INODE) {
+                result = 1;
+                break;
+            }
+            if (state[inode_idx] == 1 || state[inode_idx] == 2) {
+                result = state[inode_idx];
+                break;
+            }
+            if (state[inode_idx] == 3) {
+                cut[inode_idx] = 1;
+                result = 2;
+                break;
+            }
+            state[inode_idx] = 3;
+            walk[depth++] = inode_idx;
+
+            int64_t parent = entry_of[inode_idx] == -1 ? -1 : directory_array_ptr[entry_of[inode_idx]].parent;
+            if (parent < 0 || (uint64_t) parent >= geometry.num_inodes || !free_inode_map[parent] ||
+                inode_array_ptr[parent]->type != TYPE_DIRECTORY) {
+                cut[inode_idx] = 1;
+                result = 2;
+                break;
+            }
+            inode_idx = parent;
+        }
+
+        for (uint64_t d = 0; d < depth; d++) {
+            state[walk[d]] = result;
+        }
+    }
+
+    // the parent recorded in each reachable inode has to match its entry
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (i != ROOT_INODE && state[i] == 1 &&
+            inode_array_ptr[i]->parent != directory_array_ptr[entry_of[i]].parent) {
+            parents++;
+            if (repair) {
+                inode_array_ptr[i]->parent = directory_array_ptr[entry_of[i]].parent;
+            }
+        }
+    }
+
+    int64_t lost_dir = -2;
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (!cut[i]) {
+            continue;
+        }
+        orphans++;
+        if (!repair) {
+            continue;
+        }
+
+        if (lost_dir == -2) {
+            lost_dir = lost_and_found();
+        }
+
+        char name[MAX_FILENAME + 1];
+        snprintf(name, sizeof(name), "#%" PRIu64, i);
+
+        // rename the entry into lost+found, or give the inode one there
+        int64_t dir_idx = entry_of[i];
+        if (lost_dir != -1 && dir_idx != -1) {
+            free(directory_array_ptr[dir_idx].name);
+            directory_array_ptr[dir_idx].name = strdup(name);
+            directory_array_ptr[dir_idx].parent = lost_dir;
+        }
+        else if (lost_dir != -1) {
+            dir_idx = add_directory_entry(lost_dir, name, i);
+        }
+
+        // without room the inode is freed, the blocks it held are then leaked and freed
+        if (dir_idx == -1 || lost_dir == -1) {
+            if (dir_idx != -1) {
+                clear_directory_entry(dir_idx);
+            }
+            free_inode_map[i] = 0;
+            dropped++;
+        }
+        else {
+            inode_array_ptr[i]->parent = lost_dir;
+        }
+    }
+
+    // directory indexes are rebuilt from the entries now in place
+    if (repair && dangling + orphans > 0) {
+        for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+            struct inode *inode = inode_array_ptr[i];
+            if (free_inode_map[i] && inode->type == TYPE_DIRECTORY) {
+                free(inode->index->slots);
+                free(inode->index);
+                inode->index = new_directory_index();
+            }
+        }
+        index_directories();
+
+        if (!free_inode_map[cwd_inode]) {
+            cwd_inode = ROOT_INODE;
+        }
+    }
+
+    if (dangling > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " directory entries naming no file%s\n", dangling,
+                repair ? ", removed" : "");
+    }
+    if (orphans > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " orphaned inodes%s\n", orphans,
+                repair ? ", moved to /" LOST_AND_FOUND : "");
+    }
+    if (dropped > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " of them freed, no room left in /" LOST_AND_FOUND "\n", dropped);
+    }
+    if (parents > 0) {
+        fprintf(output_fp, "fsck: %" PRIu64 " inodes with the wrong parent%s\n", parents, repair ? ", fixed" : "");
+    }
+
+    free(entry_of);
+    free(state);
+    free(cut);
+    free(walk);
+
+    return dangling + orphans + parents;
+}
+
+/*
+    Name: fsck
+    Parameters: flag that says whether to repair or only report
+    Return: int
+    Description: checks the directory, the inodes and the free maps of the image against
+    each other and repairs what doesn't match. Returns 0 if the image was consistent and -1
+    otherwise
+*/
+int fsck(int repair) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // everything hangs off the root directory, there's nothing to rebuild it from
+    if (!free_inode_map[ROOT_INODE] || inode_array_ptr[ROOT_INODE]->type != TYPE_DIRECTORY) {
+        fprintf(output_fp, "fsck error: Root directory missing\n");
+        return -1;
+    }
+
+    // inodes found unreachable may be freed, so the namespace is settled before the blocks
+    uint64_t problems = fsck_namespace(repair);
+    uint64_t conflicts = 0;
+    int64_t found = fsck_blocks(repair, &conflicts);
+    if (found == -1) {
+        fprintf(output_fp, "fsck error: Not enough memory to check the blocks\n");
+        return -1;
+    }
+    problems += found;
+
+    // copying entries in conflict leaves the fragments they marked behind
+    if (repair && conflicts > 0) {
+        fsck_blocks(repair, &conflicts);
+    }
+
+    fprintf(output_fp, "fsck: %" PRIu64 " inodes and %" PRIu64 " blocks checked in %.2f ms, ",
+            geometry.num_inodes, geometry.num_blocks, elapsed_ns(&start) / 1e6);
+    if (problems == 0) {
+        fprintf(output_fp, "no problems found.\n");
+    }
+    else {
+        fprintf(output_fp, "%" PRIu64 " problems %s.\n", problems, repair ? "fixed" : "found");
+    }
+
+    return problems == 0 ? 0 : -1;
+}
+
+// a block map entry referring to a block, defrag rewrites it when the block moves
+struct block_ref {
+    struct inode *inode;
+    uint64_t index;                 // position of the entry in the block map
+};
+
+/*
+    Name: file_extents
+    Parameters: inode of a file and a pointer to return the number of whole blocks in
+    Return: uint64_t
+    Description: number of runs of consecutive blocks the file's whole blocks are stored in,
+    holes and packed entries don't count
+*/
+uint64_t file_extents(struct inode *inode, uint64_t *num_blocks) {
+    uint64_t extents = 0;
+    int64_t last = -2;
+
+    *num_blocks = 0;
+    if (inode->flags & INODE_INLINE) {
+        return 0;
+    }
+
+    for (uint64_t i = 0; inode->blocks[i] != -1; i++) {
+        int64_t entry = inode->blocks[i];
+        if (entry == HOLE_ENTRY || (entry & PACKED_ENTRY) || !valid_entry(entry)) {
+            continue;
+        }
+
+        if (entry != last + 1) {
+            extents++;
+        }
+        last = entry;
+        (*num_blocks)++;
+    }
+
+    return extents;
+}
+
+// a file's place in the order defrag lays out the image's files in with placement on
+struct file_heat {
+    uint64_t heat;
+    uint64_t inode_idx;
+};
+
+/*
+    Name: file_heat
+    Parameters: inode and the current time
+    Return: uint64_t
+    Description: how hot the file is, its reads halved for every HEAT_HALF_LIFE since the
+    file was last read, so files read a lot long ago cool down again
+*/
+uint64_t file_heat(struct inode *inode, time_t now) {
+    time_t last_read = __atomic_load_n(&inode->last_read, __ATOMIC_RELAXED);
+    uint64_t halvings = now > last_read ? (now - last_read) / HEAT_HALF_LIFE : 0;
+
+    return halvings < 64 ? __atomic_load_n(&inode->reads, __ATOMIC_RELAXED) >> halvings : 0;
+}
+
+/*
+    Name: compare_heat
+    Parameters: two file heats
+    Return: int
+    Description: qsort comparator putting hotter files first and files as hot as each other
+    in inode order
+*/
+int compare_heat(const void *a, const void *b) {
+    const struct file_heat *x = a;
+    const struct file_heat *y = b;
+
+    if (x->heat != y->heat) {
+        return x->heat > y->heat ? -1 : 1;
+    }
+
+    return x->inode_idx < y->inode_idx ? -1 : x->inode_idx > y->inode_idx;
+}
+
+/*
+    Name: defrag_report
+    Parameters: None
+    Return: void
+    Description: prints the fragmentation score of every file stored in more than one run
+    of blocks, of all files together and of the free space. A file's score is the share of
+    its blocks that don't follow the one before, the free space's is the share of it outside
+    its longest run. 0 is contiguous, 1 as scattered as can be
+*/
+void defrag_report() {
+    int64_t *entry_of = entry_index(directory_array_ptr);
+    uint64_t total_blocks = 0;
+    uint64_t total_extents = 0;
+    uint64_t files = 0;
+
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (!free_inode_map[i] || inode_array_ptr[i]->type != TYPE_FILE) {
+            continue;
+        }
+
+        uint64_t num_blocks;
+        uint64_t extents = file_extents(inode_array_ptr[i], &num_blocks);
+        if (num_blocks == 0) {
+            continue;
+        }
+        total_blocks += num_blocks;
+        total_extents += extents;
+        files++;
+
+        if (extents > 1) {
+            fprintf(output_fp, "defrag: ");
+            print_path(directory_array_ptr, entry_of, i, 0);
+            fprintf(output_fp, " %" PRIu64 " blocks in %" PRIu64 " extents (score %.2f)\n", num_blocks,
+                    extents, (double) (extents - 1) / (num_blocks - 1));
+        }
+    }
+    free(entry_of);
+
+    // each file starts an extent of its own, only the breaks within files count
+    fprintf(output_fp, "defrag: %" PRIu64 " files in %" PRIu64 " blocks and %" PRIu64 " extents (score %.2f)\n",
+            files, total_blocks, total_extents,
+            total_blocks > files ? (double) (total_extents - files) / (total_blocks - files) : 0.0);
+
+    uint64_t free_blocks = 0;
+    uint64_t runs = 0;
+    uint64_t run = 0;
+    uint64_t longest = 0;
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        if (free_block_map[i]) {
+            run = 0;
+            continue;
+        }
+
+        free_blocks++;
+        if (run++ == 0) {
+            runs++;
+        }
+        if (run > longest) {
+            longest = run;
+        }
+    }
+    fprintf(output_fp, "defrag: %" PRIu64 " free blocks in %" PRIu64 " runs, longest %" PRIu64 " (score %.2f)\n",
+            free_blocks, runs, longest, free_blocks ? 1.0 - (double) longest / free_blocks : 0.0);
+
+    // with placement on, how much of the data region the files still being read take up
+    // and how far into it their blocks reach
+    if (geometry.features & IMAGE_PLACEMENT) {
+        time_t now = time(NULL);
+        uint64_t hot_files = 0;
+        uint64_t hot_blocks = 0;
+        uint64_t hot_end = 0;
+        uint8_t *hot = calloc(geometry.num_blocks, sizeof(uint8_t));
+        for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+            struct inode *inode = inode_array_ptr[i];
+            if (!free_inode_map[i] || inode->type != TYPE_FILE || file_heat(inode, now) == 0 ||
+                (inode->flags & INODE_INLINE)) {
+                continue;
+            }
+
+            hot_files++;
+            for (uint64_t j = 0; inode->blocks[j] != -1; j++) {
+                int64_t entry = inode->blocks[j];
+                if (entry == HOLE_ENTRY || !valid_entry(entry) || hot[entry_block(entry)]) {
+                    continue;
+                }
+
+                hot[entry_block(entry)] = 1;
+                hot_blocks++;
+                if ((uint64_t) entry_block(entry) + 1 > hot_end) {
+                    hot_end = entry_block(entry) + 1;
+                }
+            }
+        }
+        free(hot);
+
+        // the score is the share of the region up to the last hot block that isn't hot
+        fprintf(output_fp, "defrag: %" PRIu64 " hot files in %" PRIu64 " blocks, spread over the first %" PRIu64
+                " blocks (score %.2f)\n", hot_files, hot_blocks, hot_end,
+                hot_end ? 1.0 - (double) hot_blocks / hot_end : 0.0);
+    }
+}
+
+/*
+    Name: with_block
+    Parameters: block map entry and index of a data block
+    Return: int64_t
+    Description: the entry moved to the other block, fragments stay where they are in it
+*/
+int64_t with_block(int64_t entry, int64_t block_idx) {
+    if (entry & PACKED_ENTRY) {
+        return (entry & (PACKED_ENTRY | COMPRESSED_ENTRY | 0xFF)) | block_idx << 8;
+    }
+
+    return block_idx;
+}
+
+/*
+    Name: swap_blocks
+    Parameters: indices of two data blocks
+    Return: void
+    Description: exchanges the data and the map state of the two blocks. Blocks in use are
+    loaded first and written back by the next savefs, a block left free drops its data
+*/
+void swap_blocks(int64_t a, int64_t b) {
+    if (free_block_map[a]) {
+        block_data(a);
+    }
+    if (free_block_map[b]) {
+        block_data(b);
+    }
+
+    void *data = data_blocks[a];
+    data_blocks[a] = data_blocks[b];
+    data_blocks[b] = data;
+
+    uint8_t used = free_block_map[a];
+    free_block_map[a] = free_block_map[b];
+    free_block_map[b] = used;
+
+    uint16_t fragments = fragment_map[a];
+    fragment_map[a] = fragment_map[b];
+    fragment_map[b] = fragments;
+
+    // a corrupt block takes its checksum along, savefs leaves it as it is
+    uint8_t corrupt = corrupt_block_map[a];
+    corrupt_block_map[a] = corrupt_block_map[b];
+    corrupt_block_map[b] = corrupt;
+
+    uint32_t checksum = block_checksums[a];
+    block_checksums[a] = block_checksums[b];
+    block_checksums[b] = checksum;
+
+    int64_t blocks[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        if (free_block_map[blocks[i]]) {
+            dirty_block_map[blocks[i]] = 1;
+        }
+        else {
+            free(data_blocks[blocks[i]]);
+            data_blocks[blocks[i]] = NULL;
+            dirty_block_map[blocks[i]] = 0;
+        }
+    }
+}
+
+/*
+    Name: move_references
+    Parameters: references to a block, their number, the block they move to and an array
+    with room for the share table entries of the references
+    Return: uint64_t
+    Description: points the references at the other block. Their entries are taken out of
+    the share table, along with their counts, into the array for the caller to put back once
+    every block in the exchange has moved (so an entry never collides with the old entry of
+    the other block). Returns the number of entries taken out
+*/
+uint64_t move_references(struct block_ref *refs, uint64_t count, int64_t block_idx, struct share_table *moved) {
+    uint64_t num_moved = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        int64_t *entry = &refs[i].inode->blocks[refs[i].index];
+
+        int64_t slot = share_slot(*entry);
+        if (slot != -1) {
+            moved->entries[num_moved] = with_block(*entry, block_idx);
+            moved->refs[num_moved] = shared_entries.refs[slot];
+            num_moved++;
+            shared_entries.entries[slot] = DELETED_SLOT;
+            shared_entries.count--;
+        }
+
+        *entry = with_block(*entry, block_idx);
+    }
+
+    return num_moved;
+}
+
+/*
+    Name: defrag
+    Parameters: milliseconds the step may take and a flag that says to only report
+    Return: int
+    Description: reports the fragmentation scores, or lays the blocks out again: the
+    whole blocks of each file one after the other in inode order (hottest files first with
+    placement on, so the files being read share a hot region at the front), then the blocks
+    holding packed entries, then the blocks only snapshots use, leaving the free space at the end.
+    Blocks are exchanged into place one at a time until the time runs out, the image is
+    consistent after each exchange and the next defrag carries on where this one stopped.
+    The budget counts from the start of the step, planning it included, though a step always
+    moves at least one block so repeated steps get somewhere. Planning reads every block map,
+    so a step takes at least that long. Returns 0 once everything is in place, 1 if blocks
+    are left to move and -1 if there isn't enough memory to plan the step
+*/
+int defrag(uint64_t budget_ms, int report_only) {
+    if (report_only) {
+        defrag_report();
+        return 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the plan takes a few arrays the size of the data region, plus one entry for each
+    // reference to a block
+    struct inode **inodes = malloc(geometry.num_inodes * (geometry.num_snapshots + 1) * sizeof(struct inode *));
+    struct file_heat *order = malloc(geometry.num_inodes * sizeof(struct file_heat));
+    uint64_t *first = calloc(geometry.num_blocks + 1, sizeof(uint64_t));
+    uint64_t *next = malloc(geometry.num_blocks * sizeof(uint64_t));
+    int64_t *want = malloc(geometry.num_blocks * sizeof(int64_t));
+    uint8_t *placed = calloc(geometry.num_blocks, sizeof(uint8_t));
+    int64_t *pos = malloc(geometry.num_blocks * sizeof(int64_t));
+    int64_t *at = malloc(geometry.num_blocks * sizeof(int64_t));
+    struct block_ref *refs = NULL;
+    if (!inodes || !order || !first || !next || !want || !placed || !pos || !at) {
+        fprintf(output_fp, "defrag error: Not enough memory\n");
+        free(inodes);
+        free(order);
+        free(first);
+        free(next);
+        free(want);
+        free(placed);
+        free(pos);
+        free(at);
+        return -1;
+    }
+
+    // the image's inodes come first so its files get the front of the data region
+    uint64_t num_inodes = 0;
+    time_t now = time(NULL);
+    for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+        if (free_inode_map[i] && !(inode_array_ptr[i]->flags & INODE_INLINE)) {
+            order[num_inodes].heat = file_heat(inode_array_ptr[i], now);
+            order[num_inodes++].inode_idx = i;
+        }
+    }
+    if (geometry.features & IMAGE_PLACEMENT) {
+        qsort(order, num_inodes, sizeof(struct file_heat), compare_heat);
+    }
+    for (uint64_t i = 0; i < num_inodes; i++) {
+        inodes[i] = inode_array_ptr[order[i].inode_idx];
+    }
+    free(order);
+    uint64_t num_live = num_inodes;
+    for (uint64_t j = 0; j < geometry.num_snapshots; j++) {
+        for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+            if (snapshots[j].free_inode_map[i] && !(snapshots[j].inodes[i]->flags & INODE_INLINE)) {
+                inodes[num_inodes++] = snapshots[j].inodes[i];
+            }
+        }
+    }
+
+    // every reference to each block, grouped by block: count them, then fill them in
+    for (uint64_t i = 0; i < num_inodes; i++) {
+        for (uint64_t j = 0; inodes[i]->blocks[j] != -1; j++) {
+            int64_t entry = inodes[i]->blocks[j];
+            if (entry != HOLE_ENTRY && valid_entry(entry)) {
+                first[entry_block(entry) + 1]++;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        first[i + 1] += first[i];
+    }
+
+    refs = malloc((first[geometry.num_blocks] + 1) * sizeof(struct block_ref));
+    if (!refs) {
+        fprintf(output_fp, "defrag error: Not enough memory\n");
+        free(inodes);
+        free(first);
+        free(next);
+        free(want);
+        free(placed);
+        free(pos);
+        free(at);
+        return -1;
+    }
+    memcpy(next, first, geometry.num_blocks * sizeof(uint64_t));
+    for (uint64_t i = 0; i < num_inodes; i++) {
+        for (uint64_t j = 0; inodes[i]->blocks[j] != -1; j++) {
+            int64_t entry = inodes[i]->blocks[j];
+            if (entry != HOLE_ENTRY && valid_entry(entry)) {
+                refs[next[entry_block(entry)]].inode = inodes[i];
+                refs[next[entry_block(entry)]].index = j;
+                next[entry_block(entry)]++;
+            }
+        }
+    }
+
+    // the block wanted at each position: the image's whole blocks in the order its files
+    // use them, then the blocks its packed entries use, then whatever only snapshots use
+    // (a block shared by several files goes where the first of them wants it). With placement
+    // on a file's packed blocks go right after its whole blocks, so a hot file's tail is in
+    // the hot region too
+    uint64_t num_used = 0;
+    int by_heat = geometry.features & IMAGE_PLACEMENT;
+    for (int pass = by_heat ? 1 : 0; pass < 3; pass++) {
+        for (uint64_t i = pass < 2 ? 0 : num_live; i < (pass < 2 ? num_live : num_inodes); i++) {
+            for (uint64_t j = 0; inodes[i]->blocks[j] != -1; j++) {
+                int64_t entry = inodes[i]->blocks[j];
+                if (entry == HOLE_ENTRY || !valid_entry(entry) ||
+                    (pass < 2 && !by_heat && !(entry & PACKED_ENTRY) != !pass)) {
+                    continue;
+                }
+
+                int64_t block_idx = entry_block(entry);
+                if (!placed[block_idx]) {
+                    placed[block_idx] = 1;
+                    want[num_used++] = block_idx;
+                }
+            }
+        }
+    }
+
+    // where each block (by its index before the step) is now, and which block is at each position
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        pos[i] = i;
+        at[i] = i;
+    }
+
+    // exchange blocks into place until the time the planning left runs out
+    uint64_t moved = 0;
+    for (uint64_t t = 0; t < num_used; t++) {
+        int64_t block_idx = want[t];
+        int64_t from = pos[block_idx];
+        if (from == (int64_t) t) {
+            continue;
+        }
+        if (moved > 0 && elapsed_ns(&start) > budget_ms * 1000000) {
+            break;
+        }
+
+        // the block in the way (or a free one) takes the place this one leaves
+        int64_t other = at[t];
+        uint64_t count = first[block_idx + 1] - first[block_idx];
+        uint64_t other_count = first[other + 1] - first[other];
+        struct share_table moved_entries;
+        moved_entries.entries = malloc((count + other_count + 1) * sizeof(int64_t));
+        moved_entries.refs = malloc((count + other_count + 1) * sizeof(uint32_t));
+
+        swap_blocks(from, t);
+        uint64_t num_moved = move_references(&refs[first[block_idx]], count, t, &moved_entries);
+        struct share_table rest = { 0, 0, 0, moved_entries.entries + num_moved, moved_entries.refs + num_moved };
+        num_moved += move_references(&refs[first[other]], other_count, from, &rest);
+
+        for (uint64_t i = 0; i < num_moved; i++) {
+            share_entry(moved_entries.entries[i]);
+            shared_entries.refs[share_slot(moved_entries.entries[i])] = moved_entries.refs[i];
+        }
+        free(moved_entries.entries);
+        free(moved_entries.refs);
+
+        pos[block_idx] = t;
+        at[t] = block_idx;
+        pos[other] = from;
+        at[from] = other;
+        moved++;
+    }
+
+    // the dedup index follows the blocks it points at
+    for (uint64_t i = 0; fingerprint_index && i < geometry.num_blocks; i++) {
+        int64_t entry = fingerprint_index[i].entry;
+        if (entry != -1 && valid_entry(entry)) {
+            fingerprint_index[i].entry = with_block(entry, pos[entry_block(entry)]);
+        }
+    }
+
+    uint64_t left = 0;
+    for (uint64_t t = 0; t < num_used; t++) {
+        if (pos[want[t]] != (int64_t) t) {
+            left++;
+        }
+    }
+
+    fprintf(output_fp, "defrag: %" PRIu64 " blocks moved in %.1f ms", moved, elapsed_ns(&start) / 1e6);
+    if (left > 0) {
+        fprintf(output_fp, ", %" PRIu64 " left to move (run defrag again to carry on).\n", left);
+    }
+    else {
+        fprintf(output_fp, ", free space starts at block %" PRIu64 ".\n", num_used);
+    }
+
+    free(first);
+    free(next);
+    free(refs);
+    free(want);
+    free(placed);
+    free(pos);
+    free(at);
+    free(inodes);
+
+    return left > 0;
+}
+
+/*
+    Name: defrag_worker
+    Parameters: unused
+    Return: void pointer
+    Description: takes a defrag step every defrag_interval seconds until stopped, under the
+    same locks as a defrag request. With placement on this migrates the files being read
+    into the hot region a step at a time, and back out once they cool down
+*/
+void *defrag_worker(void *arg) {
+    (void) arg;
+
+    // the reports of the steps aren't wanted anywhere
+    output_fp = fopen("/dev/null", "w");
+
+    pthread_mutex_lock(&defrag_auto_lock);
+    while (defrag_interval) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += defrag_interval;
+        if (pthread_cond_timedwait(&defrag_auto_cond, &defrag_auto_lock, &wake) != ETIMEDOUT || !defrag_interval) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&defrag_auto_lock);
+        pthread_rwlock_wrlock(&image_lock);
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_wrlock(&inode_locks[i]);
+        }
+        if (opened) {
+            defrag(DEFRAG_STEP_MS, 0);
+        }
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_unlock(&inode_locks[i]);
+        }
+        pthread_rwlock_unlock(&image_lock);
+        pthread_mutex_lock(&defrag_auto_lock);
+    }
+    pthread_mutex_unlock(&defrag_auto_lock);
+
+    fclose(output_fp);
+
+    return NULL;
+}
+
+/*
+    Name: defrag_auto
+    Parameters: seconds between background defrag steps (0 to stop)
+    Return: void
+    Description: starts, restarts or stops the background defrag. The caller must not hold
+    the image lock, a step in progress may be waiting for it
+*/
+void defrag_auto(uint64_t interval) {
+    pthread_mutex_lock(&defrag_auto_control_lock);
+
+    // stop the running thread first
+    pthread_mutex_lock(&defrag_auto_lock);
+    int running = defrag_interval > 0;
+    defrag_interval = 0;
+    pthread_cond_signal(&defrag_auto_cond);
+    pthread_mutex_unlock(&defrag_auto_lock);
+    if (running) {
+        pthread_join(defrag_thread, NULL);
+    }
+
+    if (interval > 0) {
+        defrag_interval = interval;
+        pthread_create(&defrag_thread, NULL, defrag_worker, NULL);
+    }
+
+    pthread_mutex_unlock(&defrag_auto_control_lock);
+}
+
+/*
+    Name: resize_array
+    Parameters: array, its number of elements, the number it should have and the size of one
+    Return: pointer to the resized array
+    Description: reallocates a per block array, elements added at the end are zeroed
+*/
+void *resize_array(void *array, uint64_t count, uint64_t new_count, size_t size) {
+    array = realloc(array, new_count * size);
+    if (new_count > count) {
+        memset((char *) array + count * size, 0, (new_count - count) * size);
+    }
+
+    return array;
+}
+
+/*
+    Name: resize
+    Parameters: number of data blocks the image should have
+    Return: int
+    Description: grows or shrinks the data region of the opened image. The data region sits
+    right after the header, so it grows into where the metadata regions were and shrinks by
+    giving its end up to them; only blocks in use past a shrink boundary are moved, into
+    free blocks before it. The image is saved straight away since its metadata regions move
+    in the file, and the fingerprint index is rehashed for the new block count, so a resize
+    costs O(metadata) on top of the blocks it moves however small the change is. Returns 0
+    on success and -1 on failure
+*/
+int resize(uint64_t new_num_blocks) {
+    uint64_t num_blocks = geometry.num_blocks;
+    if (new_num_blocks == 0 || new_num_blocks > MAX_NUM_BLOCKS) {
+        fprintf(output_fp, "resize error: Invalid block count\n");
+        return -1;
+    }
+
+    // every block in use past the boundary needs a free block before it to go to
+    uint64_t num_moving = 0;
+    for (uint64_t i = new_num_blocks; i < num_blocks; i++) {
+        if (free_block_map[i]) {
+            num_moving++;
+        }
+    }
+
+    int64_t *targets = NULL;
+    if (num_moving > 0) {
+        targets = malloc((num_blocks - new_num_blocks) * sizeof(int64_t));
+        uint64_t found = 0;
+        int64_t block_idx = 0;
+        for (uint64_t i = new_num_blocks; i < num_blocks; i++) {
+            targets[i - new_num_blocks] = -1;
+            if (!free_block_map[i]) {
+                continue;
+            }
+
+            while (block_idx < (int64_t) new_num_blocks && free_block_map[block_idx]) {
+                block_idx++;
+            }
+            if (block_idx == (int64_t) new_num_blocks) {
+                break;
+            }
+            targets[i - new_num_blocks] = block_idx++;
+            found++;
+        }
+
+        if (found < num_moving) {
+            fprintf(output_fp, "resize error: Not enough free space\n");
+            free(targets);
+            return -1;
+        }
+
+        // move the blocks first, then point the image's and the snapshots' entries at them
+        for (uint64_t i = new_num_blocks; i < num_blocks; i++) {
+            if (targets[i - new_num_blocks] != -1) {
+                swap_blocks(i, targets[i - new_num_blocks]);
+            }
+        }
+
+        for (uint64_t k = 0; k <= geometry.num_snapshots; k++) {
+            for (uint64_t i = 0; i < geometry.num_inodes; i++) {
+                struct inode *inode = k == 0 ? inode_array_ptr[i] : snapshots[k - 1].inodes[i];
+                uint8_t used = k == 0 ? free_inode_map[i] : snapshots[k - 1].free_inode_map[i];
+                if (!used || (inode->flags & INODE_INLINE)) {
+                    continue;
+                }
+
+                for (uint64_t j = 0; inode->blocks[j] != -1; j++) {
+                    int64_t entry = inode->blocks[j];
+                    if (entry == HOLE_ENTRY || !valid_entry(entry) ||
+                        entry_block(entry) < (int64_t) new_num_blocks) {
+                        continue;
+                    }
+
+                    // the new entry goes in a block that was free, so it can't collide with
+                    // one already in the share table
+                    int64_t new_entry = with_block(entry, targets[entry_block(entry) - new_num_blocks]);
+                    int64_t slot = share_slot(entry);
+                    if (slot != -1) {
+                        uint32_t refs = shared_entries.refs[slot];
+                        shared_entries.entries[slot] = DELETED_SLOT;
+                        shared_entries.count--;
+                        share_entry(new_entry);
+                        shared_entries.refs[share_slot(new_entry)] = refs;
+                    }
+                    inode->blocks[j] = new_entry;
+                }
+            }
+        }
+    }
+
+    // the fingerprint index is hashed by the block count, put its hints in a new one
+    if (fingerprint_index) {
+        struct fingerprint_slot *index = malloc(new_num_blocks * sizeof(struct fingerprint_slot));
+        for (uint64_t i = 0; i < new_num_blocks; i++) {
+            index[i].entry = -1;
+        }
+
+        for (uint64_t i = 0; i < num_blocks; i++) {
+            int64_t entry = fingerprint_index[i].entry;
+            if (entry == -1 || !valid_entry(entry)) {
+                continue;
+            }
+            if (entry_block(entry) >= (int64_t) new_num_blocks) {
+                // hints outlive the blocks they name, a hint past the boundary whose block
+                // didn't move names a freed block and is dropped
+                if (!targets || targets[entry_block(entry) - new_num_blocks] == -1) {
+                    continue;
+                }
+                entry = with_block(entry, targets[entry_block(entry) - new_num_blocks]);
+            }
+
+            struct fingerprint_slot *slot = &index[fingerprint_index[i].fingerprint % new_num_blocks];
+            slot->fingerprint = fingerprint_index[i].fingerprint;
+            slot->entry = entry;
+        }
+
+        free(fingerprint_index);
+        fingerprint_index = index;
+    }
+    free(targets);
+
+    // the blocks past a shrink boundary are all free now
+    for (uint64_t i = new_num_blocks; i < num_blocks; i++) {
+        free(data_blocks[i]);
+    }
+    data_blocks = resize_array(data_blocks, num_blocks, new_num_blocks, sizeof(void *));
+    dirty_block_map = resize_array(dirty_block_map, num_blocks, new_num_blocks, sizeof(uint8_t));
+    block_checksums = resize_array(block_checksums, num_blocks, new_num_blocks, sizeof(uint32_t));
+    corrupt_block_map = resize_array(corrupt_block_map, num_blocks, new_num_blocks, sizeof(uint8_t));
+    fragment_map = resize_array(fragment_map, num_blocks, new_num_blocks, sizeof(uint16_t));
+    free_block_map = resize_array(free_block_map, num_blocks, new_num_blocks, sizeof(uint8_t));
+
+    // lay the regions out again around the new data region, keeping the image's settings
+    uint64_t features = geometry.features;
+    uint64_t num_snapshots = geometry.num_snapshots;
+    set_geometry(geometry.block_size, new_num_blocks, geometry.num_inodes);
+    geometry.features = features;
+    geometry.num_snapshots = num_snapshots;
+
+    fprintf(output_fp, "resize: %" PRIu64 " blocks to %" PRIu64 ", %" PRIu64 " blocks moved.\n",
+            num_blocks, new_num_blocks, num_moving);
+
+    return savefs();
+}
+
+/*
+    Name: feature_flag
+    Parameters: name of a feature as set takes it
+    Return: uint64_t
+    Description: the feature flag with the name, 0 if there is none
+*/
+uint64_t feature_flag(char *name) {
+    if (!strcmp(name, "compress")) {
+        return IMAGE_COMPRESS;
+    }
+    if (!strcmp(name, "dedup")) {
+        return IMAGE_DEDUP;
+    }
+    if (!strcmp(name, "placement")) {
+        return IMAGE_PLACEMENT;
+    }
+
+    return 0;
+}
+
+/*
+    Name: set_feature
+    Parameters: feature flag and whether to turn it on
+    Return: void
+    Description: turns compression, deduplication or access-aware placement of newly stored
+    blocks on or off, blocks already stored stay as they are
+*/
+void set_feature(uint64_t feature, int on) {
+    if (on) {
+        geometry.features |= feature;
+    }
+    else {
+        geometry.features &= ~feature;
+    }
+
+    // dedup starts out with an empty fingerprint index and drops it when turned off
+    if ((geometry.features & IMAGE_DEDUP) && !fingerprint_index) {
+        fingerprint_index = malloc(geometry.num_blocks * sizeof(struct fingerprint_slot));
+        for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+            fingerprint_index[i].entry = -1;
+        }
+    }
+    else if (!(geometry.features & IMAGE_DEDUP)) {
+        free(fingerprint_index);
+        fingerprint_index = NULL;
+    }
+}
+
+/*
+    Name: record_command
+    Parameters: command line as typed and its tokens
+    Return: void
+    Description: appends the command to the workload recording with the microseconds since
+    the recording started and the size of the host file it reads, if any, so mfs_replay can
+    make up data of the same size
+*/
+void record_command(char *line, char **token) {
+    int64_t size = 0;
+    struct stat buf;
+    if ((!strcmp(token[0], "put") || !strcmp(token[0], "write")) && token[1] && stat(token[1], &buf) == 0) {
+        size = buf.st_size;
+    }
+
+    fprintf(record_fp, "%" PRIu64 " %" PRId64 " %s\n", elapsed_ns(&record_epoch) / 1000, size, line);
+    fflush(record_fp);
+}
 
-            free(directory_array_ptr[dir_idx].name);
-            directory_array_ptr[dir_idx].name = NULL;
-            directory_array_ptr[dir_idx].valid = 0;
-            directory_array_ptr[dir_idx].inode_idx = -1;
-            directory_array_ptr[dir_idx].h = 0;
-            directory_array_ptr[dir_idx].r = 0;
+/*
+    Name: record_workload
+    Parameters: file to record to, or "off" to stop recording
+    Return: int
+    Description: starts or stops recording the commands typed, returns 0 on success and -1
+    if the file can't be written
+*/
+int record_workload(char *path) {
+    if (record_fp) {
+        fclose(record_fp);
+        record_fp = NULL;
+    }
+    if (!strcmp(path, "off")) {
+        return 0;
+    }
+
+    record_fp = fopen(path, "w");
+    if (!record_fp) {
+        fprintf(output_fp, "record error: File not found\n");
+        return -1;
+    }
+    fprintf(record_fp, "%s\n", RECORD_HEADER);
+    clock_gettime(CLOCK_MONOTONIC, &record_epoch);
+
+    return 0;
+}
+
+/*
+    Name: make_directory
+    Parameters: path of the directory to create
+    Return: int
+    Description: creates an empty directory, returns 0 on success and -1 on failure
+*/
+int make_directory(char *path) {
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t dir_inode = check_new_entry("mkdir", path, leaf);
+    if (dir_inode == -1) {
+        return -1;
+    }
+
+    // a directory takes an inode and a directory entry like a file does
+    int64_t inode_idx = find_free_inode();
+    if (inode_idx == -1 || find_free_directory_entry() == -1) {
+        fprintf(output_fp, "mkdir error: Not enough disk space\n");
+        return -1;
+    }
+
+    make_directory_inode(inode_idx, dir_inode);
+    add_directory_entry(dir_inode, leaf, inode_idx);
+
+    return 0;
+}
+
+/*
+    Name: remove_directory
+    Parameters: path of the directory to remove
+    Return: int
+    Description: removes an empty directory, returns 0 on success and -1 on failure
+*/
+int remove_directory(char *path) {
+    int64_t dir_idx = find_directory_entry(path);
+
+    if (dir_idx == -1 || directory_array_ptr[dir_idx].r) {
+        fprintf(output_fp, "rmdir error: Directory not found\n");
+        return -1;
+    }
+
+    int64_t inode_idx = directory_array_ptr[dir_idx].inode_idx;
+    struct inode *inode = inode_array_ptr[inode_idx];
+
+    if (inode->type != TYPE_DIRECTORY) {
+        fprintf(output_fp, "rmdir error: Not a directory\n");
+        return -1;
+    }
+
+    if (inode->index->count != 0) {
+        fprintf(output_fp, "rmdir error: Directory not empty\n");
+        return -1;
+    }
+
+    // an empty directory can't contain the working directory, but can be it
+    if (inode_idx == cwd_inode) {
+        fprintf(output_fp, "rmdir error: Directory is in use\n");
+        return -1;
+    }
+
+    remove_directory_entry(dir_idx);
+
+    // drops the directory's index as well
+    alloc_inode(inode_idx);
+    free_inode_map[inode_idx] = 0;
+
+    return 0;
+}
+
+/*
+    Name: change_directory
+    Parameters: path of the new working directory (NULL for the root)
+    Return: int
+    Description: changes the shell's working directory, returns 0 on success and -1 on failure
+*/
+int change_directory(char *path) {
+    int64_t dir_inode = path ? resolve_inode(path) : ROOT_INODE;
+
+    if (dir_inode == -1 || inode_array_ptr[dir_inode]->type != TYPE_DIRECTORY) {
+        fprintf(output_fp, "cd error: Directory not found\n");
+        return -1;
+    }
+
+    cwd_inode = dir_inode;
+
+    return 0;
+}
+
+/*
+    Name: image_open
+    Parameters: name of the command
+    Return: int
+    Description: returns 1 if an image is open, otherwise prints the command's error and
+    returns 0
+*/
+int image_open(char *command) {
+    if (!opened) {
+        fprintf(output_fp, "%s error: No file system image currently open\n", command);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Name: createfs_geometry
+    Parameters: tokens of a createfs command and the block size, block count and inode count
+    to parse them into
+    Return: int
+    Description: "createfs <image> [block size] [blocks] [inodes]", the geometry not given is
+    the default one. Returns 0 on success and -1 if no image filename was given
+*/
+int createfs_geometry(char **token, uint64_t *block_size, uint64_t *num_blocks, uint64_t *num_inodes) {
+    if (token[1] == NULL) {
+        fprintf(output_fp, "createfs error: File not found\n");
+        return -1;
+    }
 
-            inode_array_ptr[inode_idx]->date = 0;
-            inode_array_ptr[inode_idx]->size = 0;
-            inode_array_ptr[inode_idx]->valid = 0;
-            for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
-                inode_array_ptr[inode_idx]->blocks[i] = -1;
+    *block_size = token[2] ? strtoull(token[2], NULL, 10) : DEFAULT_BLOCK_SIZE;
+    *num_blocks = token[3] ? strtoull(token[3], NULL, 10) : DEFAULT_NUM_BLOCKS;
+    *num_inodes = token[4] ? strtoull(token[4], NULL, 10) : DEFAULT_NUM_INODES;
+
+    return 0;
+}
+
+/*
+    Name: get_range
+    Parameters: tokens of a get command and the offset and length to parse them into
+    Return: int
+    Description: "get <image file> [host file] [offset length]", the whole file unless a byte
+    range is given. Returns 0 on success and -1 on incorrect usage
+*/
+int get_range(char **token, uint64_t *offset, uint64_t *length) {
+    if (token[1] == NULL) {
+        fprintf(output_fp, "get error: File not found\n");
+        return -1;
+    }
+
+    *offset = 0;
+    *length = UINT64_MAX;
+    if (token[2] != NULL && token[3] != NULL && token[4] != NULL) {
+        *offset = strtoull(token[3], NULL, 10);
+        *length = strtoull(token[4], NULL, 10);
+    }
+    else if (token[3] != NULL) {
+        fprintf(output_fp, "get error: Incorrect command usage\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Name: image_command
+    Parameters: tokens of the command, NULL after the last one
+    Return: int
+    Description: runs the commands that only work on the opened image, the ones that need no
+    host file and leave the shell's images as they are, for the REPL and mfs_replay alike.
+    Returns 0 on success, -1 on failure and 1 if the command isn't one of them
+*/
+int image_command(char **token) {
+    if (!strcmp(token[0], "defrag") && token[1] && !strcmp(token[1], "auto")) {
+        return 1;
+    }
+    if (strcmp(token[0], "df") && strcmp(token[0], "list") && strcmp(token[0], "attrib") &&
+        strcmp(token[0], "del") && strcmp(token[0], "mkdir") && strcmp(token[0], "rmdir") &&
+        strcmp(token[0], "cd") && strcmp(token[0], "clone") && strcmp(token[0], "snapshot") &&
+        strcmp(token[0], "scrub") && strcmp(token[0], "fsck") && strcmp(token[0], "defrag") &&
+        strcmp(token[0], "resize") && strcmp(token[0], "set")) {
+        return 1;
+    }
+
+    if (!image_open(token[0])) {
+        return -1;
+    }
+
+    if (!strcmp(token[0], "df")) {
+        report_df();
+    }
+    else if (!strcmp(token[0], "list")) {
+        // "list [-h] [path]", lists the working directory if no path given
+        int list_hidden = 0;
+        char *path = NULL;
+        for (int i = 1; i < MAX_NUM_ARGUMENTS && token[i]; i++) {
+            if (!strcmp(token[i], "-h")) {
+                list_hidden = 1;
             }
+            else {
+                path = token[i];
+            }
+        }
 
-            free_inode_map[inode_idx] = 1;
+        list(path, list_hidden);
+    }
+    else if (!strcmp(token[0], "attrib")) {
+        // "attrib +h|-h|+r|-r <file>"
+        if (token[1] == NULL || token[2] == NULL || (strcmp(token[1], "+h") && strcmp(token[1], "-h") &&
+            strcmp(token[1], "+r") && strcmp(token[1], "-r"))) {
+            fprintf(output_fp, "attrib error: Incorrect command usage\n");
+            return -1;
+        }
 
-            return;
-        } 
+        int set = token[1][0] == '+';
+        attrib(token[1][1] == 'h' ? set : -1, token[1][1] == 'r' ? set : -1, token[2]);
+    }
+    else if (!strcmp(token[0], "del")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "del error: File not found\n");
+            return -1;
+        }
 
-        inode_array_ptr[inode_idx]->blocks[inode_block_entry] = block_idx;
+        return del(token[1]);
+    }
+    else if (!strcmp(token[0], "mkdir") || !strcmp(token[0], "rmdir")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "%s error: Directory not found\n", token[0]);
+            return -1;
+        }
 
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if (bytes == 0 && !feof(fp)) {
-            printf("An error occured reading from the input file.\n");
-            return;
+        return !strcmp(token[0], "mkdir") ? make_directory(token[1]) : remove_directory(token[1]);
+    }
+    else if (!strcmp(token[0], "cd")) {
+        // go to the given directory, or the root if none given
+        return change_directory(token[1]);
+    }
+    else if (!strcmp(token[0], "clone")) {
+        if (token[1] == NULL || token[2] == NULL) {
+            fprintf(output_fp, "clone error: Incorrect command usage\n");
+            return -1;
         }
 
-        // Clear the EOF file flag.
-        clearerr(fp);
+        return clone_file(token[1], token[2]);
+    }
+    else if (!strcmp(token[0], "snapshot")) {
+        // "snapshot list" or "snapshot create|restore|delete <name>"
+        if (token[1] != NULL && !strcmp(token[1], "list")) {
+            snapshot_list();
+        }
+        else if (token[1] == NULL || token[2] == NULL) {
+            fprintf(output_fp, "snapshot error: Incorrect command usage\n");
+            return -1;
+        }
+        else if (!strcmp(token[1], "create")) {
+            return snapshot_create(token[2]);
+        }
+        else if (!strcmp(token[1], "restore")) {
+            return snapshot_restore(token[2]);
+        }
+        else if (!strcmp(token[1], "delete")) {
+            return snapshot_delete(token[2]);
+        }
+        else {
+            fprintf(output_fp, "snapshot error: Incorrect command usage\n");
+            return -1;
+        }
+    }
+    else if (!strcmp(token[0], "scrub")) {
+        // "scrub [threads] [MB/s]", one thread per core at the default rate unless given
+        int num_threads = token[1] ? atoi(token[1]) : 0;
+        uint64_t rate = token[1] && token[2] ? strtoull(token[2], NULL, 10) : DEFAULT_SCRUB_RATE;
 
-        // Reduce copy_size by the BLOCK_SIZE bytes.
-        copy_size -= BLOCK_SIZE;
-        
-        // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-        // the fseek at the top of the loop to position us to the correct spot.
-        offset += BLOCK_SIZE;
+        return scrub(num_threads, rate);
+    }
+    else if (!strcmp(token[0], "fsck")) {
+        // "fsck -n" only reports what it finds
+        return fsck(!(token[1] && !strcmp(token[1], "-n")));
+    }
+    else if (!strcmp(token[0], "defrag")) {
+        // "defrag -s" only reports the scores, "defrag [ms]" moves blocks for that long
+        int report_only = token[1] && !strcmp(token[1], "-s");
+        uint64_t budget_ms = token[1] && !report_only ? strtoull(token[1], NULL, 10) : DEFRAG_STEP_MS;
 
-        // Increment the index into the block array 
-        block_idx++;
+        // blocks left to move aren't a failure, the next step carries on
+        return defrag(budget_ms, report_only) == -1 ? -1 : 0;
     }
+    else if (!strcmp(token[0], "resize")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "resize error: Incorrect command usage\n");
+            return -1;
+        }
 
-    // handle remainder
-    if (copy_size > 0) {
-        // try to find a free block
-        int block_idx = find_free_block();
+        return resize(strtoull(token[1], NULL, 10));
+    }
+    else if (!strcmp(token[0], "set")) {
+        // "set compress|dedup|placement on|off" turns compression, deduplication or
+        // access-aware placement of newly stored blocks on or off, blocks already stored
+        // stay as they are
+        uint64_t feature = token[1] != NULL ? feature_flag(token[1]) : 0;
+
+        if (feature == 0 || token[2] == NULL || (strcmp(token[2], "on") && strcmp(token[2], "off"))) {
+            fprintf(output_fp, "set error: Incorrect command usage\n");
+            return -1;
+        }
 
-        // if -1 returned (never should), print error message and cleanup directory/inode entry
-        if (block_idx == -1) {
-            printf("put error: Not enough disk space\n");
+        set_feature(feature, !strcmp(token[2], "on"));
+    }
 
-            free(directory_array_ptr[dir_idx].name);
-            directory_array_ptr[dir_idx].name = NULL;
-            directory_array_ptr[dir_idx].valid = 0;
-            directory_array_ptr[dir_idx].inode_idx = -1;
-            directory_array_ptr[dir_idx].h = 0;
-            directory_array_ptr[dir_idx].r = 0;
+    return 0;
+}
+
+/*
+    Name: attach
+    Parameters: filename of the image to attach
+    Return: int
+    Description: loads a second image next to the opened one (or creates an empty one if the
+    file doesn't exist yet), returns 0 on success and -1 on failure
+*/
+int attach(char *image) {
+    if (attached_image.opened) {
+        fprintf(output_fp, "attach error: An image is already attached\n");
+        return -1;
+    }
+
+    // build the second image in the attached slot
+    swap_images();
 
-            inode_array_ptr[inode_idx]->date = 0;
-            inode_array_ptr[inode_idx]->size = 0;
-            inode_array_ptr[inode_idx]->valid = 0;
+    int retval = 0;
+    if (access(image, F_OK) == 0) {
+        retval = open(image);
+    }
+    else if (init(DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES) < 0) {
+        fprintf(output_fp, "attach error: Not enough memory\n");
+        retval = -1;
+    }
+
+    if (retval == 0) {
+        opened_image = strdup(image);
+    }
+    // nothing is left attached after a failure
+    else if (opened) {
+        close_image();
+    }
+
+    swap_images();
+
+    return retval;
+}
+
+/*
+    Name: detach
+    Parameters: None
+    Return: int
+    Description: saves the attached image back to its file and releases it, returns 0 on
+    success and -1 on failure (the image stays attached if it couldn't be saved)
+*/
+int detach() {
+    if (!attached_image.opened) {
+        fprintf(output_fp, "detach error: No image attached\n");
+        return -1;
+    }
+
+    swap_images();
+
+    if (savefs() == -1) {
+        fprintf(output_fp, "detach error: The attached image could not be saved, it stays attached\n");
+        swap_images();
+        return -1;
+    }
+
+    free(opened_image);
+    opened_image = NULL;
+    close_image();
+
+    swap_images();
+
+    return 0;
+}
+
+/*
+    Name: transfer
+    Parameters: filename in the opened image, filename to give it in the attached image
+    (NULL to keep the same name) and a flag that says whether to move instead of copy
+    Return: int
+    Description: copies a file from the opened image into the attached image block by block,
+    a move hands the source's block buffers over to the target instead of copying them and
+    then deletes the source. Returns 0 on success and -1 on failure
+*/
+int transfer(char *filename, char *target_filename, int move) {
+    char *command = move ? "move" : "copy";
+
+    if (!attached_image.opened) {
+        fprintf(output_fp, "%s error: No image attached\n", command);
+        return -1;
+    }
+
+    // find the source file in the opened image
+    int64_t src_dir_idx = find_directory_entry(filename);
+    if (src_dir_idx == -1) {
+        fprintf(output_fp, "%s error: File not found\n", command);
+        return -1;
+    }
+
+    if (inode_array_ptr[directory_array_ptr[src_dir_idx].inode_idx]->type == TYPE_DIRECTORY) {
+        fprintf(output_fp, "%s error: Is a directory\n", command);
+        return -1;
+    }
+
+    // keep the file's name in the attached image's working directory unless told otherwise
+    if (!target_filename) {
+        target_filename = directory_array_ptr[src_dir_idx].name;
+    }
+
+    // a move deletes the source, which read-only files don't allow
+    if (move && directory_array_ptr[src_dir_idx].r) {
+        fprintf(output_fp, "move error: File is read-only\n");
+        return -1;
+    }
+
+    struct inode *src_inode = inode_array_ptr[directory_array_ptr[src_dir_idx].inode_idx];
+    int hidden = directory_array_ptr[src_dir_idx].h;
+    int read_only = directory_array_ptr[src_dir_idx].r;
+    uint64_t src_block_size = geometry.block_size;
+
+    // load the source blocks while the source is the opened image, the target reaches
+    // them through this array once the images are swapped (an inline file's data is in
+    // its inode, a packed tail's in its fragments). Compressed blocks are expanded into
+    // buffers of their own, freed along with the array. Blocks of its own the file doesn't
+    // share with another are marked movable, a move can hand those over without copying
+    uint64_t num_src_blocks = blocks_for(src_inode->size);
+    void **src_blocks = malloc((num_src_blocks + 1) * sizeof(void *));
+    uint8_t *src_expanded = calloc(num_src_blocks + 1, sizeof(uint8_t));
+    uint8_t *src_movable = calloc(num_src_blocks + 1, sizeof(uint8_t));
+    for (uint64_t i = 0; i < num_src_blocks; i++) {
+        int64_t entry = src_inode->blocks[i];
+
+        if (src_inode->flags & INODE_INLINE) {
+            src_blocks[i] = src_inode->blocks;
+        }
+        else if (entry != HOLE_ENTRY && (entry & COMPRESSED_ENTRY)) {
+            src_blocks[i] = entry_data(entry, malloc(src_block_size));
+            src_expanded[i] = 1;
+        }
+        else {
+            src_blocks[i] = entry_data(entry, NULL);
+            src_movable[i] = entry >= 0 && !(entry & PACKED_ENTRY) && share_slot(entry) == -1;
+        }
+    }
+
+    // the remaining work allocates in the attached image
+    swap_images();
+
+    // the images may have different block sizes, then a move has to copy too
+    uint64_t num_blocks = blocks_for(src_inode->size);
+    int relink = move && geometry.block_size == src_block_size;
+
+    // the target path is resolved in the attached image
+    char leaf[MAX_COMMAND_SIZE];
+    int64_t target_dir_inode = check_new_entry(command, target_filename, leaf);
+    if (target_dir_inode == -1) {
+        swap_images();
+        for (uint64_t i = 0; i < num_src_blocks; i++) {
+            if (src_expanded[i]) {
+                free(src_blocks[i]);
+            }
+        }
+        free(src_blocks);
+        free(src_expanded);
+        free(src_movable);
+        return -1;
+    }
+
+    int retval = -1;
+    int64_t inode_idx;
+
+    if (src_inode->size > geometry.max_file_size) {
+        fprintf(output_fp, "%s error: File size too big\n", command);
+    }
+    else if (num_blocks * geometry.block_size > df()) {
+        fprintf(output_fp, "%s error: Not enough disk space\n", command);
+    }
+    else if (find_free_directory_entry() == -1 || (inode_idx = find_free_inode()) == -1) {
+        fprintf(output_fp, "%s error: Not enough disk space\n", command);
+    }
+    else {
+        struct inode *inode = alloc_inode(inode_idx);
+        inode->size = src_inode->size;
+        reserve_blocks(inode, num_blocks);
+
+        // reserve the target blocks as one contiguous run when the free space allows it,
+        // otherwise fall back to first-fit one block at a time
+        int64_t run_start = find_free_block_run(num_blocks);
+        char *buffer = malloc(geometry.block_size);
+        char *compressed = malloc(geometry.block_size);
+        int compress = geometry.features & IMAGE_COMPRESS;
+        retval = 0;
+
+        for (uint64_t i = 0; i < num_blocks && retval == 0; i++) {
+            int64_t block_idx = run_start != -1 ? run_start + (int64_t) i : -1;
+
+            // both images live in this process, so a move relinks the source buffer into
+            // the target, the source gives it up and frees the block on delete. Only
+            // blocks of its own can be handed over, not inline data, holes, packed fragments
+            // or blocks other files share
+            if (relink && src_movable[i]) {
+                if (block_idx == -1) {
+                    block_idx = find_free_block();
+                }
+                free(claim_block(block_idx));
+                data_blocks[block_idx] = src_blocks[i];
+                attached_image.data_blocks[src_inode->blocks[i]] = NULL;
+                inode->blocks[i] = block_idx;
+                continue;
+            }
+
+            // otherwise gather the target block's byte range out of the source blocks
+            uint64_t offset = i * geometry.block_size;
+            uint64_t end = offset + geometry.block_size;
+            if (end > src_inode->size) {
+                end = src_inode->size;
+            }
+            uint64_t length = end - offset;
+            while (offset < end) {
+                uint64_t src_offset = offset % src_block_size;
+                uint64_t num_bytes = src_block_size - src_offset;
+                if (num_bytes > end - offset) {
+                    num_bytes = end - offset;
+                }
+                memcpy(buffer + offset % geometry.block_size,
+                       (char *) src_blocks[offset / src_block_size] + src_offset, num_bytes);
+                offset += num_bytes;
+            }
+
+            uint64_t compressed_size = compress ? compress_block(buffer, length, compressed) : 0;
+            if (store_block(inode, i, buffer, length, compressed, compressed_size, block_idx) == -1) {
+                fprintf(output_fp, "%s error: Not enough disk space\n", command);
+                release_inode(inode_idx);
+                retval = -1;
+            }
+        }
 
+        free(buffer);
+        free(compressed);
+
+        // populate inode and directory entry, keeping the source's date and attributes
+        if (retval == 0) {
+            inode->date = src_inode->date;
+            inode->valid = 1;
+            inode->parent = target_dir_inode;
             free_inode_map[inode_idx] = 1;
 
-            return;
-        } 
+            int64_t dir_idx = add_directory_entry(target_dir_inode, leaf, inode_idx);
+            directory_array_ptr[dir_idx].h = hidden;
+            directory_array_ptr[dir_idx].r = read_only;
+        }
+    }
+
+    swap_images();
+    for (uint64_t i = 0; i < num_src_blocks; i++) {
+        if (src_expanded[i]) {
+            free(src_blocks[i]);
+        }
+    }
+    free(src_blocks);
+    free(src_expanded);
+    free(src_movable);
+
+    // the moved file's blocks now belong to the attached image
+    if (retval == 0 && move) {
+        del(filename);
+    }
+
+    return retval;
+}
+
+/*
+    Name: read_full
+    Parameters: socket descriptor, buffer to read into and number of bytes to read
+    Return: int
+    Description: reads exactly len bytes from the socket, returns 0 on success and -1 if the
+    connection was closed or failed first
+*/
+int read_full(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t bytes = read(fd, ptr, len);
+
+        // retry if interrupted by a signal, give up on EOF or any other error
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/*
+    Name: write_full
+    Parameters: socket descriptor, buffer to write from and number of bytes to write
+    Return: int
+    Description: writes exactly len bytes to the socket, returns 0 on success and -1 on failure
+*/
+int write_full(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t bytes = write(fd, ptr, len);
+
+        // retry if interrupted by a signal, give up on any other error
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/*
+    Name: read_line
+    Parameters: socket descriptor, buffer to read into and size of the buffer
+    Return: int
+    Description: reads a newline terminated request line from the socket and strips the
+    newline, returns 0 on success and -1 on EOF, error or a line that does not fit
+*/
+int read_line(int fd, char *line, int size) {
+    for (int i = 0; i < size; i++) {
+        if (read_full(fd, &line[i], 1) == -1) {
+            return -1;
+        }
+
+        // end of the request line
+        if (line[i] == '\n') {
+            line[i] = 0;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Name: send_response
+    Parameters: socket descriptor, status of the request, body and length of the body
+    Return: int
+    Description: sends a "<status> <length>" header line followed by the body, returns 0 on
+    success and -1 on failure
+*/
+int send_response(int fd, int status, const char *body, size_t len) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%d %zu\n", status, len);
+
+    if (write_full(fd, header, header_len) == -1) {
+        return -1;
+    }
+
+    return write_full(fd, body, len);
+}
+
+/*
+    Name: handle_request
+    Parameters: socket descriptor of the client and the request line it sent
+    Return: int
+    Description: runs one get/put/list/del/df/savefs request under the image and file locks
+    and sends the result back, returns -1 if the connection should be dropped
+*/
+int handle_request(int fd, char *line) {
+    // tokenize the request line (strtok_r since every worker parses concurrently)
+    char *token[MAX_NUM_ARGUMENTS] = {0};
+    int token_count = 0;
+    char *save_ptr;
+    char *arg_ptr = strtok_r(line, WHITESPACE, &save_ptr);
+    while (arg_ptr != NULL && token_count < MAX_NUM_ARGUMENTS) {
+        token[token_count++] = arg_ptr;
+        arg_ptr = strtok_r(NULL, WHITESPACE, &save_ptr);
+    }
 
-        // read remainder into the block
-        fseek(fp, offset, SEEK_SET);
-        int bytes = fread(data_blocks[block_idx], copy_size, 1, fp);
+    // ignore empty lines
+    if (token_count == 0) {
+        return 0;
+    }
 
-        // After reading in data into the block, set that block in the free block map to in use
-        // index - 130 used to map from index in data_blocks to the index in the free map
-        free_block_map[block_idx - 130] = 1;
+    // collect everything the command prints into a per-request buffer
+    char *msg = NULL;
+    size_t msg_len = 0;
+    output_fp = open_memstream(&msg, &msg_len);
 
-        // Also record the block used into the blocks array of the inode
-        int inode_block_entry = find_free_inode_block_entry(inode_idx);
+    int status = 0;
+    int retval = 0;
 
-        // if -1 returned, print error message and cleanup directory/inode entry
-        if (inode_block_entry == -1) {
-            printf("put error: Not enough disk space\n");
+    // file data returned by get
+    char *data = NULL;
+    size_t data_len = 0;
 
-            free(directory_array_ptr[dir_idx].name);
-            directory_array_ptr[dir_idx].name = NULL;
-            directory_array_ptr[dir_idx].valid = 0;
-            directory_array_ptr[dir_idx].inode_idx = -1;
-            directory_array_ptr[dir_idx].h = 0;
-            directory_array_ptr[dir_idx].r = 0;
+    if (!strcmp(token[0], "put")) {
+        // request line is "put <name> <size>" followed by size bytes of file data
+        if (token[1] == NULL || token[2] == NULL) {
+            fprintf(output_fp, "put error: Incorrect command usage\n");
+            status = -1;
+            retval = -1;
+        }
+        else {
+            long long size = strtoll(token[2], NULL, 10);
 
-            inode_array_ptr[inode_idx]->date = 0;
-            inode_array_ptr[inode_idx]->size = 0;
-            inode_array_ptr[inode_idx]->valid = 0;
-            for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
-                inode_array_ptr[inode_idx]->blocks[i] = -1;
+            // the data can't be skipped over without reading it, so drop the client
+            if (size < 0 || (uint64_t) size > geometry.max_file_size) {
+                fprintf(output_fp, "put error: File size too big\n");
+                status = -1;
+                retval = -1;
             }
+            else {
+                // fmemopen does not accept an empty buffer, so always allocate a byte
+                char *buf = malloc(size + 1);
+
+                if (read_full(fd, buf, size) == -1) {
+                    free(buf);
+                    fclose(output_fp);
+                    free(msg);
+                    return -1;
+                }
 
-            free_inode_map[inode_idx] = 1;
+                FILE *fp = fmemopen(buf, size + 1, "r");
 
-            return;
-        } 
+                pthread_rwlock_wrlock(&image_lock);
+                status = put_stream(token[1], fp, size);
+                pthread_rwlock_unlock(&image_lock);
 
-        inode_array_ptr[inode_idx]->blocks[inode_block_entry] = block_idx;
+                fclose(fp);
+
+                free(buf);
+            }
+        }
     }
+    else if (!strcmp(token[0], "get")) {
+        // "get <name> [offset length]" retrieves the whole file or a byte range of it
+        if (token[1] == NULL) {
+            fprintf(output_fp, "get error: File not found\n");
+            status = -1;
+        }
+        else {
+            uint64_t offset = token[2] ? strtoull(token[2], NULL, 10) : 0;
+            uint64_t length = token[2] && token[3] ? strtoull(token[3], NULL, 10) : UINT64_MAX;
 
-    // close file pointer
-    fclose(fp);
-}
+            // look the file up while the namespace can't change underneath us
+            pthread_rwlock_rdlock(&image_lock);
+            int64_t dir_idx = find_directory_entry(token[1]);
 
-/*
-    Name: get
-    Parameters: filename of file in image and filename of file getting written to
-    Return: void
-    Description: retrieve file from image and write it into a file in the curent working directory
-*/
-void get(char *image_filename, char *out_filename) {
-    // first, see if the image file actually exists
-    int dir_idx = -1;
-    for (int i = 0; i < MAX_FILE; i++) {
-        // if NULL name, skip loop iteration
-        if (directory_array_ptr[i].name == NULL) {
-            continue;
-        }
+            if (dir_idx == -1) {
+                pthread_rwlock_unlock(&image_lock);
+                fprintf(output_fp, "get error: File not found\n");
+                status = -1;
+            }
+            else {
+                // hold only the file's lock while copying, so writers to other files
+                // and readers of this one can proceed
+                int64_t inode_idx = directory_array_ptr[dir_idx].inode_idx;
+                pthread_rwlock_rdlock(inode_lock(inode_idx));
+                pthread_rwlock_unlock(&image_lock);
+
+                FILE *fp = open_memstream(&data, &data_len);
+                status = get_stream(inode_idx, fp, offset, length);
+                fclose(fp);
 
-        // check if directory entry name is equal to image filename
-        // must be a file that has not deleted in the image
-        if (directory_array_ptr[i].valid && !strcmp(directory_array_ptr[i].name, image_filename)) {
-            dir_idx = i;
-            break;
+                // a failed get replies with its message rather than the partial contents
+                if (status == -1) {
+                    free(data);
+                    data = NULL;
+                }
+
+                pthread_rwlock_unlock(inode_lock(inode_idx));
+            }
         }
     }
+    else if (!strcmp(token[0], "list")) {
+        // "list [-h] [path]", paths are taken from the root
+        int list_hidden = 0;
+        char *path = "/";
+        for (int i = 1; i < token_count; i++) {
+            if (!strcmp(token[i], "-h")) {
+                list_hidden = 1;
+            }
+            else {
+                path = token[i];
+            }
+        }
 
-    // if dir_idx is -1, the file cold not be found, so print error message
-    if (dir_idx == -1) {
-        printf("get error: File not found\n");
-        return;
+        pthread_rwlock_rdlock(&image_lock);
+        list(path, list_hidden);
+        pthread_rwlock_unlock(&image_lock);
     }
-
-    // if no output filename given, set it equal to the image filename
-    if (!out_filename) {
-        out_filename = image_filename;
+    else if (!strcmp(token[0], "mkdir") || !strcmp(token[0], "rmdir")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "%s error: Directory not found\n", token[0]);
+            status = -1;
+        }
+        else {
+            pthread_rwlock_wrlock(&image_lock);
+            status = !strcmp(token[0], "mkdir") ? make_directory(token[1]) : remove_directory(token[1]);
+            pthread_rwlock_unlock(&image_lock);
+        }
     }
-
-    // try opening output filename for writing
-    FILE *fp = fopen(out_filename, "w");
-    if (!fp) {
-        printf("get error: File not found\n");
-        return;
+    else if (!strcmp(token[0], "del")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "del error: File not found\n");
+            status = -1;
+        }
+        else {
+            pthread_rwlock_wrlock(&image_lock);
+            status = del(token[1]);
+            pthread_rwlock_unlock(&image_lock);
+        }
     }
-
-    // get inode index using directory index
-    int inode_idx = directory_array_ptr[dir_idx].inode_idx;
-
-    // Initialize our offsets and pointers just we did above when reading from the file.
-    int copy_size = inode_array_ptr[inode_idx]->size;
-    int offset = 0;
-
-    // Now that we have the inode of the file in the image, we can iterate through its block array
-    // and copy the blocks into the file
-    for (int i = 0; inode_array_ptr[inode_idx]->blocks[i] != -1; i++) {
-        int block_idx = inode_array_ptr[inode_idx]->blocks[i];
-
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, ..., the remainder
-        fseek(fp, offset, SEEK_SET);
-
-        // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-        // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-        // end up with garbage at the end of the file.
-        int num_bytes;
-        if (copy_size < BLOCK_SIZE) {
-            num_bytes = copy_size;
+    else if (!strcmp(token[0], "clone")) {
+        if (token[1] == NULL || token[2] == NULL) {
+            fprintf(output_fp, "clone error: Incorrect command usage\n");
+            status = -1;
+        }
+        else {
+            // exclusive, the new entry and the share counts both change
+            pthread_rwlock_wrlock(&image_lock);
+            status = clone_file(token[1], token[2]);
+            pthread_rwlock_unlock(&image_lock);
+        }
+    }
+    else if (!strcmp(token[0], "df")) {
+        pthread_rwlock_rdlock(&image_lock);
+        report_df();
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else if (!strcmp(token[0], "scrub")) {
+        // "scrub [threads] [MB/s]", shared since it only reads the image file, which
+        // savefs can't be writing meanwhile
+        int num_threads = token[1] ? atoi(token[1]) : 0;
+        uint64_t rate = token[1] && token[2] ? strtoull(token[2], NULL, 10) : DEFAULT_SCRUB_RATE;
+
+        pthread_rwlock_rdlock(&image_lock);
+        status = scrub(num_threads, rate);
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else if (!strcmp(token[0], "fsck")) {
+        // exclusive, a repair can change anything
+        pthread_rwlock_wrlock(&image_lock);
+        status = fsck(!(token[1] && !strcmp(token[1], "-n")));
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else if (!strcmp(token[0], "defrag") && token[1] && !strcmp(token[1], "auto")) {
+        // the background steps take the locks themselves
+        if (token[2] && !strcmp(token[2], "off")) {
+            defrag_auto(0);
+        }
+        else if (token[2] && strtoull(token[2], NULL, 10) > 0) {
+            defrag_auto(strtoull(token[2], NULL, 10));
+        }
+        else {
+            fprintf(output_fp, "defrag error: Incorrect command usage\n");
+            status = -1;
+        }
+    }
+    else if (!strcmp(token[0], "defrag")) {
+        // exclusive, and every inode stripe too since a get still reading blocks after it
+        // dropped the image lock would see them move under it
+        int report_only = token[1] && !strcmp(token[1], "-s");
+        uint64_t budget_ms = token[1] && !report_only ? strtoull(token[1], NULL, 10) : DEFRAG_STEP_MS;
+
+        pthread_rwlock_wrlock(&image_lock);
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_wrlock(&inode_locks[i]);
+        }
+        defrag(budget_ms, report_only);
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_unlock(&inode_locks[i]);
+        }
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else if (!strcmp(token[0], "resize") && token[1]) {
+        // exclusive with every inode stripe, like defrag, since the block arrays move too
+        pthread_rwlock_wrlock(&image_lock);
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_wrlock(&inode_locks[i]);
+        }
+        status = resize(strtoull(token[1], NULL, 10));
+        for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+            pthread_rwlock_unlock(&inode_locks[i]);
+        }
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else if (!strcmp(token[0], "trace")) {
+        // the ring buffer takes care of itself, no image lock needed
+        status = trace_command(token[1], token[2]);
+    }
+    else if (!strcmp(token[0], "stats")) {
+        // the counters are read as they are, the image is looked at under the shared lock
+        if (token[1] && !strcmp(token[1], "reset")) {
+            reset_stats();
+        }
+        else if (token[1] && !strcmp(token[1], "dump")) {
+            if (token[2] && !strcmp(token[2], "off")) {
+                stats_dump(NULL, 0);
+            }
+            else if (token[2] && token[3] && strtoull(token[3], NULL, 10) > 0) {
+                stats_dump(token[2], strtoull(token[3], NULL, 10));
+            }
+            else {
+                fprintf(output_fp, "stats error: Incorrect command usage\n");
+                status = -1;
+            }
         }
         else {
-            num_bytes = BLOCK_SIZE;
+            pthread_rwlock_rdlock(&image_lock);
+            report_stats(output_fp);
+            pthread_rwlock_unlock(&image_lock);
         }
+    }
+    else if (!strcmp(token[0], "savefs")) {
+        // exclusive so two savefs requests don't interleave writes to the image file
+        pthread_rwlock_wrlock(&image_lock);
+        status = savefs();
+        pthread_rwlock_unlock(&image_lock);
+    }
+    else {
+        fprintf(output_fp, "%s error: Unknown command\n", token[0]);
+        status = -1;
+    }
 
-        // Write num_bytes number of bytes from our data array into our output file.
-        fwrite(data_blocks[block_idx], num_bytes, 1, fp);
+    fclose(output_fp);
+    output_fp = NULL;
 
-        // Reduce the amount of bytes remaining to copy, increase the offset into the file
-        copy_size -= num_bytes;
-        offset += num_bytes;
+    // successful gets reply with the file contents, everything else with its messages
+    if (send_response(fd, status == 0 ? 0 : 1, data ? data : msg, data ? data_len : msg_len) == -1) {
+        retval = -1;
     }
 
-    // close file pointer
-    fclose(fp);
+    free(data);
+    free(msg);
+
+    return retval;
 }
 
 /*
-    Name: list
-    Parameters: a flag that indicates if the user wants to also list hidden files
-    Return: void
-    Description: looks through the directory array and prints valid entries
+    Name: server_worker
+    Parameters: pointer to the listening socket descriptor
+    Return: void pointer
+    Description: accepts clients on the shared listening socket and serves their requests
+    until they disconnect
 */
-void list(int list_hidden) {
-    // keep count of files listed
-    int count = 0;
+void *server_worker(void *arg) {
+    int server_fd = *(int *) arg;
 
-    // iterate through directory array for valid entries
-    for (int i = 0; i < MAX_FILE; i++) {
-        // only process valid entries
-        if (directory_array_ptr[i].valid) {
-            // if file is hidden and flag is not set, skip loop iteration
-            if (directory_array_ptr[i].h && !list_hidden) {
+    while (1) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
                 continue;
             }
+            perror("mfsd: accept");
+            break;
+        }
 
-            // get inode index of entry
-            int inode_idx = directory_array_ptr[i].inode_idx;
-
-            // get date and size of file from inode
-            time_t date = inode_array_ptr[inode_idx]->date;
-            int size = inode_array_ptr[inode_idx]->size;
-
-            // ctime returns a string with a newline so strip it
-            char *date_string = strdup(ctime(&date));
-            trim(date_string);
-
-            // print out list information
-            printf("%-8d %s %s\n", size, date_string, directory_array_ptr[i].name);
-
-            // because we allocated memory for date_string, deallocate it
-            free(date_string);
-
-            // increment count
-            count++;
+        // serve requests until the client hangs up or sends something malformed
+        char line[MAX_COMMAND_SIZE];
+        while (read_line(client_fd, line, MAX_COMMAND_SIZE) == 0) {
+            // timed here since the request line is taken apart as it's handled
+            int command = command_stat(line);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            int retval = handle_request(client_fd, line);
+            if (command != -1) {
+                record_stat(command, &start);
+            }
+            if (retval == -1) {
+                break;
+            }
         }
-    }
 
-    // if count is 0, no files were listed
-    if (count == 0) {
-        printf("list: No files found.\n");
+        close(client_fd);
     }
+
+    return NULL;
 }
 
 /*
-    Name: attrib
-    Parameters: flags that see which attribute to set and the filename of the file that the
-    user wants to set the attribute for
-    Return: void
-    Description: looks for the file in the directory entry and sets according attribute
+    Name: serve
+    Parameters: path of the unix socket, filename of the image and number of worker threads
+    Return: int
+    Description: loads the image (or creates an empty one) and serves it to clients over the
+    unix socket from a pool of worker threads, returns the process exit status
 */
-void attrib(int set_h, int set_r, char *filename) {
-    // first, look for file in directory array
-    int dir_idx = -1;
-    for (int i = 0; i < MAX_FILE; i++) {
-        // if entry is invalid, skip
-        if (!directory_array_ptr[i].valid) {
-            continue;
+int serve(char *socket_path, char *image, int num_threads) {
+    // load the image once (or start an empty one), every client then shares this copy
+    if (access(image, F_OK) == 0) {
+        if (open(image) == -1) {
+            return 1;
         }
+    }
+    else {
+        init(DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES);
+    }
+    opened_image = strdup(image);
 
-        // if filename matches, get its index
-        if (!strcmp(directory_array_ptr[i].name, filename)) {
-            dir_idx = i;
-            break;
-        }
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("mfsd: socket");
+        return 1;
     }
 
-    // if file not found, output error message
-    if (dir_idx == -1 ) {
-        printf("attrib error: File not found\n");
-        return;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mfsd: socket path too long\n");
+        return 1;
     }
+    strcpy(addr.sun_path, socket_path);
 
-    // if set_h flag is -1, user wants to set read-only instead
-    if (set_h == -1) {
-        directory_array_ptr[dir_idx].r = set_r;
+    // remove a stale socket left behind by a previous run
+    unlink(socket_path);
+
+    if (bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("mfsd: bind");
+        return 1;
     }
-    // if set_r flag is -1, user wants to set hidden instead
-    else if (set_r == -1) {
-        directory_array_ptr[dir_idx].h = set_h;
+
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("mfsd: listen");
+        return 1;
     }
-}
 
-/*
-    Name: del
-    Parameters: filename of file to delete
-    Return: void
-    Description: deletes the provided file from the file system image
-*/
-void del(char *filename) {
-    // first, look for file in directory array
-    int dir_idx = -1;
-    for (int i = 0; i < MAX_FILE; i++) {
-        // skip entry if invalid or read-only
-        if (!directory_array_ptr[i].valid || directory_array_ptr[i].r) {
-            continue;
-        }
+    // a client going away mid-response should not take the daemon down with it
+    signal(SIGPIPE, SIG_IGN);
 
-        // if filename matches, get its index
-        if (!strcmp(directory_array_ptr[i].name, filename)) {
-            dir_idx = i;
-            break;
-        }
+    // every worker blocks in accept on the same socket, the kernel hands each
+    // connection to exactly one of them
+    pthread_t workers[MAX_SERVER_THREADS];
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&workers[i], NULL, server_worker, &server_fd);
     }
 
-    // if file not found, output error message
-    if (dir_idx == -1 ) {
-        printf("attrib error: File not found\n");
-        return;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i], NULL);
     }
 
-    // get inode index of entry
-    int inode_idx = directory_array_ptr[dir_idx].inode_idx;
+    close(server_fd);
+    unlink(socket_path);
 
-    // clear directory entry
-    free(directory_array_ptr[dir_idx].name);
-    directory_array_ptr[dir_idx].name = NULL;
-    directory_array_ptr[dir_idx].valid = 0;
-    directory_array_ptr[dir_idx].inode_idx = -1;
-    directory_array_ptr[dir_idx].h = 0;
-    directory_array_ptr[dir_idx].r = 0;
+    return 0;
+}
 
-    // clear inode entry and set its value in inode map to not in use
-    inode_array_ptr[inode_idx]->date = 0;
-    inode_array_ptr[inode_idx]->size = 0;
-    inode_array_ptr[inode_idx]->valid = 0;
-    free_inode_map[inode_idx] = 0;
+// mfs_bench includes this file to drive the image functions directly, without the REPL
+#ifndef MFS_NO_MAIN
+int main(int argc, char *argv[])
+{
+    char cmd_str[MAX_COMMAND_SIZE] = {0};
 
-    // clear blocks array in inode entry and set corresponding blocks in free block map to not in use
-    for (int i = 0; inode_array_ptr[inode_idx]->blocks[i] != -1; i++) {
-        // grab block index (offset 130) for free block map
-        int block_idx = inode_array_ptr[inode_idx]->blocks[i] - 130;
+    // the command running and when it started, it holds the image lock until it's timed
+    // at the top of the loop
+    int command = -1;
+    int command_locked = 0;
+    struct timespec command_start;
 
-        // set block in free map block to not in use
-        free_block_map[block_idx] = 0;
+    // command output goes to the terminal unless a mfsd worker redirects it
+    output_fp = stdout;
 
-        // clear entry in blocks array of inode
-        inode_array_ptr[inode_idx]->blocks[i] = -1;
+    for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
     }
-}
 
-int main()
-{
-    char cmd_str[MAX_COMMAND_SIZE] = {0};
+    // pick the CRC32C block checksums are computed with
+    crc32c_init();
+
+    // daemon mode, either started as "mfsd <socket> <image> [threads]"
+    // or as "mfs -d <socket> <image> [threads]"
+    int daemon_arg = -1;
+    if (!strcmp(basename(argv[0]), "mfsd")) {
+        daemon_arg = 1;
+    }
+    else if (argc > 1 && !strcmp(argv[1], "-d")) {
+        daemon_arg = 2;
+    }
+
+    if (daemon_arg != -1) {
+        if (argc < daemon_arg + 2) {
+            fprintf(stderr, "usage: %s %s<socket> <image> [threads]\n", argv[0],
+                    daemon_arg == 2 ? "-d " : "");
+            return 1;
+        }
+
+        int num_threads = DEFAULT_SERVER_THREADS;
+        if (argc > daemon_arg + 2) {
+            num_threads = atoi(argv[daemon_arg + 2]);
+        }
+        if (num_threads < 1 || num_threads > MAX_SERVER_THREADS) {
+            fprintf(stderr, "mfsd: thread count must be between 1 and %d\n", MAX_SERVER_THREADS);
+            return 1;
+        }
+
+        return serve(argv[daemon_arg], argv[daemon_arg + 1], num_threads);
+    }
 
     while (1) {
+        // the last command is timed here, every path through the loop comes back to the top
+        if (command != -1) {
+            record_stat(command, &command_start);
+            command = -1;
+        }
+        if (command_locked) {
+            pthread_rwlock_unlock(&image_lock);
+            command_locked = 0;
+        }
+
         // Print out the mfs prompt
-        printf("mfs> ");
+        fprintf(output_fp, "mfs> ");
 
         // Read the command from the commandline.  The
         // maximum command that will be read is MAX_COMMAND_SIZE
@@ -892,9 +7141,24 @@ int main()
             token[token_count++] = strndup(arg_ptr, MAX_COMMAND_SIZE);
         }
 
+        // every command but record itself goes into a workload recording
+        if (record_fp && strcmp(token[0], "record")) {
+            record_command(cmd_str, token);
+        }
+
+        // commands hold the image lock so a periodic stats dump or background defrag step
+        // never sees one half done, except stats, which only reads, and defrag auto, which
+        // both may have to wait for one to finish
+        command = command_stat(token[0]);
+        if (strcmp(token[0], "stats") && !(!strcmp(token[0], "defrag") && token[1] && !strcmp(token[1], "auto"))) {
+            pthread_rwlock_wrlock(&image_lock);
+            command_locked = 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &command_start);
+
         /*
         for (int token_index = 0; token_index < token_count; token_index++ ) {
-            printf("token[%d] = %s\n", token_index, token[token_index] );  
+            fprintf(output_fp, "token[%d] = %s\n", token_index, token[token_index] );  
         }
         */
         
@@ -902,20 +7166,28 @@ int main()
 
         // if user enters createfs command
         if (!strcmp(token[0], "createfs")) {
-            // if no filename given
-            if (token[1] == NULL) {
-                // print error message, clean parsing variables, and skip loop
-                printf("createfs error: File not found\n");
+            // filename, optionally followed by block size, block count and inode count
+            uint64_t block_size;
+            uint64_t num_blocks;
+            uint64_t num_inodes;
+            if (createfs_geometry(token, &block_size, &num_blocks, &num_inodes) == -1) {
+                // clean parsing variables, and skip loop
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
-            // if filename given 
             else {
+                // initialize new file system image
+                int retval = init(block_size, num_blocks, num_inodes);
+                if (retval < 0) {
+                    fprintf(output_fp, "createfs error: %s\n",
+                            retval == -1 ? "Invalid geometry" : "Not enough memory");
+                    cleanup(token, MAX_NUM_ARGUMENTS, working_root);
+                    continue;
+                }
+
                 // free old file image name and replace with new one
                 free(opened_image);
                 opened_image = strdup(token[1]);
-                // initialize new file system image
-                init();
             }
         }
         // if user enters savefs command
@@ -923,23 +7195,13 @@ int main()
             // check if an image is currently not open
             if (!opened) {
                 // print error message, clean parsing variables, and skip loop
-                printf("savefs error: No file system image currently open\n");
+                fprintf(output_fp, "savefs error: No file system image currently open\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
-            // file image currently open
+            // file image currently open, save image into its file
             else {
-                // try opening file to write into
-                FILE *fp = fopen(opened_image, "wb");
-                if (!fp) {
-                    printf("savefs error: File not found\n");
-                    cleanup(token, MAX_NUM_ARGUMENTS, working_root);
-                    continue;
-                }
-
-                // save image into opened file
-                savefs(fp);
-                fclose(fp);
+                savefs();
             }
         }
         // if user enters open command
@@ -947,16 +7209,14 @@ int main()
             // if no filename given
             if (token[1] == NULL) {
                 // print error message, clean parsing variables, and skip loop
-                printf("open error: File not found\n");
+                fprintf(output_fp, "open error: File not found\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
             // if filename given
             else {
-                // try opening file to write from
-                FILE *fp = fopen(token[1], "rb");
-                if (!fp) {
-                    printf("open error: File not found\n");
+                // read the image, replaces the opened one only if it could be read
+                if (open(token[1]) == -1) {
                     cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                     continue;
                 }
@@ -964,11 +7224,6 @@ int main()
                 // free old file image name and replace with new one
                 free(opened_image);
                 opened_image = strdup(token[1]);
-                // initialize a new image to read data into
-                init();
-                // read data into new image
-                open(fp);
-                fclose(fp);
             }
         }
         // if user enters close command
@@ -988,6 +7243,15 @@ int main()
         }
         // if user enters quit command
         else if (!strcmp(token[0], "quit")) {
+            // release the attached image as well
+            if (attached_image.opened) {
+                swap_images();
+                free(opened_image);
+                opened_image = NULL;
+                close_image();
+                swap_images();
+            }
+
             // if no image opened, clean parsing variables and return from program
             if (!opened) {
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
@@ -1005,27 +7269,12 @@ int main()
                 break;
             }
         }
-        // if user enters df command
-        else if (!strcmp(token[0], "df")) {
-            // if no image currently opened
-            if (!opened) {
-                // print error message, clean parsing variables, and skip loop
-                printf("df error: No file system image currently open\n");
-                cleanup(token, MAX_NUM_ARGUMENTS, working_root);
-                continue;
-            }
-            // if image currently opened
-            else {
-                // print result of df
-                printf("%d bytes free.\n", df());
-            }
-        }
         // if user enters put command
         else if (!strcmp(token[0], "put")) {
             // if no image currently opened
             if (!opened) {
                 // print error message, clean parsing variables, and skip loop
-                printf("put error: No file system image currently open\n");
+                fprintf(output_fp, "put error: No file system image currently open\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
@@ -1033,19 +7282,13 @@ int main()
             // if no filename given
             if (token[1] == NULL) {
                 // print error message, clean parsing variables, and skip loop
-                printf("put error: File not found\n");
-                cleanup(token, MAX_NUM_ARGUMENTS, working_root);
-                continue;
-            }
-            // if filename given, but too long
-            else if (strlen(token[1]) > MAX_FILENAME) {
-                // print error message, clean parsing variables, and skip loop
-                printf("put error: File name too long\n");
+                fprintf(output_fp, "put error: File not found\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
+            // store under the given path, or the filename if none given
             else {
-                put(token[1]);
+                put(token[1], token[2]);
             }
         }
         // if user enters get command
@@ -1053,88 +7296,129 @@ int main()
             // if no image currently opened
             if (!opened) {
                 // print error message, clean parsing variables, and skip loop
-                printf("get error: No file system image currently open\n");
+                fprintf(output_fp, "get error: No file system image currently open\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
 
-            // if no filename given
-            if (token[1] == NULL) {
-                // print error message, clean parsing variables, and skip loop
-                printf("get error: File not found\n");
+            // try getting image file, or the byte range "<offset> <length>" of it
+            uint64_t offset;
+            uint64_t length;
+            if (get_range(token, &offset, &length) == -1) {
+                // clean parsing variables, and skip loop
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
-            // try getting image file
             else {
-                get(token[1], token[2]);
+                get(token[1], token[2], offset, length);
             }
         }
-        // if user enters list command
-        else if (!strcmp(token[0], "list")) {
+        // if user enters write command
+        else if (!strcmp(token[0], "write")) {
             // if no image currently opened
             if (!opened) {
                 // print error message, clean parsing variables, and skip loop
-                printf("list error: No file system image currently open\n");
+                fprintf(output_fp, "write error: No file system image currently open\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
 
-            // if user wants to also list hidden files
-            if (token[1] != NULL && !strcmp(token[1], "-h")) {
-                list(1);
+            // "write <host file> <image file> <offset>"
+            if (token[1] == NULL || token[2] == NULL || token[3] == NULL) {
+                // print error message, clean parsing variables, and skip loop
+                fprintf(output_fp, "write error: Incorrect command usage\n");
+                cleanup(token, MAX_NUM_ARGUMENTS, working_root);
+                continue;
             }
-            // else just list unhidden files
             else {
-                list(0);
+                write_file(token[1], token[2], strtoull(token[3], NULL, 10));
             }
         }
-        // if user enters attrib command
-        else if (!strcmp(token[0], "attrib")) {
-            // if no image currently opened
-            if (!opened) {
-                // print error message, clean parsing variables, and skip loop
-                printf("attrib error: No file system image currently open\n");
-                cleanup(token, MAX_NUM_ARGUMENTS, working_root);
-                continue;
+        // if user enters defrag auto command
+        else if (!strcmp(token[0], "defrag") && token[1] && !strcmp(token[1], "auto")) {
+            // "defrag auto <seconds>" takes a step in the background every so many seconds
+            // and "defrag auto off" stops that
+            if (token[2] && !strcmp(token[2], "off")) {
+                defrag_auto(0);
             }
-
-            // if no attribute/filename given, print error message, clean parsing variables, and skip loop
-            if (token[1] == NULL || token[2] == NULL) {
-                printf("attrib error: Incorrect command usage\n");
+            else if (token[2] && strtoull(token[2], NULL, 10) > 0) {
+                defrag_auto(strtoull(token[2], NULL, 10));
+            }
+            else {
+                fprintf(output_fp, "defrag error: Incorrect command usage\n");
+            }
+        }
+        // if user enters record command
+        else if (!strcmp(token[0], "record")) {
+            // "record <file>" records the commands that follow for mfs_replay, "record off" stops
+            if (token[1] == NULL) {
+                fprintf(output_fp, "record error: Incorrect command usage\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
 
-            // user wants to set file to hidden
-            if (!strcmp(token[1], "+h")) {
-                attrib(1, -1, token[2]);
-            }
-            // user wants to set file to unhidden
-            else if (!strcmp(token[1], "-h")) {
-                attrib(0, -1, token[2]);
-            }
-            // user wants to set file to read-only
-            else if (!strcmp(token[1], "+r")) {
-                attrib(-1, 1, token[2]);
+            record_workload(token[1]);
+        }
+        // if user enters trace command
+        else if (!strcmp(token[0], "trace")) {
+            trace_command(token[1], token[2]);
+        }
+        // if user enters stats command
+        else if (!strcmp(token[0], "stats")) {
+            // "stats reset" zeroes the stats, "stats dump <file> <seconds>" appends them to the
+            // file every so many seconds and "stats dump off" stops that
+            if (token[1] && !strcmp(token[1], "reset")) {
+                reset_stats();
             }
-            // user wants to set file to not read-only
-            else if (!strcmp(token[1], "-r")) {
-                attrib(-1, 0, token[2]);
+            else if (token[1] && !strcmp(token[1], "dump")) {
+                if (token[2] && !strcmp(token[2], "off")) {
+                    stats_dump(NULL, 0);
+                }
+                else if (token[2] && token[3] && strtoull(token[3], NULL, 10) > 0) {
+                    stats_dump(token[2], strtoull(token[3], NULL, 10));
+                }
+                else {
+                    fprintf(output_fp, "stats error: Incorrect command usage\n");
+                }
             }
-            // user enters invalid attribute argumemt
             else {
-                printf("attrib error: Incorrect command usage\n");
+                report_stats(output_fp);
+            }
+        }
+        // if user enters attach command
+        else if (!strcmp(token[0], "attach")) {
+            // if no filename given
+            if (token[1] == NULL) {
+                // print error message, clean parsing variables, and skip loop
+                fprintf(output_fp, "attach error: File not found\n");
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
+            else {
+                attach(token[1]);
+            }
+        }
+        // if user enters detach command
+        else if (!strcmp(token[0], "detach")) {
+            detach();
+        }
+        // if user enters switch command
+        else if (!strcmp(token[0], "switch")) {
+            // if no attached image, print error message
+            if (!attached_image.opened) {
+                fprintf(output_fp, "switch error: No image attached\n");
+            }
+            // make the attached image the opened one and vice versa
+            else {
+                swap_images();
+            }
         }
-        // if user enters del command
-        else if (!strcmp(token[0], "del")) {
+        // if user enters copy or move command
+        else if (!strcmp(token[0], "copy") || !strcmp(token[0], "move")) {
             // if no image currently opened
             if (!opened) {
                 // print error message, clean parsing variables, and skip loop
-                printf("del error: No file system image currently open\n");
+                fprintf(output_fp, "%s error: No file system image currently open\n", token[0]);
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
@@ -1142,19 +7426,31 @@ int main()
             // if no filename given
             if (token[1] == NULL) {
                 // print error message, clean parsing variables, and skip loop
-                printf("del error: File not found\n");
+                fprintf(output_fp, "%s error: File not found\n", token[0]);
                 cleanup(token, MAX_NUM_ARGUMENTS, working_root);
                 continue;
             }
-            // if filename given
+            // transfer file into the attached image, under a new name if given
             else {
-                del(token[1]);
+                transfer(token[1], token[2], !strcmp(token[0], "move"));
             }
         }
+        // the commands that only work on the opened image, shared with mfs_replay
+        else {
+            image_command(token);
+        }
 
         // clean parsing variables for next loop iteration
         cleanup(token, MAX_NUM_ARGUMENTS, working_root);
     }
 
+    // let a stats dump or defrag step in progress finish before exiting
+    if (command_locked) {
+        pthread_rwlock_unlock(&image_lock);
+    }
+    stats_dump(NULL, 0);
+    defrag_auto(0);
+
     return 0;
 }
+#endif
@@ -0,0 +1,497 @@
+#define MFS_NO_MAIN
+
+// the benchmark drives the image functions directly, so it is built with all of mfs
+#include "mfs.c"
+
+#include <getopt.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#define DEFAULT_BENCH_IMAGE "mfs_bench.img"
+#define DEFAULT_BENCH_INODES 4096   // Inodes of the benchmark image, enough to reach the fill level
+#define DEFAULT_FILL 80             // Percent of the data region the fill phase stores
+#define DEFAULT_CHURN_ROUNDS 4      // Rounds of deletes and refills that age the image
+#define DEFAULT_CHURN 25            // Percent of the files each churn round deletes
+#define DEFAULT_MIN_SIZE 1024       // Smallest file size the distributions draw
+#define DEFAULT_MAX_SIZE 262144     // Largest file size the distributions draw
+#define DEFAULT_REPEAT 5            // Times the list, df, savefs and open phases are repeated
+
+// operations the benchmark times, in the order they are reported
+enum bench_op { OP_PUT, OP_GET, OP_GET_COLD, OP_DEL, OP_LIST, OP_DF, OP_SAVEFS, OP_OPEN, NUM_OPS };
+const char *op_names[NUM_OPS] = { "put", "get", "get_cold", "del", "list", "df", "savefs", "open" };
+
+// latency samples and bytes moved by one operation
+struct op_stats {
+    uint64_t *samples;              // nanoseconds each call took
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t bytes;
+    uint64_t failures;
+};
+struct op_stats stats[NUM_OPS];
+
+// file sizes are drawn from one of these
+enum size_dist { DIST_FIXED, DIST_UNIFORM, DIST_LOG_UNIFORM };
+const char *dist_names[] = { "fixed", "uniform", "loguniform" };
+
+struct bench_config {
+    char *image;
+    char *output;
+    uint64_t block_size;
+    uint64_t num_blocks;
+    uint64_t num_inodes;
+    enum size_dist dist;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t fill;
+    uint64_t churn_rounds;
+    uint64_t churn;
+    uint64_t repeat;
+    uint64_t seed;
+    int compress;
+    int dedup;
+};
+
+// files stored so far, by the number in their name
+uint64_t *live_files;
+uint64_t num_live;
+uint64_t next_file;
+
+// xorshift state for file sizes, picks and contents
+uint64_t rng_state;
+
+/*
+    Name: rng
+    Parameters: None
+    Return: uint64_t
+    Description: next number of the xorshift64* generator, the runs repeat for a given seed
+*/
+uint64_t rng() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+    Name: record
+    Parameters: operation, nanoseconds the call took, bytes it moved and whether it failed
+    Return: void
+    Description: adds a latency sample to the operation's statistics
+*/
+void record(enum bench_op op, uint64_t ns, uint64_t bytes, int failed) {
+    struct op_stats *op_stats = &stats[op];
+
+    if (failed) {
+        op_stats->failures++;
+        return;
+    }
+
+    if (op_stats->count == op_stats->capacity) {
+        op_stats->capacity = op_stats->capacity ? op_stats->capacity * 2 : 1024;
+        op_stats->samples = realloc(op_stats->samples, op_stats->capacity * sizeof(uint64_t));
+    }
+    op_stats->samples[op_stats->count++] = ns;
+    op_stats->bytes += bytes;
+}
+
+/*
+    Name: draw_size
+    Parameters: pointer to the benchmark configuration
+    Return: uint64_t
+    Description: size of the next file, from the configured distribution
+*/
+uint64_t draw_size(struct bench_config *config) {
+    uint64_t span = config->max_size - config->min_size;
+
+    switch (config->dist) {
+    case DIST_FIXED:
+        return config->max_size;
+    case DIST_UNIFORM:
+        return config->min_size + (span ? rng() % (span + 1) : 0);
+    default: {
+        // as many small files as large ones per doubling of the size
+        double low = log((double) config->min_size);
+        double high = log((double) config->max_size);
+        double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+        return (uint64_t) exp(low + (high - low) * u);
+    }
+    }
+}
+
+/*
+    Name: used_percent
+    Parameters: None
+    Return: uint64_t
+    Description: percent of the data region in use
+*/
+uint64_t used_percent() {
+    uint64_t capacity = geometry.num_blocks * geometry.block_size;
+
+    return (capacity - df()) * 100 / capacity;
+}
+
+/*
+    Name: bench_put
+    Parameters: pointer to the benchmark configuration and a buffer of max_size bytes
+    Return: int
+    Description: stores a new file of a drawn size, returns 0 on success and -1 once the
+    image is full
+*/
+int bench_put(struct bench_config *config, char *buffer) {
+    uint64_t size = draw_size(config);
+    char name[32];
+    snprintf(name, sizeof(name), "f%" PRIu64, next_file);
+
+    // half random and half zero-run contents, so compression has something to do when on
+    for (uint64_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t word = (i / 4096) & 1 ? 0 : rng();
+        memcpy(buffer + i, &word, size - i < sizeof(uint64_t) ? size - i : sizeof(uint64_t));
+    }
+
+    FILE *fp = fmemopen(buffer, size ? size : 1, "rb");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = put_stream(name, fp, size) == -1;
+    record(OP_PUT, elapsed_ns(&start), size, failed);
+    fclose(fp);
+
+    if (failed) {
+        return -1;
+    }
+
+    live_files[num_live++] = next_file++;
+    return 0;
+}
+
+/*
+    Name: bench_del
+    Parameters: position of the file in the list of files stored
+    Return: void
+    Description: deletes the file, the last file stored takes its place in the list
+*/
+void bench_del(uint64_t i) {
+    char name[32];
+    snprintf(name, sizeof(name), "f%" PRIu64, live_files[i]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = del(name) == -1;
+    record(OP_DEL, elapsed_ns(&start), 0, failed);
+
+    live_files[i] = live_files[--num_live];
+}
+
+/*
+    Name: bench_get
+    Parameters: operation to record the reads under and a stream to write them to
+    Return: void
+    Description: reads every file stored
+*/
+void bench_get(enum bench_op op, FILE *sink) {
+    for (uint64_t i = 0; i < num_live; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%" PRIu64, live_files[i]);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int64_t inode_idx = resolve_inode(name);
+        int failed = inode_idx == -1 || get_stream(inode_idx, sink, 0, UINT64_MAX) == -1;
+        record(op, elapsed_ns(&start), failed ? 0 : inode_array_ptr[inode_idx]->size, failed);
+    }
+}
+
+/*
+    Name: fill
+    Parameters: pointer to the benchmark configuration and a buffer of max_size bytes
+    Return: void
+    Description: stores files until the data region is as full as configured
+*/
+void fill(struct bench_config *config, char *buffer) {
+    while (used_percent() < config->fill && num_live < geometry.num_inodes - 1) {
+        if (bench_put(config, buffer) == -1) {
+            break;
+        }
+    }
+}
+
+/*
+    Name: compare_samples
+    Parameters: two latency samples
+    Return: int
+    Description: orders samples for qsort
+*/
+int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Name: percentile
+    Parameters: sorted samples, their number and the percentile wanted
+    Return: double
+    Description: the sample at the percentile in microseconds, nearest rank
+*/
+double percentile(uint64_t *samples, uint64_t count, double p) {
+    uint64_t rank = (uint64_t) ceil(p / 100.0 * count);
+
+    return samples[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+/*
+    Name: free_runs
+    Parameters: pointer to the returned longest run
+    Return: uint64_t
+    Description: number of runs of free blocks, the fragmentation churn leaves behind
+*/
+uint64_t free_runs(uint64_t *longest) {
+    uint64_t runs = 0;
+    uint64_t run = 0;
+
+    *longest = 0;
+    for (uint64_t i = 0; i < geometry.num_blocks; i++) {
+        if (free_block_map[i]) {
+            run = 0;
+            continue;
+        }
+
+        if (run++ == 0) {
+            runs++;
+        }
+        if (run > *longest) {
+            *longest = run;
+        }
+    }
+
+    return runs;
+}
+
+/*
+    Name: report
+    Parameters: pointer to the benchmark configuration, stream to write to and total seconds
+    Return: void
+    Description: writes the configuration, the statistics of every operation, the state the
+    image was left in and the peak RSS as JSON
+*/
+void report(struct bench_config *config, FILE *fp, double seconds) {
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"config\": {\"block_size\": %" PRIu64 ", \"num_blocks\": %" PRIu64
+            ", \"num_inodes\": %" PRIu64 ", \"dist\": \"%s\", \"min_size\": %" PRIu64
+            ", \"max_size\": %" PRIu64 ", \"fill\": %" PRIu64 ", \"churn_rounds\": %" PRIu64
+            ", \"churn\": %" PRIu64 ", \"repeat\": %" PRIu64 ", \"seed\": %" PRIu64
+            ", \"compress\": %s, \"dedup\": %s},\n",
+            config->block_size, config->num_blocks, config->num_inodes, dist_names[config->dist],
+            config->min_size, config->max_size, config->fill, config->churn_rounds, config->churn,
+            config->repeat, config->seed, config->compress ? "true" : "false",
+            config->dedup ? "true" : "false");
+
+    fprintf(fp, "  \"ops\": {\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        struct op_stats *op_stats = &stats[op];
+        uint64_t total_ns = 0;
+        for (uint64_t i = 0; i < op_stats->count; i++) {
+            total_ns += op_stats->samples[i];
+        }
+        double total = total_ns / 1e9;
+
+        fprintf(fp, "    \"%s\": {\"count\": %" PRIu64 ", \"failures\": %" PRIu64 ", \"bytes\": %" PRIu64
+                ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f",
+                op_names[op], op_stats->count, op_stats->failures, op_stats->bytes, total,
+                total > 0 ? op_stats->count / total : 0.0, total > 0 ? op_stats->bytes / total / 1e6 : 0.0);
+
+        if (op_stats->count > 0) {
+            qsort(op_stats->samples, op_stats->count, sizeof(uint64_t), compare_samples);
+            fprintf(fp, ", \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+                    "\"max\": %.1f}",
+                    percentile(op_stats->samples, op_stats->count, 50),
+                    percentile(op_stats->samples, op_stats->count, 90),
+                    percentile(op_stats->samples, op_stats->count, 99),
+                    percentile(op_stats->samples, op_stats->count, 99.9),
+                    op_stats->samples[op_stats->count - 1] / 1000.0);
+        }
+        fprintf(fp, "}%s\n", op < NUM_OPS - 1 ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    uint64_t longest;
+    uint64_t runs = free_runs(&longest);
+    fprintf(fp, "  \"image\": {\"files\": %" PRIu64 ", \"used_percent\": %" PRIu64 ", \"free_bytes\": %" PRIu64
+            ", \"free_runs\": %" PRIu64 ", \"longest_free_run\": %" PRIu64 "},\n",
+            num_live, used_percent(), df(), runs, longest);
+
+    // ru_maxrss is in kilobytes on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss);
+    fprintf(fp, "  \"seconds\": %.3f\n", seconds);
+    fprintf(fp, "}\n");
+}
+
+/*
+    Name: bench_usage
+    Parameters: name the program was started as
+    Return: void
+    Description: prints the options
+*/
+void bench_usage(char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -i <image>        image file to create (default %s)\n", DEFAULT_BENCH_IMAGE);
+    fprintf(stderr, "  -o <file>         write the JSON report to a file instead of stdout\n");
+    fprintf(stderr, "  -b <bytes>        block size (default %d)\n", DEFAULT_BLOCK_SIZE);
+    fprintf(stderr, "  -n <blocks>       block count (default %d)\n", DEFAULT_NUM_BLOCKS);
+    fprintf(stderr, "  -N <inodes>       inode count (default %d)\n", DEFAULT_BENCH_INODES);
+    fprintf(stderr, "  -d <dist>         file sizes: fixed, uniform or loguniform (default loguniform)\n");
+    fprintf(stderr, "  -s <min>-<max>    file size range in bytes (default %d-%d)\n",
+            DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE);
+    fprintf(stderr, "  -f <percent>      fill level of the data region (default %d)\n", DEFAULT_FILL);
+    fprintf(stderr, "  -c <rounds>       put/del churn rounds that age the image (default %d)\n",
+            DEFAULT_CHURN_ROUNDS);
+    fprintf(stderr, "  -C <percent>      files deleted per churn round (default %d)\n", DEFAULT_CHURN);
+    fprintf(stderr, "  -r <count>        repetitions of list, df, savefs and open (default %d)\n",
+            DEFAULT_REPEAT);
+    fprintf(stderr, "  -S <seed>         random seed (default 1)\n");
+    fprintf(stderr, "  -z                store with compression on\n");
+    fprintf(stderr, "  -D                store with dedup on\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config config = {
+        DEFAULT_BENCH_IMAGE, NULL, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_BENCH_INODES,
+        DIST_LOG_UNIFORM, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE, DEFAULT_FILL, DEFAULT_CHURN_ROUNDS,
+        DEFAULT_CHURN, DEFAULT_REPEAT, 1, 0, 0
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:b:n:N:d:s:f:c:C:r:S:zDh")) != -1) {
+        switch (opt) {
+        case 'i': config.image = optarg; break;
+        case 'o': config.output = optarg; break;
+        case 'b': config.block_size = strtoull(optarg, NULL, 10); break;
+        case 'n': config.num_blocks = strtoull(optarg, NULL, 10); break;
+        case 'N': config.num_inodes = strtoull(optarg, NULL, 10); break;
+        case 'd':
+            for (config.dist = DIST_FIXED; config.dist <= DIST_LOG_UNIFORM; config.dist++) {
+                if (!strcmp(optarg, dist_names[config.dist])) {
+                    break;
+                }
+            }
+            if (config.dist > DIST_LOG_UNIFORM) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            if (sscanf(optarg, "%" SCNu64 "-%" SCNu64, &config.min_size, &config.max_size) != 2) {
+                config.min_size = config.max_size = strtoull(optarg, NULL, 10);
+            }
+            break;
+        case 'f': config.fill = strtoull(optarg, NULL, 10); break;
+        case 'c': config.churn_rounds = strtoull(optarg, NULL, 10); break;
+        case 'C': config.churn = strtoull(optarg, NULL, 10); break;
+        case 'r': config.repeat = strtoull(optarg, NULL, 10); break;
+        case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+        case 'z': config.compress = 1; break;
+        case 'D': config.dedup = 1; break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.min_size == 0 || config.min_size > config.max_size || config.fill > 100 ||
+        config.churn > 100) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    // same setup as mfs, with the messages of failed calls thrown away
+    FILE *sink = fopen("/dev/null", "w");
+    output_fp = sink;
+    for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    crc32c_init();
+    rng_state = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    int retval = init(config.block_size, config.num_blocks, config.num_inodes);
+    if (retval < 0) {
+        fprintf(stderr, "mfs_bench: %s\n", retval == -1 ? "Invalid geometry" : "Not enough memory");
+        return 1;
+    }
+    if (config.max_size > geometry.max_file_size) {
+        fprintf(stderr, "mfs_bench: Files can be at most %" PRIu64 " bytes\n", geometry.max_file_size);
+        return 1;
+    }
+    opened_image = strdup(config.image);
+    unlink(config.image);
+    set_feature(IMAGE_COMPRESS, config.compress);
+    set_feature(IMAGE_DEDUP, config.dedup);
+
+    struct timespec bench_start;
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+    char *buffer = malloc(config.max_size + sizeof(uint64_t));
+    live_files = malloc(geometry.num_inodes * sizeof(uint64_t));
+    struct timespec start;
+
+    // fill the image, then age it: delete a share of the files at random and fill again
+    fill(&config, buffer);
+    for (uint64_t round = 0; round < config.churn_rounds; round++) {
+        uint64_t num_deletes = num_live * config.churn / 100;
+        for (uint64_t i = 0; i < num_deletes && num_live > 0; i++) {
+            bench_del(rng() % num_live);
+        }
+        fill(&config, buffer);
+    }
+
+    // reads with every block in memory
+    bench_get(OP_GET, sink);
+
+    for (uint64_t i = 0; i < config.repeat; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        list(NULL, 1);
+        record(OP_LIST, elapsed_ns(&start), 0, 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        report_df();
+        record(OP_DF, elapsed_ns(&start), 0, 0);
+    }
+
+    // the first save writes every block, the ones after it only the metadata
+    for (uint64_t i = 0; i < config.repeat; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int failed = savefs() == -1;
+        record(OP_SAVEFS, elapsed_ns(&start), 0, failed);
+    }
+
+    // open reads the metadata only, the reads after it load the blocks from the file
+    for (uint64_t i = 0; i < config.repeat; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int failed = open(config.image) == -1;
+        record(OP_OPEN, elapsed_ns(&start), 0, failed);
+        if (failed) {
+            fprintf(stderr, "mfs_bench: Could not open the saved image\n");
+            return 1;
+        }
+    }
+    bench_get(OP_GET_COLD, sink);
+
+    FILE *out = config.output ? fopen(config.output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "mfs_bench: Could not write %s\n", config.output);
+        return 1;
+    }
+    report(&config, out, elapsed_ns(&bench_start) / 1e9);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    close_image();
+    free(opened_image);
+    free(buffer);
+    free(live_files);
+    fclose(sink);
+
+    return 0;
+}
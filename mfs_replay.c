@@ -0,0 +1,329 @@
+#define MFS_NO_MAIN
+
+// the replay runs the recorded commands against the image functions directly, so it is
+// built with all of mfs
+#include "mfs.c"
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#define DEFAULT_REPLAY_IMAGE "mfs_replay.img"
+
+// commands that failed, by command histogram, and commands the replay doesn't run
+uint64_t failures[NUM_COMMAND_STATS];
+uint64_t skipped;
+
+// xorshift state for the made up file contents
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/*
+    Name: make_data
+    Parameters: number of bytes
+    Return: stream to read the bytes from
+    Description: stands in for the host file a recorded put or write read, the contents are
+    random since the recording only has the size. The stream owns a copy of the data
+*/
+FILE *make_data(uint64_t size) {
+    char *data = malloc(size + sizeof(uint64_t));
+    for (uint64_t i = 0; i < size; i += sizeof(uint64_t)) {
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        uint64_t word = rng_state * 0x2545F4914F6CDD1DULL;
+        memcpy(data + i, &word, sizeof(uint64_t));
+    }
+
+    // fmemopen doesn't take a zero length buffer, reads still stop at size
+    FILE *fp = fmemopen(NULL, size ? size : 1, "w+b");
+    fwrite(data, 1, size, fp);
+    rewind(fp);
+    free(data);
+
+    return fp;
+}
+
+/*
+    Name: replay_command
+    Parameters: tokens of the recorded command, the host file size recorded with it, the
+    image file the replay works on and a stream to throw file contents into
+    Return: int
+    Description: runs the command the way the REPL would, with host files replaced by made
+    up data of the recorded size and every image file by the replay's own. Returns 0 on
+    success, -1 on failure and 1 for a command the replay skips
+*/
+int replay_command(char **token, int64_t size, char *image, FILE *sink) {
+    // commands about the shell rather than the image, and ones that need the attached image
+    if (!strcmp(token[0], "record") || !strcmp(token[0], "trace") || !strcmp(token[0], "stats") ||
+        !strcmp(token[0], "attach") || !strcmp(token[0], "detach") || !strcmp(token[0], "switch") ||
+        !strcmp(token[0], "copy") || !strcmp(token[0], "move") || !strcmp(token[0], "quit") ||
+        (!strcmp(token[0], "defrag") && token[1] && !strcmp(token[1], "auto"))) {
+        return 1;
+    }
+
+    if (!strcmp(token[0], "createfs")) {
+        uint64_t block_size;
+        uint64_t num_blocks;
+        uint64_t num_inodes;
+        if (createfs_geometry(token, &block_size, &num_blocks, &num_inodes) == -1) {
+            return -1;
+        }
+
+        unlink(image);
+        int retval = init(block_size, num_blocks, num_inodes);
+        if (retval < 0) {
+            fprintf(output_fp, "createfs error: %s\n", retval == -1 ? "Invalid geometry" : "Not enough memory");
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(token[0], "open")) {
+        if (token[1] == NULL) {
+            fprintf(output_fp, "open error: File not found\n");
+            return -1;
+        }
+        return open(image);
+    }
+    if (!strcmp(token[0], "close")) {
+        if (opened) {
+            close_image();
+        }
+        return 0;
+    }
+    if (!strcmp(token[0], "savefs")) {
+        return image_open("savefs") ? savefs() : -1;
+    }
+
+    // put, write and get as in the REPL, with made up data for the host file
+    if (!strcmp(token[0], "put")) {
+        if (!image_open("put")) {
+            return -1;
+        }
+        if (token[1] == NULL) {
+            fprintf(output_fp, "put error: File not found\n");
+            return -1;
+        }
+
+        FILE *fp = make_data(size);
+        int retval = put_stream(token[2] ? token[2] : token[1], fp, size);
+        fclose(fp);
+        return retval;
+    }
+    if (!strcmp(token[0], "write")) {
+        if (!image_open("write")) {
+            return -1;
+        }
+        if (token[1] == NULL || token[2] == NULL || token[3] == NULL) {
+            fprintf(output_fp, "write error: Incorrect command usage\n");
+            return -1;
+        }
+
+        FILE *fp = make_data(size);
+        int retval = write_stream(token[2], fp, strtoull(token[3], NULL, 10), size);
+        fclose(fp);
+        return retval;
+    }
+    if (!strcmp(token[0], "get")) {
+        uint64_t offset;
+        uint64_t length;
+        if (!image_open("get") || get_range(token, &offset, &length) == -1) {
+            return -1;
+        }
+
+        int64_t dir_idx = get_entry(token[1]);
+        if (dir_idx == -1) {
+            return -1;
+        }
+        return get_stream(directory_array_ptr[dir_idx].inode_idx, sink, offset, length);
+    }
+
+    // the rest are the REPL's own
+    return image_command(token);
+}
+
+/*
+    Name: report_histogram
+    Parameters: stream to write to, name, histogram, the failures to go with it and whether
+    it's the first entry of its object
+    Return: void
+    Description: writes one entry of the JSON report, latencies in microseconds
+*/
+void report_histogram(FILE *fp, const char *name, struct histogram *histogram, uint64_t failed, int first) {
+    fprintf(fp, "%s    \"%s\": {\"count\": %" PRIu64 ", \"failures\": %" PRIu64 ", \"mean_us\": %.1f, "
+            "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+            first ? "" : ",\n", name, histogram->count, failed,
+            histogram->count ? histogram->sum / 1e3 / histogram->count : 0.0,
+            histogram_percentile(histogram, 50) / 1e3, histogram_percentile(histogram, 90) / 1e3,
+            histogram_percentile(histogram, 99) / 1e3, histogram->max / 1e3);
+}
+
+/*
+    Name: replay_usage
+    Parameters: name the program was started as
+    Return: void
+    Description: prints the options
+*/
+void replay_usage(char *program) {
+    fprintf(stderr, "usage: %s [options] <recording>\n", program);
+    fprintf(stderr, "  -i <image>   start from a copy of this image instead of a fresh one\n");
+    fprintf(stderr, "  -w <image>   image file the replay works on (default %s)\n", DEFAULT_REPLAY_IMAGE);
+    fprintf(stderr, "  -p           keep the recorded pacing instead of running as fast as possible\n");
+    fprintf(stderr, "  -o <file>    write the JSON report to a file instead of stdout\n");
+    fprintf(stderr, "  -v           show the output of the commands on stderr\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *start_image = NULL;
+    char *image = DEFAULT_REPLAY_IMAGE;
+    char *output = NULL;
+    int paced = 0;
+    int verbose = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:w:po:vh")) != -1) {
+        switch (opt) {
+        case 'i': start_image = optarg; break;
+        case 'w': image = optarg; break;
+        case 'p': paced = 1; break;
+        case 'o': output = optarg; break;
+        case 'v': verbose = 1; break;
+        default:
+            replay_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        replay_usage(argv[0]);
+        return 1;
+    }
+
+    FILE *recording = fopen(argv[optind], "r");
+    char line[MAX_COMMAND_SIZE + 64];
+    if (!recording || !fgets(line, sizeof(line), recording) || strncmp(line, RECORD_HEADER, strlen(RECORD_HEADER))) {
+        fprintf(stderr, "mfs_replay: %s is not a workload recording\n", argv[optind]);
+        return 1;
+    }
+
+    // same setup as mfs
+    FILE *sink = fopen("/dev/null", "w");
+    output_fp = verbose ? stderr : sink;
+    for (int i = 0; i < NUM_INODE_LOCKS; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    crc32c_init();
+    opened_image = strdup(image);
+
+    // a copy of the starting image, so the replay never changes it
+    if (start_image) {
+        FILE *in = fopen(start_image, "rb");
+        FILE *out = fopen(image, "wb");
+        if (!in || !out) {
+            fprintf(stderr, "mfs_replay: Could not copy %s to %s\n", start_image, image);
+            return 1;
+        }
+
+        char buffer[65536];
+        size_t bytes;
+        while ((bytes = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+            fwrite(buffer, 1, bytes, out);
+        }
+        fclose(in);
+        fclose(out);
+
+        if (open(image) == -1) {
+            fprintf(stderr, "mfs_replay: Could not open %s\n", start_image);
+            return 1;
+        }
+    }
+    // otherwise a fresh image, unless the recording starts with a createfs of its own
+    else {
+        unlink(image);
+        init(DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES);
+    }
+
+    struct timespec replay_start;
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    uint64_t num_commands = 0;
+
+    while (fgets(line, sizeof(line), recording)) {
+        uint64_t at_us;
+        int64_t size;
+        int consumed;
+        if (sscanf(line, "%" SCNu64 " %" SCNd64 " %n", &at_us, &size, &consumed) != 2) {
+            continue;
+        }
+        char *command_line = line + consumed;
+        command_line[strcspn(command_line, "\n")] = 0;
+
+        char *token[MAX_NUM_ARGUMENTS] = {0};
+        int token_count = 0;
+        char *save_ptr;
+        for (char *arg = strtok_r(command_line, WHITESPACE, &save_ptr); arg && token_count < MAX_NUM_ARGUMENTS;
+             arg = strtok_r(NULL, WHITESPACE, &save_ptr)) {
+            token[token_count++] = arg;
+        }
+        if (token_count == 0) {
+            continue;
+        }
+
+        // wait for the time the command was typed at, relative to the start
+        uint64_t now_us = elapsed_ns(&replay_start) / 1000;
+        if (paced && at_us > now_us) {
+            usleep(at_us - now_us);
+        }
+
+        int command = command_stat(token[0]);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int retval = replay_command(token, size, image, sink);
+        if (retval == 1 || command == -1) {
+            skipped++;
+            continue;
+        }
+
+        record_stat(command, &start);
+        if (retval == -1) {
+            failures[command - NUM_PHASE_STATS]++;
+        }
+        num_commands++;
+    }
+    fclose(recording);
+
+    FILE *fp = output ? fopen(output, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "mfs_replay: Could not write %s\n", output);
+        return 1;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fp, "{\n  \"recording\": \"%s\",\n  \"paced\": %s,\n  \"replayed\": %" PRIu64 ",\n  \"skipped\": %" PRIu64
+            ",\n  \"seconds\": %.3f,\n  \"peak_rss_kb\": %ld,\n  \"commands\": {\n",
+            argv[optind], paced ? "true" : "false", num_commands, skipped, elapsed_ns(&replay_start) / 1e9,
+            usage.ru_maxrss);
+    int first = 1;
+    for (uint64_t i = 0; i < NUM_COMMAND_STATS; i++) {
+        if (histograms[NUM_PHASE_STATS + i].count > 0) {
+            report_histogram(fp, command_names[i], &histograms[NUM_PHASE_STATS + i], failures[i], first);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n  },\n  \"phases\": {\n");
+    first = 1;
+    for (uint64_t i = 0; i < NUM_PHASE_STATS; i++) {
+        if (histograms[i].count > 0) {
+            report_histogram(fp, phase_names[i], &histograms[i], 0, first);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n  }\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    if (opened) {
+        close_image();
+    }
+    fclose(sink);
+
+    return 0;
+}
@@ -0,0 +1,561 @@
+#define MFS_NO_MAIN
+
+// the sync tool reads image headers and hashes blocks the way mfs does, so it is built with
+// all of mfs
+#include "mfs.c"
+
+#include <getopt.h>
+
+#define SIGNATURE_MAGIC "MFSSIGN1"      // Identifies a signature file
+#define DELTA_MAGIC "MFSDELT1"          // Identifies a delta file
+#define SYNC_CHUNK 64                   // Blocks a fingerprint thread takes at a time
+#define MAX_SYNC_THREADS 16             // Upper bound on threads fingerprinting blocks
+#define END_OF_EXTENTS UINT64_MAX       // Start of the extent that ends a delta
+
+// starts a signature or a delta file. A signature holds the fingerprint of every block of
+// an image file, a delta the fingerprints of the new image followed by the runs of blocks
+// that differ from the image it applies to, as "<start> <count> <data>", the header block
+// last. The runs end with an extent starting at END_OF_EXTENTS
+struct sync_header {
+    char magic[8];
+    uint64_t block_size;            // bytes per block the image file was split into
+    uint64_t length;                // bytes in the image file, the new one for a delta
+    uint64_t num_blocks;            // fingerprints that follow the header
+    uint64_t base;                  // image_identity of the image the signature was taken of,
+                                    // which is the image the delta applies to
+};
+
+// fingerprints of the blocks of an image file, shared by the threads computing them
+struct sign_job {
+    int fd;                         // image file the blocks are read from
+    uint64_t block_size;
+    uint64_t num_blocks;
+    uint64_t next;                  // next chunk of blocks to hash, taken atomically
+    uint64_t *fingerprints;         // one per block
+};
+
+/*
+    Name: sync_usage
+    Parameters: name the program was started as
+    Return: void
+    Description: prints the options of the sync tool
+*/
+void sync_usage(char *program) {
+    fprintf(stderr, "usage: %s [-t threads] signature <image> <signature file>\n", program);
+    fprintf(stderr, "       %s [-t threads] delta <signature file | old image> <new image> <delta file>\n", program);
+    fprintf(stderr, "       %s apply [-s signature file] <image> <delta file>\n", program);
+    fprintf(stderr, "  -t <threads>  threads fingerprinting blocks (default one per core)\n");
+    fprintf(stderr, "  -s <file>     also write the signature of the updated image, for the next delta\n");
+}
+
+/*
+    Name: read_header
+    Parameters: descriptor of an image file and the geometry to read into
+    Return: int
+    Description: reads and checks the header of an image file, returns 0 on success and -1 if
+    the file isn't an image of this version
+*/
+int read_header(int fd, struct fs_geometry *header) {
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t) sizeof(*header) ||
+        memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Name: image_identity
+    Parameters: descriptor of an image file and its header
+    Return: uint64_t
+    Description: fingerprint of the header and the checksum region. The checksums cover every
+    data block and every metadata region, so two images with the same identity hold the same
+    data, and checking it reads a few blocks instead of the whole file
+*/
+uint64_t image_identity(int fd, struct fs_geometry *header) {
+    uint64_t length = header->checksum_blocks * header->block_size;
+    char *buffer = calloc(length + sizeof(*header), 1);
+
+    memcpy(buffer, header, sizeof(*header));
+    if (pread(fd, buffer + sizeof(*header), length, header->checksum_start * header->block_size) == -1) {
+        perror("mfs_sync: pread");
+    }
+    uint64_t identity = fingerprint(buffer, length + sizeof(*header));
+    free(buffer);
+
+    return identity;
+}
+
+/*
+    Name: sign_worker
+    Parameters: pointer to the sign job
+    Return: void pointer
+    Description: hashes chunks of blocks of the image file until none are left, blocks past
+    the end of the file hash as zeros
+*/
+void *sign_worker(void *arg) {
+    struct sign_job *job = arg;
+    char *buffer = malloc(job->block_size);
+
+    uint64_t first;
+    while ((first = __atomic_fetch_add(&job->next, SYNC_CHUNK, __ATOMIC_RELAXED)) < job->num_blocks) {
+        uint64_t last = first + SYNC_CHUNK < job->num_blocks ? first + SYNC_CHUNK : job->num_blocks;
+
+        for (uint64_t i = first; i < last; i++) {
+            memset(buffer, 0, job->block_size);
+            if (pread(job->fd, buffer, job->block_size, i * job->block_size) == -1) {
+                perror("mfs_sync: pread");
+            }
+            job->fingerprints[i] = fingerprint(buffer, job->block_size);
+        }
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+/*
+    Name: sign_image
+    Parameters: descriptor of an image file, the block size to split it into, the number of
+    threads to hash with and a header to fill in for the signature
+    Return: pointer to an array of fingerprints
+    Description: fingerprints every block of the image file, the threads take chunks of
+    blocks in turn so they all keep reading until the end of the file
+*/
+uint64_t *sign_image(int fd, uint64_t block_size, int num_threads, struct sync_header *header) {
+    struct stat buf;
+    fstat(fd, &buf);
+
+    struct fs_geometry geometry_header;
+    read_header(fd, &geometry_header);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SIGNATURE_MAGIC, sizeof(header->magic));
+    header->block_size = block_size;
+    header->length = buf.st_size;
+    header->num_blocks = (buf.st_size + block_size - 1) / block_size;
+    header->base = image_identity(fd, &geometry_header);
+
+    struct sign_job job = { fd, block_size, header->num_blocks, 0, malloc(header->num_blocks * sizeof(uint64_t)) };
+
+    // the calling thread hashes along with the others
+    pthread_t threads[MAX_SYNC_THREADS];
+    for (int t = 1; t < num_threads; t++) {
+        pthread_create(&threads[t], NULL, sign_worker, &job);
+    }
+    sign_worker(&job);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    return job.fingerprints;
+}
+
+/*
+    Name: write_signature
+    Parameters: path of the signature file, its header and the fingerprints
+    Return: int
+    Description: writes a signature file, returns 0 on success and -1 on failure
+*/
+int write_signature(char *path, struct sync_header *header, uint64_t *fingerprints) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "mfs_sync: Could not write %s\n", path);
+        return -1;
+    }
+
+    fwrite(header, sizeof(*header), 1, fp);
+    fwrite(fingerprints, sizeof(uint64_t), header->num_blocks, fp);
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "mfs_sync: Could not write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Name: load_signature
+    Parameters: path of a signature file or an image, the block size of the new image, the
+    number of threads and a header to fill in
+    Return: pointer to an array of fingerprints
+    Description: reads a signature file, or takes the signature of an image on the spot.
+    Returns NULL if the file is neither
+*/
+uint64_t *load_signature(char *path, uint64_t block_size, int num_threads, struct sync_header *header) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "mfs_sync: Could not open %s\n", path);
+        return NULL;
+    }
+
+    struct fs_geometry geometry_header;
+    if (read_header(fileno(fp), &geometry_header) == 0) {
+        uint64_t *fingerprints = sign_image(fileno(fp), block_size, num_threads, header);
+        fclose(fp);
+        return fingerprints;
+    }
+
+    uint64_t *fingerprints = NULL;
+    if (fread(header, sizeof(*header), 1, fp) == 1 &&
+        memcmp(header->magic, SIGNATURE_MAGIC, sizeof(header->magic)) == 0) {
+        fingerprints = malloc(header->num_blocks * sizeof(uint64_t) + 1);
+        if (fread(fingerprints, sizeof(uint64_t), header->num_blocks, fp) != header->num_blocks) {
+            free(fingerprints);
+            fingerprints = NULL;
+        }
+    }
+    fclose(fp);
+
+    if (!fingerprints) {
+        fprintf(stderr, "mfs_sync: %s is not a signature or an image\n", path);
+    }
+
+    return fingerprints;
+}
+
+/*
+    Name: write_extent
+    Parameters: delta file, descriptor of the new image, its length, the block size and the
+    first block and number of blocks of the run
+    Return: uint64_t
+    Description: copies a run of blocks of the new image into the delta, the last block of
+    the file only as far as the file goes. Returns the number of data bytes written
+*/
+uint64_t write_extent(FILE *fp, int fd, uint64_t length, uint64_t block_size, uint64_t start, uint64_t count) {
+    uint64_t bytes = count * block_size;
+    if (start * block_size + bytes > length) {
+        bytes = length - start * block_size;
+    }
+
+    char *buffer = malloc(bytes + 1);
+    if (pread(fd, buffer, bytes, start * block_size) != (ssize_t) bytes) {
+        perror("mfs_sync: pread");
+    }
+    fwrite(&start, sizeof(uint64_t), 1, fp);
+    fwrite(&count, sizeof(uint64_t), 1, fp);
+    fwrite(buffer, 1, bytes, fp);
+    free(buffer);
+
+    return bytes;
+}
+
+/*
+    Name: make_delta
+    Parameters: signature file or image the delta applies to, the new image, path of the
+    delta file and the number of threads
+    Return: int
+    Description: fingerprints the new image and writes the runs of blocks whose fingerprint
+    differs from the signature into the delta, the header block last so an image the delta
+    is being applied to never has a header describing regions not written yet. Metadata
+    regions are blocks of the image file like any other, only the ones that changed go in.
+    Returns 0 on success and -1 on failure
+*/
+int make_delta(char *old_path, char *new_path, char *delta_path, int num_threads) {
+    FILE *image_fp = fopen(new_path, "rb");
+    struct fs_geometry new_header;
+    if (!image_fp || read_header(fileno(image_fp), &new_header) == -1) {
+        fprintf(stderr, "mfs_sync: %s is not a file system image\n", new_path);
+        if (image_fp) {
+            fclose(image_fp);
+        }
+        return -1;
+    }
+    int fd = fileno(image_fp);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct sync_header old_sig;
+    uint64_t *old_fingerprints = load_signature(old_path, new_header.block_size, num_threads, &old_sig);
+    if (!old_fingerprints) {
+        fclose(image_fp);
+        return -1;
+    }
+
+    struct sync_header delta;
+    uint64_t *fingerprints = sign_image(fd, new_header.block_size, num_threads, &delta);
+    memcpy(delta.magic, DELTA_MAGIC, sizeof(delta.magic));
+    delta.base = old_sig.base;
+    uint64_t hashed_ns = elapsed_ns(&start);
+
+    FILE *fp = fopen(delta_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "mfs_sync: Could not write %s\n", delta_path);
+        free(old_fingerprints);
+        free(fingerprints);
+        fclose(image_fp);
+        return -1;
+    }
+    fwrite(&delta, sizeof(delta), 1, fp);
+    fwrite(fingerprints, sizeof(uint64_t), delta.num_blocks, fp);
+
+    // fingerprints taken at another block size can't be compared, every block is sent then
+    int comparable = old_sig.block_size == delta.block_size;
+    uint64_t changed = 0;
+    uint64_t bytes = 0;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    for (uint64_t i = 1; i <= delta.num_blocks; i++) {
+        int differs = i < delta.num_blocks &&
+                      (!comparable || i >= old_sig.num_blocks || fingerprints[i] != old_fingerprints[i]);
+        if (differs) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length++;
+            changed++;
+            continue;
+        }
+
+        if (run_length > 0) {
+            bytes += write_extent(fp, fd, delta.length, delta.block_size, run_start, run_length);
+            run_length = 0;
+        }
+    }
+    if (!comparable || old_sig.num_blocks == 0 || fingerprints[0] != old_fingerprints[0]) {
+        bytes += write_extent(fp, fd, delta.length, delta.block_size, 0, 1);
+        changed++;
+    }
+
+    uint64_t end = END_OF_EXTENTS;
+    fwrite(&end, sizeof(uint64_t), 1, fp);
+    fwrite(&end, sizeof(uint64_t), 1, fp);
+    off_t delta_size = ftello(fp);
+    fclose(image_fp);
+    free(old_fingerprints);
+    free(fingerprints);
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "mfs_sync: Could not write %s\n", delta_path);
+        return -1;
+    }
+
+    printf("delta: %" PRIu64 " of %" PRIu64 " blocks differ, %" PRIu64 " bytes of data in a delta of %lld bytes "
+           "(%.2f%% of the image), fingerprinted with %d threads in %.1f ms\n",
+           changed, delta.num_blocks, bytes, (long long) delta_size,
+           delta.length ? 100.0 * delta_size / delta.length : 0.0, num_threads, hashed_ns / 1e6);
+
+    return 0;
+}
+
+/*
+    Name: extent_block_bytes
+    Parameters: header of the delta and number of a block in the image it updates
+    Return: uint64_t
+    Description: returns the number of bytes the delta holds for the block, only the last
+    block of the image can be short
+*/
+uint64_t extent_block_bytes(struct sync_header *delta, uint64_t block) {
+    uint64_t offset = block * delta->block_size;
+    return delta->length - offset < delta->block_size ? delta->length - offset : delta->block_size;
+}
+
+/*
+    Name: check_extents
+    Parameters: delta file positioned at its first extent and header of the delta
+    Return: int
+    Description: walks the extents of the delta without writing anything, checking every
+    extent lies inside the image, its data is all there and the delta ends with its
+    terminator. The file is put back at the first extent. Returns 0 if the delta is whole
+    and -1 if it is cut short or corrupt
+*/
+int check_extents(FILE *fp, struct sync_header *delta) {
+    off_t start = ftello(fp);
+    if (start == -1 || delta->block_size == 0) {
+        return -1;
+    }
+    uint64_t image_blocks = delta->length / delta->block_size + (delta->length % delta->block_size != 0);
+
+    uint64_t extent[2];
+    int retval = -1;
+    while (fread(extent, sizeof(uint64_t), 2, fp) == 2) {
+        if (extent[0] == END_OF_EXTENTS) {
+            retval = 0;
+            break;
+        }
+        if (extent[0] >= image_blocks || extent[1] == 0 || extent[1] > image_blocks - extent[0]) {
+            break;
+        }
+
+        // every block is full but the last one of the image, which can only be in the last extent
+        uint64_t last = extent[0] + extent[1] - 1;
+        uint64_t bytes = (extent[1] - 1) * delta->block_size + extent_block_bytes(delta, last);
+        if (bytes > INT64_MAX || fseeko(fp, (off_t) bytes, SEEK_CUR) == -1) {
+            break;
+        }
+    }
+
+    // fseeko can go past the end of the file, so the data is only known to be there if the
+    // terminator after it was read in full
+    if (fseeko(fp, start, SEEK_SET) == -1) {
+        return -1;
+    }
+    return retval;
+}
+
+/*
+    Name: apply_delta
+    Parameters: image to update, path of the delta file and path to write the signature of
+    the updated image to (NULL for none)
+    Return: int
+    Description: writes the blocks in the delta into the image in place and sets its length,
+    after checking the delta was made against this very image and is whole, so a cut short
+    or corrupt delta leaves the image untouched. The new signature comes from the delta, so
+    keeping it costs no reads of the image. Returns 0 on success and -1 on failure
+*/
+int apply_delta(char *image_path, char *delta_path, char *signature_path) {
+    FILE *fp = fopen(delta_path, "rb");
+    struct sync_header delta;
+    if (!fp || fread(&delta, sizeof(delta), 1, fp) != 1 ||
+        memcmp(delta.magic, DELTA_MAGIC, sizeof(delta.magic)) != 0) {
+        fprintf(stderr, "mfs_sync: %s is not a delta\n", delta_path);
+        if (fp) {
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    FILE *image_fp = fopen(image_path, "r+b");
+    struct fs_geometry header;
+    if (!image_fp || read_header(fileno(image_fp), &header) == -1) {
+        fprintf(stderr, "mfs_sync: %s is not a file system image\n", image_path);
+        if (image_fp) {
+            fclose(image_fp);
+        }
+        fclose(fp);
+        return -1;
+    }
+    int fd = fileno(image_fp);
+    if (image_identity(fd, &header) != delta.base) {
+        fprintf(stderr, "mfs_sync: %s is not the image the delta was made against\n", image_path);
+        fclose(image_fp);
+        fclose(fp);
+        return -1;
+    }
+
+    uint64_t *fingerprints = malloc(delta.num_blocks * sizeof(uint64_t) + 1);
+    char *buffer = malloc(delta.block_size ? delta.block_size : 1);
+    if (!fingerprints || !buffer) {
+        fprintf(stderr, "mfs_sync: Not enough memory to apply %s\n", delta_path);
+        free(fingerprints);
+        free(buffer);
+        fclose(image_fp);
+        fclose(fp);
+        return -1;
+    }
+    if (fread(fingerprints, sizeof(uint64_t), delta.num_blocks, fp) != delta.num_blocks ||
+        check_extents(fp, &delta) == -1) {
+        fprintf(stderr, "mfs_sync: %s is cut short or corrupt, the image is unchanged\n", delta_path);
+        free(fingerprints);
+        free(buffer);
+        fclose(image_fp);
+        fclose(fp);
+        return -1;
+    }
+
+    // the length is set first, the header block comes last in the delta
+    int retval = ftruncate(fd, delta.length);
+    uint64_t applied = 0;
+    uint64_t extent[2] = {0, 0};
+    while (retval == 0) {
+        if (fread(extent, sizeof(uint64_t), 2, fp) != 2) {
+            retval = -1;
+            break;
+        }
+        if (extent[0] == END_OF_EXTENTS) {
+            break;
+        }
+        for (uint64_t i = extent[0]; i < extent[0] + extent[1] && retval == 0; i++) {
+            uint64_t offset = i * delta.block_size;
+            uint64_t bytes = extent_block_bytes(&delta, i);
+            if (fread(buffer, 1, bytes, fp) != bytes ||
+                pwrite(fd, buffer, bytes, offset) != (ssize_t) bytes) {
+                retval = -1;
+                break;
+            }
+            applied++;
+        }
+    }
+    if (retval == 0) {
+        retval = fsync(fd);
+    }
+    free(buffer);
+    fclose(fp);
+
+    if (retval == -1) {
+        fprintf(stderr, "mfs_sync: Could not apply %s, the image is left part way updated\n", delta_path);
+        free(fingerprints);
+        fclose(image_fp);
+        return -1;
+    }
+
+    // the updated image is signed by the fingerprints in the delta and its new identity
+    if (signature_path) {
+        memcpy(delta.magic, SIGNATURE_MAGIC, sizeof(delta.magic));
+        read_header(fd, &header);
+        delta.base = image_identity(fd, &header);
+        retval = write_signature(signature_path, &delta, fingerprints);
+    }
+    free(fingerprints);
+    fclose(image_fp);
+
+    printf("apply: %" PRIu64 " blocks written, image is %" PRIu64 " bytes\n", applied, delta.length);
+
+    return retval;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 0;
+    char *signature_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:h")) != -1) {
+        switch (opt) {
+        case 't': num_threads = atoi(optarg); break;
+        case 's': signature_path = optarg; break;
+        default:
+            sync_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cores < 1 ? 1 : cores;
+    }
+    if (num_threads > MAX_SYNC_THREADS) {
+        num_threads = MAX_SYNC_THREADS;
+    }
+
+    char **args = argv + optind;
+    int num_args = argc - optind;
+    if (num_args == 3 && !strcmp(args[0], "signature")) {
+        FILE *fp = fopen(args[1], "rb");
+        struct fs_geometry header;
+        if (!fp || read_header(fileno(fp), &header) == -1) {
+            fprintf(stderr, "mfs_sync: %s is not a file system image\n", args[1]);
+            if (fp) {
+                fclose(fp);
+            }
+            return 1;
+        }
+
+        struct sync_header signature;
+        uint64_t *fingerprints = sign_image(fileno(fp), header.block_size, num_threads, &signature);
+        fclose(fp);
+        int retval = write_signature(args[2], &signature, fingerprints);
+        free(fingerprints);
+        return retval == 0 ? 0 : 1;
+    }
+    if (num_args == 4 && !strcmp(args[0], "delta")) {
+        return make_delta(args[1], args[2], args[3], num_threads) == 0 ? 0 : 1;
+    }
+    if (num_args == 3 && !strcmp(args[0], "apply")) {
+        return apply_delta(args[1], args[2], signature_path) == 0 ? 0 : 1;
+    }
+
+    sync_usage(argv[0]);
+    return 1;
+}
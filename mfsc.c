@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_COMMAND_SIZE 255        // The maximum request line size mfsd accepts
+
+/*
+    Name: usage
+    Parameters: name the program was started as
+    Return: void
+    Description: prints the supported commands
+*/
+void usage(char *program) {
+    fprintf(stderr, "usage: %s <socket> put <host file> [image file]\n", program);
+    fprintf(stderr, "       %s <socket> get <image file> [host file] [offset length]\n", program);
+    fprintf(stderr, "       %s <socket> list [-h] [directory]\n", program);
+    fprintf(stderr, "       %s <socket> del <image file>\n", program);
+    fprintf(stderr, "       %s <socket> clone <image file> <new image file>\n", program);
+    fprintf(stderr, "       %s <socket> mkdir <directory>\n", program);
+    fprintf(stderr, "       %s <socket> rmdir <directory>\n", program);
+    fprintf(stderr, "       %s <socket> df\n", program);
+    fprintf(stderr, "       %s <socket> savefs\n", program);
+    fprintf(stderr, "       %s <socket> scrub [threads] [MB/s]\n", program);
+    fprintf(stderr, "       %s <socket> fsck [-n]\n", program);
+    fprintf(stderr, "       %s <socket> defrag [-s | ms | auto <seconds> | auto off]\n", program);
+    fprintf(stderr, "       %s <socket> resize <blocks>    (rewrites all metadata, O(metadata))\n", program);
+    fprintf(stderr, "       %s <socket> stats [reset | dump <file> <seconds> | dump off]\n", program);
+    fprintf(stderr, "       %s <socket> trace on | off | export <file>\n", program);
+}
+
+/*
+    Name: read_full
+    Parameters: socket descriptor, buffer to read into and number of bytes to read
+    Return: int
+    Description: reads exactly len bytes from the socket, returns 0 on success and -1 on failure
+*/
+int read_full(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t bytes = read(fd, ptr, len);
+
+        // retry if interrupted by a signal, give up on EOF or any other error
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/*
+    Name: write_full
+    Parameters: socket descriptor, buffer to write from and number of bytes to write
+    Return: int
+    Description: writes exactly len bytes to the socket, returns 0 on success and -1 on failure
+*/
+int write_full(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t bytes = write(fd, ptr, len);
+
+        // retry if interrupted by a signal, give up on any other error
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/*
+    Name: connect_server
+    Parameters: path of the unix socket mfsd listens on
+    Return: int
+    Description: connects to mfsd, returns the socket descriptor or -1 on failure
+*/
+int connect_server(char *socket_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("mfsc: socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mfsc: socket path too long\n");
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("mfsc: connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+    Name: read_response
+    Parameters: socket descriptor, pointer to the returned body and pointer to its length
+    Return: int
+    Description: reads a "<status> <length>" header and the body that follows, returns the
+    status (0 on success, 1 on a failed command) or -1 if the connection broke
+*/
+int read_response(int fd, char **body, size_t *len) {
+    // read the header line one byte at a time
+    char header[64];
+    int i = 0;
+    while (i < (int) sizeof(header) - 1) {
+        if (read_full(fd, &header[i], 1) == -1) {
+            return -1;
+        }
+        if (header[i] == '\n') {
+            break;
+        }
+        i++;
+    }
+    header[i] = 0;
+
+    int status;
+    if (sscanf(header, "%d %zu", &status, len) != 2) {
+        return -1;
+    }
+
+    *body = malloc(*len + 1);
+    if (read_full(fd, *body, *len) == -1) {
+        free(*body);
+        *body = NULL;
+        return -1;
+    }
+
+    return status;
+}
+
+/*
+    Name: send_put
+    Parameters: socket descriptor, host file to send and name to store it under
+    Return: int
+    Description: sends a put request followed by the contents of the host file, returns 0 on
+    success and -1 on failure
+*/
+int send_put(int fd, char *host_filename, char *image_filename) {
+    // create stat struct and try reading file into it
+    struct stat buf;
+    if (stat(host_filename, &buf) == -1) {
+        printf("put error: File not found\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(host_filename, "rb");
+    if (!fp) {
+        printf("put error: File not found\n");
+        return -1;
+    }
+
+    char line[MAX_COMMAND_SIZE];
+    int line_len = snprintf(line, sizeof(line), "put %s %lld\n", image_filename,
+                            (long long) buf.st_size);
+    if (line_len >= (int) sizeof(line) || write_full(fd, line, line_len) == -1) {
+        fclose(fp);
+        return -1;
+    }
+
+    // stream the file contents in chunks after the request line
+    char chunk[8192];
+    size_t bytes;
+    while ((bytes = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (write_full(fd, chunk, bytes) == -1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char *command = argv[2];
+    char line[MAX_COMMAND_SIZE];
+    char *out_filename = NULL;
+
+    int fd = connect_server(argv[1]);
+    if (fd == -1) {
+        return 1;
+    }
+
+    // send the request
+    int sent = 0;
+    if (!strcmp(command, "put") && argc > 3) {
+        // store under the host filename unless another name was given
+        char *image_filename = argc > 4 ? argv[4] : argv[3];
+        sent = send_put(fd, argv[3], image_filename);
+    }
+    else if ((!strcmp(command, "get") || !strcmp(command, "del") ||
+              !strcmp(command, "mkdir") || !strcmp(command, "rmdir")) && argc > 3) {
+        // files are written out under their name, without the directories leading to it
+        if (!strcmp(command, "get")) {
+            out_filename = argc > 4 ? argv[4] : basename(argv[3]);
+        }
+        int line_len = snprintf(line, sizeof(line), "%s %s\n", command, argv[3]);
+
+        // a get can ask for a byte range of the file only
+        if (!strcmp(command, "get") && argc > 6) {
+            line_len = snprintf(line, sizeof(line), "get %s %s %s\n", argv[3], argv[5], argv[6]);
+        }
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "clone") && argc > 4) {
+        int line_len = snprintf(line, sizeof(line), "clone %s %s\n", argv[3], argv[4]);
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "resize") && argc > 3) {
+        int line_len = snprintf(line, sizeof(line), "resize %s\n", argv[3]);
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "list")) {
+        int line_len = snprintf(line, sizeof(line), "list %s %s\n", argc > 3 ? argv[3] : "",
+                                argc > 4 ? argv[4] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "trace") && argc > 3) {
+        int line_len = snprintf(line, sizeof(line), "trace %s %s\n", argv[3], argc > 4 ? argv[4] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "stats")) {
+        int line_len = snprintf(line, sizeof(line), "stats %s %s %s\n", argc > 3 ? argv[3] : "",
+                                argc > 4 ? argv[4] : "", argc > 5 ? argv[5] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "fsck")) {
+        int line_len = snprintf(line, sizeof(line), "fsck %s\n", argc > 3 ? argv[3] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "defrag")) {
+        int line_len = snprintf(line, sizeof(line), "defrag %s %s\n", argc > 3 ? argv[3] : "",
+                                argc > 4 ? argv[4] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "scrub")) {
+        int line_len = snprintf(line, sizeof(line), "scrub %s %s\n", argc > 3 ? argv[3] : "",
+                                argc > 4 ? argv[4] : "");
+        sent = line_len < (int) sizeof(line) ? write_full(fd, line, line_len) : -1;
+    }
+    else if (!strcmp(command, "df") || !strcmp(command, "savefs")) {
+        int line_len = snprintf(line, sizeof(line), "%s\n", command);
+        sent = write_full(fd, line, line_len);
+    }
+    else {
+        usage(argv[0]);
+        close(fd);
+        return 1;
+    }
+
+    if (sent == -1) {
+        fprintf(stderr, "mfsc: failed to send request\n");
+        close(fd);
+        return 1;
+    }
+
+    // wait for the reply
+    char *body;
+    size_t len;
+    int status = read_response(fd, &body, &len);
+    close(fd);
+
+    if (status == -1) {
+        fprintf(stderr, "mfsc: connection closed by server\n");
+        return 1;
+    }
+
+    // a successful get carries the file contents, everything else carries messages
+    if (status == 0 && out_filename) {
+        FILE *fp = fopen(out_filename, "wb");
+        if (!fp) {
+            printf("get error: File not found\n");
+            free(body);
+            return 1;
+        }
+        fwrite(body, 1, len, fp);
+        fclose(fp);
+    }
+    else {
+        fwrite(body, 1, len, stdout);
+    }
+
+    free(body);
+
+    return status == 0 ? 0 : 1;
+}